@@ -0,0 +1,111 @@
+#include "../src/Net.h"
+#include <chrono>
+#include <iomanip>
+
+/**
+ * Baseline convolution: copy every receptive field into a row of an im2col matrix of shape
+ * (batchSize * outHeight * outWidth, kernelHeight * kernelWidth * inChannels) and contract it with the kernel.
+ */
+Eigen::Tensor<float, 4> im2colConvolution(const Eigen::Tensor<float, 4> &input, const Eigen::Tensor<float, 4> &weights,
+                                          const Eigen::Tensor<float, 4> &bias, int stride, int padding)
+{
+    const Eigen::Index batchSize = input.dimension(0);
+    const Eigen::Index height = input.dimension(1);
+    const Eigen::Index width = input.dimension(2);
+    const Eigen::Index kernelHeight = weights.dimension(0);
+    const Eigen::Index kernelWidth = weights.dimension(1);
+    const Eigen::Index inChannels = weights.dimension(2);
+    const Eigen::Index outChannels = weights.dimension(3);
+    const Eigen::Index outHeight = (height + 2 * padding - kernelHeight) / stride + 1;
+    const Eigen::Index outWidth = (width + 2 * padding - kernelWidth) / stride + 1;
+
+    Eigen::Tensor<float, 2> columns(batchSize * outHeight * outWidth, kernelHeight * kernelWidth * inChannels);
+    columns.setZero();
+    for (Eigen::Index ic = 0; ic < inChannels; ++ic)
+    {
+        for (Eigen::Index kw = 0; kw < kernelWidth; ++kw)
+        {
+            for (Eigen::Index kh = 0; kh < kernelHeight; ++kh)
+            {
+                const Eigen::Index column = kh + kernelHeight * (kw + kernelWidth * ic);
+                for (Eigen::Index ow = 0; ow < outWidth; ++ow)
+                {
+                    for (Eigen::Index oh = 0; oh < outHeight; ++oh)
+                    {
+                        const Eigen::Index ih = oh * stride - padding + kh;
+                        const Eigen::Index iw = ow * stride - padding + kw;
+                        if (ih < 0 || ih >= height || iw < 0 || iw >= width)
+                        {
+                            continue;
+                        }
+                        for (Eigen::Index n = 0; n < batchSize; ++n)
+                        {
+                            columns(n + batchSize * (oh + outHeight * ow), column) = input(n, ih, iw, ic);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    Eigen::Tensor<float, 2> kernel = weights.reshape(Eigen::array<Eigen::Index, 2>{kernelHeight * kernelWidth * inChannels, outChannels});
+    Eigen::array<Eigen::IndexPair<int>, 1> productDims = {Eigen::IndexPair<int>(1, 0)};
+    Eigen::Tensor<float, 2> result = columns.contract(kernel, productDims) +
+                                     bias.reshape(Eigen::array<Eigen::Index, 2>{1, outChannels})
+                                         .broadcast(Eigen::array<Eigen::Index, 2>{batchSize * outHeight * outWidth, 1});
+    return result.reshape(Eigen::array<Eigen::Index, 4>{batchSize, outHeight, outWidth, outChannels});
+}
+
+template <typename Function>
+double timeMilliseconds(Function function, int repetitions)
+{
+    function();
+    auto start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < repetitions; ++ii)
+    {
+        function();
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+int main()
+{
+    struct Case
+    {
+        int batchSize, size, inChannels, outChannels, kernel, stride, padding;
+    };
+    const std::vector<Case> cases = {{32, 28, 1, 16, 3, 1, 1},
+                                     {32, 28, 16, 32, 3, 1, 1},
+                                     {64, 14, 32, 64, 3, 1, 1},
+                                     {64, 7, 64, 64, 3, 1, 1},
+                                     {16, 32, 3, 32, 5, 2, 2}};
+    const int repetitions = 5;
+
+    std::cout << "Threads: " << nn::getNumThreads() << std::endl;
+    std::cout << std::setw(28) << "case" << std::setw(14) << "direct ms" << std::setw(14) << "im2col ms"
+              << std::setw(12) << "speedup" << std::setw(14) << "max abs diff" << std::endl;
+
+    for (const Case &c : cases)
+    {
+        Eigen::Tensor<float, 4> input(c.batchSize, c.size, c.size, c.inChannels);
+        input.setRandom();
+        nn::Conv2D<float> conv(c.inChannels, c.outChannels, c.kernel, c.kernel, c.stride, c.padding);
+
+        Eigen::Tensor<float, 4> direct, baseline;
+        double directMs = timeMilliseconds([&]()
+                                           { direct = conv.forward(input); },
+                                           repetitions);
+        double baselineMs = timeMilliseconds([&]()
+                                             { baseline = im2colConvolution(input, conv.getWeights(), conv.getBias(), c.stride, c.padding); },
+                                             repetitions);
+        Eigen::Tensor<float, 0> maxDiff = (direct - baseline).abs().maximum();
+
+        std::ostringstream name;
+        name << c.batchSize << "x" << c.size << "x" << c.size << "x" << c.inChannels << " -> " << c.outChannels
+             << " k" << c.kernel << " s" << c.stride;
+        std::cout << std::setw(28) << name.str() << std::setw(14) << directMs << std::setw(14) << baselineMs
+                  << std::setw(12) << baselineMs / directMs << std::setw(14) << maxDiff(0) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include "../src/Net.h"
+#include "../src/loss/CrossEntropy.h"
+#include <chrono>
+#include <iomanip>
+#include <sys/wait.h>
+
+/**
+ * Scaling of data-parallel training with ranks forked on this host:
+ *  - bandwidth of the ring all-reduce over shared memory and over loopback TCP
+ *  - weak scaling of training a multi-layer perceptron with a fixed batch per rank, with gradients reduced in
+ *    small buckets that overlap backward and in a single bucket after backward
+ */
+
+int nextPort = 31000;
+
+/**
+ * Run function(rank) in worldSize forked processes and wait for all of them
+ */
+template <typename Function>
+bool runRanks(int worldSize, Function function)
+{
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < worldSize; ++rank)
+    {
+        const pid_t child = fork();
+        if (child == 0)
+        {
+            _exit(function(rank));
+        }
+        children.push_back(child);
+    }
+
+    bool succeeded = true;
+    for (pid_t child : children)
+    {
+        int status;
+        waitpid(child, &status, 0);
+        succeeded = succeeded && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return succeeded;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void benchmarkAllReduce(int worldSize, bool useSharedMemory, Eigen::Index numValues)
+{
+    const int port = nextPort;
+    nextPort += worldSize;
+    runRanks(worldSize, [&](int rank)
+             {
+        nn::ProcessGroup group(rank, worldSize, port, {}, useSharedMemory);
+        if (!group.connect())
+        {
+            return 1;
+        }
+
+        std::vector<float> data(numValues, 1.0f);
+        const int repetitions = std::max<int>(3, (1 << 24) / numValues);
+        if (!group.allReduce(data.data(), numValues) || !group.barrier())
+        {
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int ii = 0; ii < repetitions; ++ii)
+        {
+            if (!group.allReduce(data.data(), numValues))
+            {
+                return 1;
+            }
+        }
+        const double seconds = secondsSince(start) / repetitions;
+
+        if (rank == 0)
+        {
+            // Bus bandwidth counts the 2 * (worldSize - 1) / worldSize of the data every rank sends
+            const double bytes = numValues * sizeof(float);
+            std::cout << std::setw(8) << (useSharedMemory ? "shm" : "tcp") << std::setw(8) << worldSize
+                      << std::setw(12) << bytes / 1024 << std::setw(12) << seconds * 1e3
+                      << std::setw(14) << bytes * 2 * (worldSize - 1) / worldSize / seconds / 1e9 << std::endl;
+        }
+        return 0; });
+}
+
+/**
+ * @return Samples per second over all ranks, measured on rank 0
+ */
+double benchmarkTraining(int worldSize, int batchSize, size_t bucketBytes, int numSteps)
+{
+    const int numFeatures = 512, numHidden = 1024, numClasses = 10;
+    const int port = nextPort;
+    nextPort += worldSize;
+
+    int pipe[2];
+    if (::pipe(pipe) != 0)
+    {
+        return 0;
+    }
+    runRanks(worldSize, [&](int rank)
+             {
+        nn::Net<float> net;
+        net.add(new nn::Dense<>(batchSize, numFeatures, numHidden, true));
+        net.add(new nn::Relu<>());
+        net.add(new nn::Dense<>(batchSize, numHidden, numHidden, true));
+        net.add(new nn::Relu<>());
+        net.add(new nn::Dense<>(batchSize, numHidden, numClasses, true));
+        net.add(new nn::Softmax<>());
+        net.registerOptimizer(new nn::Adam<float>(0.001));
+
+        if (worldSize > 1)
+        {
+            auto group = std::make_shared<nn::ProcessGroup>(rank, worldSize, port);
+            if (!group->connect() || !net.setDataParallel(new nn::DataParallel<float>(group, bucketBytes)))
+            {
+                return 1;
+            }
+        }
+
+        Eigen::Tensor<float, 2> input(batchSize, numFeatures);
+        Eigen::Tensor<float, 2> labels(batchSize, numClasses);
+        input.setRandom();
+        labels.setZero();
+        for (int ii = 0; ii < batchSize; ++ii)
+        {
+            labels(ii, ii % numClasses) = 1;
+        }
+
+        nn::CrossEntropyLoss<float, 2> lossFunc;
+        auto trainStep = [&]()
+        {
+            auto result = net.forward<2, 2>(input);
+            if (!net.backward(lossFunc.backward(result, labels)))
+            {
+                return false;
+            }
+            net.step();
+            return true;
+        };
+
+        if (!trainStep())
+        {
+            return 1;
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int ii = 0; ii < numSteps; ++ii)
+        {
+            if (!trainStep())
+            {
+                return 1;
+            }
+        }
+        const double samplesPerSecond = worldSize * batchSize * numSteps / secondsSince(start);
+        if (rank == 0 && write(pipe[1], &samplesPerSecond, sizeof(samplesPerSecond)) != sizeof(samplesPerSecond))
+        {
+            return 1;
+        }
+        return 0; });
+
+    double samplesPerSecond = 0;
+    if (read(pipe[0], &samplesPerSecond, sizeof(samplesPerSecond)) != sizeof(samplesPerSecond))
+    {
+        samplesPerSecond = 0;
+    }
+    close(pipe[0]);
+    close(pipe[1]);
+    return samplesPerSecond;
+}
+
+int main()
+{
+    std::cout << std::fixed << std::setprecision(3);
+
+    std::cout << "Ring all-reduce of float buffers" << std::endl;
+    std::cout << std::setw(8) << "link" << std::setw(8) << "ranks" << std::setw(12) << "KiB"
+              << std::setw(12) << "ms" << std::setw(14) << "bus GB/s" << std::endl;
+    for (bool useSharedMemory : {true, false})
+    {
+        for (int worldSize : {2, 4})
+        {
+            for (Eigen::Index numValues : {Eigen::Index(1) << 14, Eigen::Index(1) << 18, Eigen::Index(1) << 22})
+            {
+                benchmarkAllReduce(worldSize, useSharedMemory, numValues);
+            }
+        }
+    }
+
+    const int batchSize = 64, numSteps = 20;
+    std::cout << std::endl
+              << "Weak scaling, 512-1024-1024-10 MLP, batch " << batchSize << " per rank, shared memory" << std::endl;
+    // Efficiency is relative to worldSize independent single-rank runs, so it cannot exceed cores / ranks
+    std::cout << "Ranks share " << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+    std::cout << std::setw(8) << "ranks" << std::setw(22) << "overlapped samples/s" << std::setw(12) << "efficiency"
+              << std::setw(22) << "after backward" << std::setw(12) << "efficiency" << std::endl;
+    double singleRate = 0;
+    for (int worldSize : {1, 2, 4})
+    {
+        // 1 MiB buckets overlap backward, one bucket larger than the model reduces only after backward
+        const double overlapped = benchmarkTraining(worldSize, batchSize, 1 << 20, numSteps);
+        const double afterBackward = benchmarkTraining(worldSize, batchSize, size_t(1) << 30, numSteps);
+        if (worldSize == 1)
+        {
+            singleRate = overlapped;
+        }
+        std::cout << std::setw(8) << worldSize << std::setw(22) << overlapped << std::setw(12) << overlapped / (worldSize * singleRate)
+                  << std::setw(22) << afterBackward << std::setw(12) << afterBackward / (worldSize * singleRate) << std::endl;
+    }
+    return 0;
+}
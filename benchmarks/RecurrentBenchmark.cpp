@@ -0,0 +1,124 @@
+#include "../src/Net.h"
+#include <chrono>
+#include <iomanip>
+
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+
+/**
+ * Baseline LSTM forward without fusion: every timestep projects its own input and runs a separate pair of
+ * matmuls for each of the four gates. Like a training forward it keeps the activated gates of every timestep
+ * for backward, in the preallocated (4 * hiddenSize, batchSize * timeSteps) buffer gateCache.
+ */
+Eigen::Tensor<float, 3> unfusedLstmForward(const Eigen::Tensor<float, 3> &input, const Eigen::Tensor<float, 2> &inputWeights,
+                                           const Eigen::Tensor<float, 2> &recurrentWeights, Matrix &gateCache)
+{
+    const Eigen::Index batchSize = input.dimension(0);
+    const Eigen::Index timeSteps = input.dimension(1);
+    const Eigen::Index inputSize = input.dimension(2);
+    const Eigen::Index hiddenSize = recurrentWeights.dimension(0);
+    Eigen::Map<const Matrix> weights(inputWeights.data(), inputSize, 4 * hiddenSize);
+    Eigen::Map<const Matrix> recurrent(recurrentWeights.data(), hiddenSize, 4 * hiddenSize);
+
+    Eigen::Tensor<float, 3> output(batchSize, timeSteps, hiddenSize);
+    Matrix x(batchSize, inputSize), hidden = Matrix::Zero(batchSize, hiddenSize), cell = Matrix::Zero(batchSize, hiddenSize);
+    Matrix gates[4];
+    for (Eigen::Index t = 0; t < timeSteps; ++t)
+    {
+        for (Eigen::Index f = 0; f < inputSize; ++f)
+        {
+            for (Eigen::Index n = 0; n < batchSize; ++n)
+            {
+                x(n, f) = input(n, t, f);
+            }
+        }
+
+        for (int gate = 0; gate < 4; ++gate)
+        {
+            gates[gate] = x * weights.middleCols(gate * hiddenSize, hiddenSize) +
+                          hidden * recurrent.middleCols(gate * hiddenSize, hiddenSize);
+        }
+        cell = (gates[1].array().logistic() * cell.array() +
+                gates[0].array().logistic() * gates[2].array().tanh())
+                   .matrix();
+        hidden = (gates[3].array().logistic() * cell.array().tanh()).matrix();
+
+        for (int gate = 0; gate < 4; ++gate)
+        {
+            gateCache.block(gate * hiddenSize, batchSize * t, hiddenSize, batchSize) = gates[gate].transpose();
+        }
+
+        for (Eigen::Index h = 0; h < hiddenSize; ++h)
+        {
+            for (Eigen::Index n = 0; n < batchSize; ++n)
+            {
+                output(n, t, h) = hidden(n, h);
+            }
+        }
+    }
+    return output;
+}
+
+template <typename Function>
+double timeMilliseconds(Function function, int repetitions)
+{
+    function();
+    auto start = std::chrono::steady_clock::now();
+    for (int ii = 0; ii < repetitions; ++ii)
+    {
+        function();
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / repetitions;
+}
+
+template <typename LayerType>
+void benchmarkLayer(const std::string &name, int batchSize, int timeSteps, int inputSize, int hiddenSize, int repetitions)
+{
+    LayerType layer(inputSize, hiddenSize);
+    Eigen::Tensor<float, 3> input(batchSize, timeSteps, inputSize);
+    input.setRandom();
+    Eigen::Tensor<float, 3> grad(batchSize, timeSteps, hiddenSize);
+    grad.setRandom();
+
+    Eigen::Tensor<float, 3> output;
+    double forwardMs = timeMilliseconds([&]()
+                                        { output = layer.forward(input); },
+                                        repetitions);
+    double trainMs = timeMilliseconds([&]()
+                                      { output = layer.forward(input); layer.backward(grad); },
+                                      repetitions);
+
+    std::cout << std::setw(6) << name << std::setw(8) << timeSteps << std::setw(14) << forwardMs
+              << std::setw(14) << trainMs << std::setw(18) << batchSize * timeSteps / (trainMs / 1000);
+    if (name == "LSTM")
+    {
+        Eigen::Tensor<float, 3> baseline;
+        Matrix gateCache(4 * hiddenSize, batchSize * timeSteps);
+        double baselineMs = timeMilliseconds([&]()
+                                             { baseline = unfusedLstmForward(input, layer.getInputWeights(), layer.getRecurrentWeights(), gateCache); },
+                                             repetitions);
+        // The baseline starts with a zero bias, the layer opens its forget gate, so compare timings only
+        std::cout << std::setw(16) << baselineMs << std::setw(10) << baselineMs / forwardMs;
+    }
+    std::cout << std::endl;
+}
+
+int main()
+{
+    const int batchSize = 32;
+    const int inputSize = 64;
+    const int hiddenSize = 128;
+    const int repetitions = 5;
+
+    std::cout << "Batch " << batchSize << ", input " << inputSize << ", hidden " << hiddenSize << std::endl;
+    std::cout << std::setw(6) << "layer" << std::setw(8) << "steps" << std::setw(14) << "forward ms"
+              << std::setw(14) << "fwd+bwd ms" << std::setw(18) << "train steps/s"
+              << std::setw(16) << "unfused fwd ms" << std::setw(10) << "speedup" << std::endl;
+
+    for (int timeSteps : {8, 32, 128, 512})
+    {
+        benchmarkLayer<nn::LSTM<float>>("LSTM", batchSize, timeSteps, inputSize, hiddenSize, repetitions);
+        benchmarkLayer<nn::GRU<float>>("GRU", batchSize, timeSteps, inputSize, hiddenSize, repetitions);
+    }
+    return 0;
+}
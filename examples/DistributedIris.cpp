@@ -0,0 +1,167 @@
+#include "../src/Net.h"
+#include "../src/loss/CrossEntropy.h"
+#include <fstream>
+#include <boost/algorithm/string.hpp>
+#include <map>
+#include <iomanip>
+#include <sys/wait.h>
+
+/**
+ * Data-parallel training on the Iris dataset: every rank trains on every worldSize-th sample and the
+ * gradients are averaged over the ranks after each backward pass.
+ *
+ * Usage:
+ *   distributed_iris [worldSize]                      Fork worldSize ranks on this host, 2 by default
+ *   distributed_iris worldSize rank [host0 host1 ...] Run a single rank, e.g. one per machine
+ */
+
+const std::map<std::string, int> IRIS_TYPE_TO_INT{
+    {"Iris-setosa", 0},
+    {"Iris-versicolor", 1},
+    {"Iris-virginica", 2}};
+
+const int BASE_PORT = 29500;
+
+struct IrisDataset
+{
+    std::vector<std::array<float, 4>> data;
+    std::vector<int> labels;
+};
+
+IrisDataset loadIrisDataset(const std::string &path = "../examples/data/iris_data.csv")
+{
+    IrisDataset dataset;
+
+    std::ifstream irisFile(path);
+    std::string line;
+    while (std::getline(irisFile, line, '\n'))
+    {
+        std::vector<std::string> values;
+
+        boost::split(values, line, [](char c)
+                     { return c == ','; });
+
+        if (values.size() < 5)
+        {
+            continue;
+        }
+
+        auto labelIter = IRIS_TYPE_TO_INT.find(values[4]);
+        if (labelIter == IRIS_TYPE_TO_INT.end())
+        {
+            std::cerr << "Unknown Iris type of: " << values[4] << " please check dataset." << std::endl;
+            exit(-1);
+        }
+        dataset.data.push_back({std::stof(values[0]), std::stof(values[1]), std::stof(values[2]), std::stof(values[3])});
+        dataset.labels.push_back(labelIter->second);
+    }
+
+    return dataset;
+}
+
+int runRank(int rank, int worldSize, const std::vector<std::string> &hosts)
+{
+    auto dataset = loadIrisDataset();
+    if (dataset.labels.empty() || dataset.labels.size() % worldSize != 0)
+    {
+        std::cerr << "The " << dataset.labels.size() << " samples cannot be split evenly over " << worldSize << " ranks" << std::endl;
+        return 1;
+    }
+
+    // The samples are sorted by class, so take every worldSize-th one to give each rank all classes
+    int batchSize = dataset.labels.size() / worldSize;
+    int numFeatures = dataset.data[0].size();
+    int numClasses = *std::max_element(dataset.labels.begin(), dataset.labels.end()) + 1;
+
+    Eigen::Tensor<float, 2> input(batchSize, numFeatures);
+    Eigen::Tensor<float, 2> labels(batchSize, numClasses);
+    labels.setZero();
+    for (int ii = 0; ii < batchSize; ++ii)
+    {
+        const int sample = ii * worldSize + rank;
+        for (int feature = 0; feature < numFeatures; ++feature)
+        {
+            input(ii, feature) = dataset.data[sample][feature];
+        }
+        labels(ii, dataset.labels[sample]) = 1.0;
+    }
+
+    int numHiddenNodes = 20;
+    bool useBias = true;
+
+    nn::Net<float> net;
+    net.add(new nn::Dense<>(batchSize, numFeatures, numHiddenNodes, useBias));
+    net.add(new nn::Relu<>());
+    net.add(new nn::Dense<>(batchSize, numHiddenNodes, numHiddenNodes, useBias));
+    net.add(new nn::Relu<>());
+    net.add(new nn::Dense<>(batchSize, numHiddenNodes, numClasses, useBias));
+    net.add(new nn::Softmax<>());
+    net.registerOptimizer(new nn::Adam<float>(0.01));
+
+    auto group = std::make_shared<nn::ProcessGroup>(rank, worldSize, BASE_PORT, hosts);
+    if (!group->connect() || !net.setDataParallel(new nn::DataParallel<float>(group)))
+    {
+        std::cerr << "Rank " << rank << " could not join the process group" << std::endl;
+        return 1;
+    }
+
+    nn::CrossEntropyLoss<float, 2> lossFunc;
+    int numEpoch = 250;
+    float loss, accuracy;
+    for (int ii = 0; ii < numEpoch; ++ii)
+    {
+        auto result = net.forward<2, 2>(input);
+        loss = lossFunc.loss(result, labels);
+        accuracy = lossFunc.accuracy(result, labels);
+        if (rank == 0 && ii % 50 == 0)
+        {
+            std::cout << std::setprecision(5) << "Epoch: " << ii << " loss: " << loss << " accuracy: " << accuracy << std::endl;
+        }
+
+        if (!net.backward(lossFunc.backward(result, labels)))
+        {
+            std::cerr << "Rank " << rank << " lost the other ranks" << std::endl;
+            return 1;
+        }
+        net.step();
+    }
+
+    // Every rank holds the same weights, so each reports how they do on its own shard
+    std::cout << "Rank " << rank << " final loss: " << loss << " accuracy: " << accuracy << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const int worldSize = argc > 1 ? std::atoi(argv[1]) : 2;
+    if (worldSize < 1)
+    {
+        std::cerr << "The world size has to be positive" << std::endl;
+        return 1;
+    }
+
+    if (argc > 2)
+    {
+        return runRank(std::atoi(argv[2]), worldSize, std::vector<std::string>(argv + 3, argv + argc));
+    }
+
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < worldSize; ++rank)
+    {
+        const pid_t child = fork();
+        if (child == 0)
+        {
+            _exit(runRank(rank, worldSize, {}));
+        }
+        children.push_back(child);
+    }
+
+    int failures = 0;
+    for (pid_t child : children)
+    {
+        int status;
+        waitpid(child, &status, 0);
+        failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -1,11 +1,15 @@
 #pragma once
 
+#include "distributed/DataParallel.h"
 #include "layers/Layers.h"
 #include "loss/Losses.h"
 #include "optimizers/Optimizers.h"
+#include "utils/Checkpoint.h"
+#include "utils/MemoryUsage.h"
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 namespace nn
 {
@@ -25,54 +29,157 @@ namespace nn
                 return {};
             }
 
-            auto currentInput = input;
-            for (const auto &layer : m_layers)
+            if (m_estimatePeak)
             {
-                currentInput = layer->forward(currentInput);
+                refreshPersistentBytes();
             }
-            return currentInput;
+
+            Activation<Dtype> currentInput(std::move(input));
+            for (size_t ii = 0; ii < m_layers.size(); ++ii)
+            {
+                auto output = m_layers[ii]->forwardActivation(currentInput);
+                if (m_estimatePeak)
+                {
+                    updatePeakEstimate(ii, inFlightBytes(currentInput, output));
+                }
+                currentInput = std::move(output);
+            }
+            return currentInput.template release<outputDim>();
         }
 
+        /**
+         * Backpropagate the gradient of the loss through every layer, averaging the weight gradients over the
+         * ranks if the network trains data-parallel
+         * @return false if there is no optimizer or layer, or the gradients could not be averaged. A failed
+         * average breaks the process group, so every later call fails as well and training has to stop.
+         */
         template <int labelDims>
-        void backward(Eigen::Tensor<Dtype, labelDims> input)
+        bool backward(Eigen::Tensor<Dtype, labelDims> input)
         {
-            if (!m_hasOptimizer)
+            if (!m_optimizer)
             {
                 std::cerr << "No registered optimizer" << std::endl;
-                return;
+                return false;
             }
 
             if (m_layers.empty())
             {
                 std::cerr << "No layers specified" << std::endl;
-                return;
+                return false;
+            }
+
+            if (m_estimatePeak)
+            {
+                refreshPersistentBytes();
             }
 
-            auto accumulatedGrad = input;
+            Activation<Dtype> accumulatedGrad(std::move(input));
             for (auto rit = m_layers.rbegin(); rit != m_layers.rend(); ++rit)
             {
-                accumulatedGrad = (*rit)->backward(accumulatedGrad);
+                auto inputGrad = (*rit)->backwardActivation(accumulatedGrad);
+                if (m_estimatePeak)
+                {
+                    updatePeakEstimate(std::distance(rit, m_layers.rend()) - 1, inFlightBytes(accumulatedGrad, inputGrad));
+                }
+                accumulatedGrad = std::move(inputGrad);
+
+                // Reduce the gradients of this layer across ranks while the earlier layers run backward
+                if (m_dataParallel)
+                {
+                    m_dataParallel->gradientsReady(**rit);
+                }
             }
+
+            if (m_dataParallel && !m_dataParallel->synchronize())
+            {
+                std::cerr << "Reducing the gradients across ranks failed" << std::endl;
+                return false;
+            }
+            return true;
         }
 
-        void registerOptimizer(nn::StochasticGradientDescent<Dtype> *optimizer)
+        /**
+         * Register the optimizer with every layer added so far. Takes ownership.
+         */
+        void registerOptimizer(nn::Optimizer<Dtype> *optimizer)
         {
-            m_hasOptimizer = true;
-            std::shared_ptr<nn::StochasticGradientDescent<Dtype>> optimizerPtr(optimizer);
+            m_optimizer.reset(optimizer);
             for (auto &layer : m_layers)
             {
-                layer->registerOptimizer(optimizerPtr);
+                layer->registerOptimizer(m_optimizer);
             }
         }
 
-        void registerOptimizer(nn::Adam<Dtype> *optimizer)
+        /**
+         * Train data-parallel: backward averages the gradients over the ranks of the process group, which must be
+         * connected. Copies the weights of rank 0 to every rank, so add all layers first. Takes ownership.
+         * @return false if the weights could not be broadcast
+         */
+        bool setDataParallel(DataParallel<Dtype> *dataParallel)
         {
-            m_hasOptimizer = true;
-            std::shared_ptr<nn::Adam<Dtype>> optimizerPtr(optimizer);
+            m_dataParallel.reset(dataParallel);
+            return m_dataParallel->broadcastParameters(m_layers);
+        }
+
+        /**
+         * Switch every layer between training and inference behaviour
+         * @return false if training is asked for after foldBatchNorm(), the network then stays in inference
+         */
+        bool setTraining(bool training)
+        {
+            for (const auto &layer : m_layers)
+            {
+                auto batchNorm = dynamic_cast<BatchNorm<Dtype> *>(layer.get());
+                if (training && batchNorm && batchNorm->isFolded())
+                {
+                    std::cerr << "A network with folded BatchNorm layers cannot be trained" << std::endl;
+                    return false;
+                }
+            }
+
             for (auto &layer : m_layers)
             {
-                layer->registerOptimizer(optimizerPtr);
+                layer->setTraining(training);
             }
+            return true;
+        }
+
+        /**
+         * Fold every BatchNorm that directly follows a Dense layer with a bias into that layer's weights and bias.
+         * A Dense layer without a bias is left alone, with its BatchNorm unfolded, so that the parameters and the
+         * checkpoint layout of every layer stay the same. For inference only: call setTraining(false) first.
+         * The folded Dense layers drop their optimizer state, and the network cannot be switched back to training.
+         * @return The number of BatchNorm layers folded, -1 if the network is in training mode
+         */
+        int foldBatchNorm()
+        {
+            for (const auto &layer : m_layers)
+            {
+                if (layer->isTraining())
+                {
+                    std::cerr << "foldBatchNorm needs a network in inference mode, call setTraining(false) first" << std::endl;
+                    return -1;
+                }
+            }
+
+            int numFolded = 0;
+            for (size_t ii = 1; ii < m_layers.size(); ++ii)
+            {
+                auto batchNorm = dynamic_cast<BatchNorm<Dtype> *>(m_layers[ii].get());
+                auto dense = dynamic_cast<Dense<Dtype> *>(m_layers[ii - 1].get());
+                if (!batchNorm || !dense || batchNorm->isFolded())
+                {
+                    continue;
+                }
+                if (!dense->usesBias())
+                {
+                    std::cerr << "Not folding BatchNorm into a Dense layer without a bias" << std::endl;
+                    continue;
+                }
+                batchNorm->foldInto(*dense);
+                numFolded++;
+            }
+            return numFolded;
         }
 
         void step()
@@ -81,12 +188,143 @@ namespace nn
             {
                 layer->step();
             }
+
+            if (m_optimizer)
+            {
+                m_optimizer->advance();
+            }
         }
 
-        template <int Dims>
-        Net<Dtype> &add(std::unique_ptr<Layer<Dtype, Dims>> layer)
+        /**
+         * Copy the weights and optimizer state of every layer into the snapshot.
+         * The copy is cheap compared to serialization, so the snapshot can be handed to a
+         * CheckpointWriter and written while training continues.
+         */
+        void saveState(Snapshot<Dtype> &snapshot) const
+        {
+            snapshot.addInteger("Net.numLayers", m_layers.size());
+            for (const auto &layer : m_layers)
+            {
+                layer->saveState(snapshot);
+            }
+            snapshot.addInteger("Net.optimizerStep", m_optimizer ? m_optimizer->getStep() : 0);
+        }
+
+        /**
+         * Restore the weights and optimizer state of every layer from the snapshot.
+         * The network must have the same layers, and the same optimizer registered, as when it was saved.
+         * Reads the snapshot from its start, so the same snapshot can be loaded any number of times.
+         * If the snapshot does not match, the network is left as it was before the call.
+         */
+        bool loadState(Snapshot<Dtype> &snapshot)
+        {
+            // Layers restore one after the other, so keep the current state to roll back to on a mismatch
+            Snapshot<Dtype> previous;
+            saveState(previous);
+            if (restoreState(snapshot))
+            {
+                return true;
+            }
+
+            if (!restoreState(previous))
+            {
+                std::cerr << "Failed to roll back the network after an incompatible snapshot" << std::endl;
+            }
+            return false;
+        }
+
+        bool saveCheckpoint(const std::string &path, const TrainingProgress &progress = TrainingProgress()) const
+        {
+            Snapshot<Dtype> snapshot;
+            snapshot.setProgress(progress);
+            saveState(snapshot);
+            return snapshot.save(path);
+        }
+
+        bool loadCheckpoint(const std::string &path, TrainingProgress &progress)
+        {
+            Snapshot<Dtype> snapshot;
+            if (!snapshot.load(path) || !loadState(snapshot))
+            {
+                return false;
+            }
+            progress = snapshot.getProgress();
+            return true;
+        }
+
+        /**
+         * Report the memory currently held by every layer. With peak estimation enabled, the report also holds the
+         * estimated peak during forward and backward since estimation started or the last resetPeakEstimate().
+         */
+        MemoryReport memoryReport() const
+        {
+            MemoryReport report;
+            for (const auto &layer : m_layers)
+            {
+                report.layerNames.push_back(layer->getName());
+                report.layers.push_back(layer->memoryUsage());
+                report.total += report.layers.back();
+            }
+            report.estimatedPeakBytes = m_estimatedPeakBytes;
+            return report;
+        }
+
+        /**
+         * Predict the memory a training step will need for the given batch size, before any data is seen.
+         * Register the optimizer first so that its state is accounted for. Optimizers allocate their state in the
+         * first step, so the predicted peak is the one tracked from the second step on.
+         */
+        MemoryReport predictMemoryUsage(int batchSize, int inputDimension) const
+        {
+            return predictMemoryUsage({batchSize, inputDimension});
+        }
+
+        /**
+         * Predict the memory a training step will need for an input of the given shape, of any rank
+         */
+        MemoryReport predictMemoryUsage(const std::vector<Eigen::Index> &inputShape) const
+        {
+            MemoryReport report;
+            std::vector<Eigen::Index> shape = inputShape;
+            size_t largestInFlight = 0;
+            for (const auto &layer : m_layers)
+            {
+                const size_t inputBytes = shapeBytes<Dtype>(shape);
+                report.layerNames.push_back(layer->getName());
+                report.layers.push_back(layer->predictActivationMemory(shape));
+                report.total += report.layers.back();
+
+                // Each layer boundary holds the layer's input and output (or their gradients) at once,
+                // unless the layer passes its input through and its output shares the buffer of its input
+                const size_t outputBytes = layer->passesThrough() ? 0 : shapeBytes<Dtype>(shape);
+                largestInFlight = std::max(largestInFlight, inputBytes + outputBytes);
+            }
+            report.estimatedPeakBytes = report.total.persistentBytes() + largestInFlight;
+            return report;
+        }
+
+        /**
+         * Estimate the peak memory of forward and backward as they run, off by default. This is an estimate from
+         * the per-layer accounting, not a measurement of allocations: it adds the persistent bytes every layer
+         * reports to the tensors passed between two layers, at every layer boundary. Temporaries that live only
+         * inside a layer call, and allocations outside the layers, are not seen, so the real peak is higher.
+         */
+        void setPeakEstimation(bool enabled)
+        {
+            m_estimatePeak = enabled;
+        }
+
+        /**
+         * Start the peak estimate over, e.g. to estimate the peak of a later step only
+         */
+        void resetPeakEstimate()
+        {
+            m_estimatedPeakBytes = 0;
+        }
+
+        Net<Dtype> &add(std::unique_ptr<LayerBase<Dtype>> layer)
         {
-            m_layers.push_back(layer);
+            m_layers.push_back(std::move(layer));
             return *this;
         }
 
@@ -94,27 +332,166 @@ namespace nn
         Net<Dtype> &add(Dense<Dtype, Dims> *denseLayer)
         {
             // Do shape checks here
-            m_layers.push_back(std::unique_ptr<Layer<Dtype, Dims>>(denseLayer));
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(denseLayer));
             return *this;
         }
 
         template <int Dims>
         Net<Dtype> &add(Relu<Dtype, Dims> *reluLayer)
         {
-            m_layers.push_back(std::unique_ptr<Layer<Dtype, Dims>>(reluLayer));
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(reluLayer));
             return *this;
         }
 
         template <int Dims>
         Net<Dtype> &add(Softmax<Dtype, Dims> *softmaxLayer)
         {
-            m_layers.push_back(std::unique_ptr<Layer<Dtype, Dims>>(softmaxLayer));
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(softmaxLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(BatchNorm<Dtype, Dims> *batchNormLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(batchNormLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(LayerNorm<Dtype, Dims> *layerNormLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(layerNormLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(Dropout<Dtype, Dims> *dropoutLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(dropoutLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(Conv2D<Dtype, Dims> *convLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(convLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(MaxPool2D<Dtype, Dims> *poolLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(poolLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(AvgPool2D<Dtype, Dims> *poolLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(poolLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(LSTM<Dtype, Dims> *lstmLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(lstmLayer));
+            return *this;
+        }
+
+        template <int Dims>
+        Net<Dtype> &add(GRU<Dtype, Dims> *gruLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(gruLayer));
+            return *this;
+        }
+
+        Net<Dtype> &add(Flatten<Dtype> *flattenLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(flattenLayer));
+            return *this;
+        }
+
+        Net<Dtype> &add(Reshape<Dtype> *reshapeLayer)
+        {
+            m_layers.push_back(std::unique_ptr<LayerBase<Dtype>>(reshapeLayer));
             return *this;
         }
 
     private:
-        std::vector<std::unique_ptr<Layer<Dtype>>> m_layers;
-        bool m_hasOptimizer;
+        bool restoreState(Snapshot<Dtype> &snapshot)
+        {
+            snapshot.rewind();
+            uint64_t numLayers;
+            if (!snapshot.readInteger("Net.numLayers", numLayers) || numLayers != m_layers.size())
+            {
+                std::cerr << "Snapshot does not match the number of layers in the network" << std::endl;
+                return false;
+            }
+
+            for (auto &layer : m_layers)
+            {
+                if (!layer->loadState(snapshot))
+                {
+                    std::cerr << "Failed to restore layer: " << layer->getName() << std::endl;
+                    return false;
+                }
+            }
+
+            // Resume the learning rate schedule where it left off, files older than version 2 start it over
+            uint64_t optimizerStep = 0;
+            if (snapshot.getVersion() >= 2 && !snapshot.readInteger("Net.optimizerStep", optimizerStep))
+            {
+                return false;
+            }
+            if (m_optimizer)
+            {
+                m_optimizer->setStep(optimizerStep);
+            }
+            return true;
+        }
+
+        /**
+         * Bytes held by a layer's input and output, counting a buffer they share once
+         */
+        static size_t inFlightBytes(const Activation<Dtype> &input, const Activation<Dtype> &output)
+        {
+            return input.data() == output.data() ? tensorBytes(input) : tensorBytes(input) + tensorBytes(output);
+        }
+
+        /**
+         * Recount the persistent bytes of every layer, which step() and loadState() may have changed
+         */
+        void refreshPersistentBytes()
+        {
+            m_layerPersistentBytes.resize(m_layers.size());
+            m_persistentBytes = 0;
+            for (size_t ii = 0; ii < m_layers.size(); ++ii)
+            {
+                m_layerPersistentBytes[ii] = m_layers[ii]->memoryUsage().persistentBytes();
+                m_persistentBytes += m_layerPersistentBytes[ii];
+            }
+        }
+
+        /**
+         * Update the peak with everything the layers hold plus the tensors passed between two of them.
+         * Only the layer that just ran changed what it holds, so only that layer is recounted.
+         */
+        void updatePeakEstimate(size_t layerIndex, size_t inFlightBytes)
+        {
+            const size_t layerBytes = m_layers[layerIndex]->memoryUsage().persistentBytes();
+            m_persistentBytes = m_persistentBytes - m_layerPersistentBytes[layerIndex] + layerBytes;
+            m_layerPersistentBytes[layerIndex] = layerBytes;
+            m_estimatedPeakBytes = std::max(m_estimatedPeakBytes, m_persistentBytes + inFlightBytes);
+        }
+
+        std::vector<std::unique_ptr<LayerBase<Dtype>>> m_layers;
+        std::shared_ptr<Optimizer<Dtype>> m_optimizer; ///< Shared with every layer, advances the learning rate schedule
+        std::unique_ptr<DataParallel<Dtype>> m_dataParallel; ///< Reduces gradients across ranks, if set
+        bool m_estimatePeak = false;            ///< Whether forward and backward update the peak estimate
+        std::vector<size_t> m_layerPersistentBytes; ///< Persistent bytes of every layer at its last boundary
+        size_t m_persistentBytes = 0;               ///< Sum of m_layerPersistentBytes
+        size_t m_estimatedPeakBytes = 0;            ///< Highest estimate of the bytes alive during forward or backward
     };
 }
 
@@ -0,0 +1,459 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nn
+{
+    /**
+     * One direction of a link between two processes. Transfers never block, so a process can send to one
+     * neighbour while it receives from another without either side waiting on the other.
+     */
+    class Channel
+    {
+    public:
+        virtual ~Channel() = default;
+
+        /**
+         * @return The number of bytes sent, possibly 0, or -1 if the link failed
+         */
+        virtual ssize_t trySend(const char *data, size_t size) = 0;
+
+        /**
+         * @return The number of bytes received, possibly 0, or -1 if the link failed
+         */
+        virtual ssize_t tryReceive(char *data, size_t size) = 0;
+
+        /**
+         * @return A file descriptor to poll for progress, or -1 if the channel has to be polled by retrying
+         */
+        virtual int descriptor() const = 0;
+    };
+
+    /**
+     * A TCP connection, used between processes on different hosts
+     */
+    class TcpChannel : public Channel
+    {
+    public:
+        explicit TcpChannel(int socket) : m_socket(socket) {}
+
+        TcpChannel(const TcpChannel &) = delete;
+
+        TcpChannel &operator=(const TcpChannel &) = delete;
+
+        ~TcpChannel()
+        {
+            close(m_socket);
+        }
+
+        ssize_t trySend(const char *data, size_t size)
+        {
+            const ssize_t sent = send(m_socket, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+            }
+            return sent;
+        }
+
+        ssize_t tryReceive(char *data, size_t size)
+        {
+            const ssize_t received = recv(m_socket, data, size, MSG_DONTWAIT);
+            if (received < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+            }
+            // An orderly shutdown in the middle of a transfer means the peer is gone
+            return received == 0 ? -1 : received;
+        }
+
+        int descriptor() const
+        {
+            return m_socket;
+        }
+
+    private:
+        int m_socket;
+    };
+
+    /**
+     * A single-producer single-consumer ring buffer in POSIX shared memory, used between processes on the
+     * same host instead of going through the loopback TCP stack.
+     *
+     * The ring cannot tell that the peer process is gone. The TCP connection the link was set up over can,
+     * since the kernel closes it when the peer exits, so it is kept and checked whenever the ring is stuck.
+     */
+    class SharedMemoryChannel : public Channel
+    {
+    public:
+        static const size_t CAPACITY = 1 << 22; ///< Bytes of the ring buffer, a power of two
+
+        SharedMemoryChannel(const SharedMemoryChannel &) = delete;
+
+        SharedMemoryChannel &operator=(const SharedMemoryChannel &) = delete;
+
+        ~SharedMemoryChannel()
+        {
+            munmap(m_ring, sizeof(Ring));
+            if (!m_name.empty())
+            {
+                shm_unlink(m_name.c_str());
+            }
+        }
+
+        /**
+         * Create the segment on the sending side. The channel unlinks it when destroyed, unless handOver() was
+         * called, so a link that fails to set up leaves no segment behind.
+         * @return nullptr on failure
+         */
+        static SharedMemoryChannel *create(const std::string &name)
+        {
+            shm_unlink(name.c_str());
+            const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+            if (fd < 0 || ftruncate(fd, sizeof(Ring)) != 0)
+            {
+                std::cerr << "Could not create shared memory segment " << name << ": " << std::strerror(errno) << std::endl;
+                if (fd >= 0)
+                {
+                    close(fd);
+                    shm_unlink(name.c_str());
+                }
+                return nullptr;
+            }
+
+            Ring *ring = map(fd);
+            if (ring == nullptr)
+            {
+                shm_unlink(name.c_str());
+                return nullptr;
+            }
+            new (&ring->head) std::atomic<uint64_t>(0);
+            new (&ring->tail) std::atomic<uint64_t>(0);
+            return new SharedMemoryChannel(ring, name);
+        }
+
+        /**
+         * Attach to a segment created by the sending side and unlink it, so it disappears with the processes
+         * @return nullptr on failure
+         */
+        static SharedMemoryChannel *open(const std::string &name)
+        {
+            const int fd = shm_open(name.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+            if (fd < 0)
+            {
+                std::cerr << "Could not open shared memory segment " << name << ": " << std::strerror(errno) << std::endl;
+                return nullptr;
+            }
+            Ring *ring = map(fd);
+            shm_unlink(name.c_str());
+            return ring != nullptr ? new SharedMemoryChannel(ring) : nullptr;
+        }
+
+        /**
+         * Leave the segment to the receiving side, which unlinked it when it attached
+         */
+        void handOver()
+        {
+            m_name.clear();
+        }
+
+        /**
+         * Watch the connection the link was set up over for the peer exiting. No data moves over it anymore.
+         */
+        void watchPeer(std::unique_ptr<TcpChannel> connection)
+        {
+            m_peer = std::move(connection);
+        }
+
+        ssize_t trySend(const char *data, size_t size)
+        {
+            const uint64_t head = m_ring->head.load(std::memory_order_relaxed);
+            const uint64_t tail = m_ring->tail.load(std::memory_order_acquire);
+            const size_t count = std::min<size_t>(size, CAPACITY - (head - tail));
+            if (count == 0 && size > 0)
+            {
+                return peerExited() ? -1 : 0;
+            }
+            copyWrapped(m_ring->data, head, data, count);
+            m_ring->head.store(head + count, std::memory_order_release);
+            return count;
+        }
+
+        ssize_t tryReceive(char *data, size_t size)
+        {
+            const uint64_t tail = m_ring->tail.load(std::memory_order_relaxed);
+            const uint64_t head = m_ring->head.load(std::memory_order_acquire);
+            const size_t count = std::min<size_t>(size, head - tail);
+            if (count == 0 && size > 0)
+            {
+                // Data the peer wrote before exiting is still read, only an empty ring reports it gone
+                return peerExited() ? -1 : 0;
+            }
+            const size_t offset = tail & (CAPACITY - 1);
+            const size_t first = std::min(count, CAPACITY - offset);
+            std::memcpy(data, m_ring->data + offset, first);
+            std::memcpy(data + first, m_ring->data, count - first);
+            m_ring->tail.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+        int descriptor() const
+        {
+            return -1;
+        }
+
+    private:
+        struct Ring
+        {
+            std::atomic<uint64_t> head; ///< Bytes written by the producer so far
+            char headPadding[64 - sizeof(std::atomic<uint64_t>)];
+            std::atomic<uint64_t> tail; ///< Bytes read by the consumer so far
+            char tailPadding[64 - sizeof(std::atomic<uint64_t>)];
+            char data[CAPACITY];
+        };
+
+        static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory channels need lock-free 64 bit atomics");
+
+        explicit SharedMemoryChannel(Ring *ring, std::string name = std::string()) : m_ring(ring), m_name(std::move(name)) {}
+
+        /**
+         * Whether the watched connection was closed, which only happens when the peer exits
+         */
+        bool peerExited()
+        {
+            char unused;
+            return m_peer && m_peer->tryReceive(&unused, 1) < 0;
+        }
+
+        static Ring *map(int fd)
+        {
+            void *address = mmap(nullptr, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (address == MAP_FAILED)
+            {
+                std::cerr << "Could not map shared memory segment: " << std::strerror(errno) << std::endl;
+                return nullptr;
+            }
+            return static_cast<Ring *>(address);
+        }
+
+        static void copyWrapped(char *ring, uint64_t position, const char *data, size_t count)
+        {
+            const size_t offset = position & (CAPACITY - 1);
+            const size_t first = std::min(count, CAPACITY - offset);
+            std::memcpy(ring + offset, data, first);
+            std::memcpy(ring, data + first, count - first);
+        }
+
+        Ring *m_ring;
+        std::string m_name;                 ///< The segment to unlink when destroyed, empty once the receiver has it
+        std::unique_ptr<TcpChannel> m_peer; ///< The connection the link was set up over, if watched
+    };
+
+    namespace internal
+    {
+        const int SPIN_ROUNDS = 256;                    ///< Idle rounds spent yielding before sleeping
+        const std::chrono::microseconds MIN_BACKOFF(2); ///< First sleep after spinning
+        const int MAX_BACKOFF_DOUBLINGS = 9;            ///< Sleeps double up to MIN_BACKOFF * 512, about 1 ms
+
+        /**
+         * Send sendSize bytes on output while receiving receiveSize bytes on input, making progress on whichever
+         * is ready so two neighbours exchanging data never wait on each other.
+         * @param timeout Give up when neither direction made progress for this long
+         */
+        inline bool exchange(Channel &output, const char *sendData, size_t sendSize,
+                             Channel &input, char *receiveData, size_t receiveSize,
+                             std::chrono::milliseconds timeout)
+        {
+            size_t sent = 0, received = 0;
+            auto lastProgress = std::chrono::steady_clock::now();
+            int idleRounds = 0; ///< Rounds without progress, to back off from spinning on a slow neighbour
+            while (sent < sendSize || received < receiveSize)
+            {
+                bool progress = false;
+                if (sent < sendSize)
+                {
+                    const ssize_t count = output.trySend(sendData + sent, sendSize - sent);
+                    if (count < 0)
+                    {
+                        std::cerr << "Sending to the next rank failed" << std::endl;
+                        return false;
+                    }
+                    sent += count;
+                    progress = progress || count > 0;
+                }
+                if (received < receiveSize)
+                {
+                    const ssize_t count = input.tryReceive(receiveData + received, receiveSize - received);
+                    if (count < 0)
+                    {
+                        std::cerr << "Receiving from the previous rank failed" << std::endl;
+                        return false;
+                    }
+                    received += count;
+                    progress = progress || count > 0;
+                }
+
+                const auto now = std::chrono::steady_clock::now();
+                if (progress)
+                {
+                    lastProgress = now;
+                    idleRounds = 0;
+                    continue;
+                }
+                if (now - lastProgress > timeout)
+                {
+                    std::cerr << "Timed out exchanging data with the neighbouring ranks" << std::endl;
+                    return false;
+                }
+
+                // Sleep in poll when every pending direction is a socket. A shared memory ring cannot be polled:
+                // spin briefly for a peer that is about to write, then sleep in doubling steps so a rank waiting
+                // on a slow neighbour leaves the core to the rest of the process, e.g. the reduction thread.
+                pollfd descriptors[2];
+                int numDescriptors = 0;
+                bool canPoll = true;
+                if (sent < sendSize)
+                {
+                    descriptors[numDescriptors++] = {output.descriptor(), POLLOUT, 0};
+                    canPoll = canPoll && output.descriptor() >= 0;
+                }
+                if (received < receiveSize)
+                {
+                    descriptors[numDescriptors++] = {input.descriptor(), POLLIN, 0};
+                    canPoll = canPoll && input.descriptor() >= 0;
+                }
+                if (canPoll)
+                {
+                    poll(descriptors, numDescriptors, 10);
+                }
+                else if (idleRounds < SPIN_ROUNDS)
+                {
+                    std::this_thread::yield();
+                }
+                else
+                {
+                    const int doublings = std::min(idleRounds - SPIN_ROUNDS, MAX_BACKOFF_DOUBLINGS);
+                    std::this_thread::sleep_for(MIN_BACKOFF * (1 << doublings));
+                }
+                idleRounds++;
+            }
+            return true;
+        }
+
+        /**
+         * Blocking send of a whole message, used while setting up the links
+         */
+        inline bool sendAll(Channel &channel, const void *data, size_t size, std::chrono::milliseconds timeout)
+        {
+            char unused;
+            return exchange(channel, static_cast<const char *>(data), size, channel, &unused, 0, timeout);
+        }
+
+        inline bool receiveAll(Channel &channel, void *data, size_t size, std::chrono::milliseconds timeout)
+        {
+            return exchange(channel, nullptr, 0, channel, static_cast<char *>(data), size, timeout);
+        }
+
+        inline int listenSocket(int port)
+        {
+            const int listener = socket(AF_INET, SOCK_STREAM, 0);
+            const int enable = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(port);
+            if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 4) != 0)
+            {
+                std::cerr << "Could not listen on port " << port << ": " << std::strerror(errno) << std::endl;
+                close(listener);
+                return -1;
+            }
+            return listener;
+        }
+
+        inline void configureSocket(int socket)
+        {
+            // Ring steps exchange one chunk at a time, so Nagle's algorithm would only add latency
+            const int enable = 1;
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        }
+
+        /**
+         * Connect to host:port, retrying until the peer listens or the timeout expires
+         */
+        inline int connectSocket(const std::string &host, int port, std::chrono::milliseconds timeout)
+        {
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo *addresses = nullptr;
+            if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0 || addresses == nullptr)
+            {
+                std::cerr << "Could not resolve host " << host << std::endl;
+                return -1;
+            }
+
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            int connection = -1;
+            while (connection < 0 && std::chrono::steady_clock::now() < deadline)
+            {
+                connection = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(connection, addresses->ai_addr, addresses->ai_addrlen) != 0)
+                {
+                    close(connection);
+                    connection = -1;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+            }
+            freeaddrinfo(addresses);
+
+            if (connection < 0)
+            {
+                std::cerr << "Could not connect to " << host << ":" << port << std::endl;
+                return -1;
+            }
+            configureSocket(connection);
+            return connection;
+        }
+
+        inline int acceptSocket(int listener, std::chrono::milliseconds timeout)
+        {
+            pollfd descriptor = {listener, POLLIN, 0};
+            if (poll(&descriptor, 1, static_cast<int>(timeout.count())) != 1)
+            {
+                std::cerr << "Timed out waiting for the previous rank to connect" << std::endl;
+                return -1;
+            }
+            const int connection = accept(listener, nullptr, nullptr);
+            if (connection >= 0)
+            {
+                configureSocket(connection);
+            }
+            return connection;
+        }
+    }
+}
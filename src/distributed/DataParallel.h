@@ -0,0 +1,224 @@
+#pragma once
+
+#include "distributed/ProcessGroup.h"
+#include "layers/Layer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace nn
+{
+    /**
+     * Averages the gradients of a Net over the ranks of a process group, each of which trains on its own
+     * shard of the data.
+     *
+     * Net::backward reports every layer as soon as its gradients are final. They are packed into buckets of
+     * about bucketBytes, and every full bucket is all-reduced on a background thread while backward continues
+     * with the earlier layers. Net::backward waits for the last bucket before it returns.
+     *
+     * Averaging matches gradients that are means over the batch, as the ones behind Softmax: ranks running
+     * batches of b samples then train like a single Net on batches of worldSize * b samples.
+     */
+    template <typename Dtype = float>
+    class DataParallel
+    {
+    public:
+        explicit DataParallel(std::shared_ptr<ProcessGroup> group, size_t bucketBytes = 1 << 20) : m_group(std::move(group)),
+                                                                                                  m_bucketBytes(bucketBytes),
+                                                                                                  m_stop(false),
+                                                                                                  m_failed(false),
+                                                                                                  m_thread(&DataParallel::run, this)
+        {
+        }
+
+        DataParallel(const DataParallel &) = delete;
+
+        DataParallel &operator=(const DataParallel &) = delete;
+
+        ~DataParallel()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_condition.notify_all();
+            m_thread.join();
+        }
+
+        /**
+         * Copy the weights of rank 0 to every rank, so all of them start from the same model
+         */
+        bool broadcastParameters(const std::vector<std::unique_ptr<LayerBase<Dtype>>> &layers);
+
+        /**
+         * Add the gradients of a layer whose backward pass finished to the current bucket
+         */
+        void gradientsReady(LayerBase<Dtype> &layer);
+
+        /**
+         * Reduce the last, partly filled, bucket and wait until every bucket is reduced
+         * @return false if an all-reduce failed, in this or any earlier call. The process group is broken by then
+         * and the gradients are no longer reduced, so training has to stop.
+         */
+        bool synchronize();
+
+        ProcessGroup &getProcessGroup()
+        {
+            return *m_group;
+        }
+
+    private:
+        struct Bucket
+        {
+            std::vector<ParameterView<Dtype>> parameters; ///< The gradients packed into the bucket
+            std::vector<Dtype> buffer;                    ///< Staging buffer the all-reduce runs on
+            Eigen::Index size = 0;                        ///< Number of gradient values in the bucket
+        };
+
+        /**
+         * Pack the gradients of the current bucket and hand it to the background thread
+         */
+        void launch();
+
+        void run();
+
+        std::shared_ptr<ProcessGroup> m_group;
+        size_t m_bucketBytes;
+
+        std::vector<std::unique_ptr<Bucket>> m_buckets; ///< Kept between steps so their buffers are reused
+        size_t m_currentBucket = 0;                     ///< The bucket being filled by backward
+        std::vector<ParameterView<Dtype>> m_layerParameters;
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::deque<Bucket *> m_pending; ///< Full buckets, reduced in order so every rank reduces the same bucket
+        size_t m_inFlight = 0;          ///< Buckets launched but not yet reduced
+        bool m_stop;
+        bool m_failed; ///< Set by the first failed all-reduce, never cleared
+        std::thread m_thread; ///< Declared last so it starts after the state above is initialized
+    };
+
+    template <typename Dtype>
+    bool DataParallel<Dtype>::broadcastParameters(const std::vector<std::unique_ptr<LayerBase<Dtype>>> &layers)
+    {
+        std::vector<ParameterView<Dtype>> parameters;
+        for (const auto &layer : layers)
+        {
+            layer->collectParameters(parameters);
+        }
+        for (const auto &parameter : parameters)
+        {
+            if (!m_group->broadcast(parameter.weights, parameter.size))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Dtype>
+    void DataParallel<Dtype>::gradientsReady(LayerBase<Dtype> &layer)
+    {
+        m_layerParameters.clear();
+        layer.collectParameters(m_layerParameters);
+        for (const auto &parameter : m_layerParameters)
+        {
+            if (m_currentBucket == m_buckets.size())
+            {
+                m_buckets.emplace_back(new Bucket());
+            }
+            Bucket &bucket = *m_buckets[m_currentBucket];
+            bucket.parameters.push_back(parameter);
+            bucket.size += parameter.size;
+            if (bucket.size * sizeof(Dtype) >= m_bucketBytes)
+            {
+                launch();
+            }
+        }
+    }
+
+    template <typename Dtype>
+    void DataParallel<Dtype>::launch()
+    {
+        Bucket &bucket = *m_buckets[m_currentBucket++];
+        bucket.buffer.resize(bucket.size);
+        Dtype *position = bucket.buffer.data();
+        for (const auto &parameter : bucket.parameters)
+        {
+            std::copy(parameter.gradient, parameter.gradient + parameter.size, position);
+            position += parameter.size;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.push_back(&bucket);
+            m_inFlight++;
+        }
+        m_condition.notify_all();
+    }
+
+    template <typename Dtype>
+    bool DataParallel<Dtype>::synchronize()
+    {
+        if (m_currentBucket < m_buckets.size() && m_buckets[m_currentBucket]->size > 0)
+        {
+            launch();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this]()
+                         { return m_inFlight == 0; });
+        const bool succeeded = !m_failed;
+        lock.unlock();
+
+        // Start the next backward pass from the first bucket, keeping the buffers
+        for (auto &bucket : m_buckets)
+        {
+            bucket->parameters.clear();
+            bucket->size = 0;
+        }
+        m_currentBucket = 0;
+        return succeeded;
+    }
+
+    template <typename Dtype>
+    void DataParallel<Dtype>::run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            m_condition.wait(lock, [this]()
+                             { return m_stop || !m_pending.empty(); });
+            if (m_pending.empty())
+            {
+                return;
+            }
+
+            Bucket *bucket = m_pending.front();
+            m_pending.pop_front();
+            const bool skip = m_failed;
+            lock.unlock();
+
+            // After a failure the ring is out of step for good, so the remaining buckets keep the local gradients
+            bool succeeded = skip || m_group->allReduce(bucket->buffer.data(), bucket->size);
+            if (succeeded && !skip)
+            {
+                const Dtype scale = Dtype(1) / m_group->getWorldSize();
+                const Dtype *position = bucket->buffer.data();
+                for (const auto &parameter : bucket->parameters)
+                {
+                    Eigen::TensorMap<Eigen::Tensor<Dtype, 1>> gradient(parameter.gradient, parameter.size);
+                    gradient = Eigen::TensorMap<Eigen::Tensor<const Dtype, 1>>(position, parameter.size) * scale;
+                    position += parameter.size;
+                }
+            }
+
+            lock.lock();
+            m_failed = m_failed || !succeeded;
+            m_inFlight--;
+            m_condition.notify_all();
+        }
+    }
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include "distributed/Channel.h"
+
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace nn
+{
+    /**
+     * The processes of a data-parallel job, connected in a ring: every rank sends to rank + 1 and receives
+     * from rank - 1.
+     *
+     * Rank r listens on basePort + r. Links between ranks on the same host move their data through a shared
+     * memory ring buffer, the TCP connection is then only used to set it up and to notice the peer exiting.
+     */
+    class ProcessGroup
+    {
+    public:
+        /**
+         * @param hosts The host of every rank, all ranks run on this host if empty
+         * @param useSharedMemory Whether links between ranks on the same host use shared memory instead of TCP
+         */
+        ProcessGroup(int rank, int worldSize, int basePort = 29500, std::vector<std::string> hosts = {},
+                     bool useSharedMemory = true) : m_rank(rank),
+                                                    m_worldSize(worldSize),
+                                                    m_basePort(basePort),
+                                                    m_hosts(std::move(hosts)),
+                                                    m_useSharedMemory(useSharedMemory)
+        {
+            if (m_hosts.empty())
+            {
+                m_hosts.assign(worldSize, "127.0.0.1");
+            }
+        }
+
+        /**
+         * Connect to the neighbouring ranks, waiting up to timeout for them to start
+         */
+        bool connect(std::chrono::milliseconds timeout = std::chrono::milliseconds(60000));
+
+        /**
+         * Sum data over all ranks in place, with a chunked ring all-reduce.
+         * A failed transfer leaves the ring out of step, so it breaks the group and every later call fails.
+         */
+        template <typename Dtype>
+        bool allReduce(Dtype *data, Eigen::Index count);
+
+        /**
+         * Copy data from root to every other rank. Like allReduce, a failed transfer breaks the group.
+         */
+        template <typename Dtype>
+        bool broadcast(Dtype *data, Eigen::Index count, int root = 0);
+
+        /**
+         * Wait until every rank reached the barrier
+         */
+        bool barrier()
+        {
+            float token = 0;
+            return allReduce(&token, 1);
+        }
+
+        int getRank() const
+        {
+            return m_rank;
+        }
+
+        int getWorldSize() const
+        {
+            return m_worldSize;
+        }
+
+        /**
+         * Whether data to the next rank moves through shared memory
+         */
+        bool usesSharedMemory() const
+        {
+            return dynamic_cast<SharedMemoryChannel *>(m_output.get()) != nullptr;
+        }
+
+        /**
+         * Whether a transfer failed, after which the ranks no longer agree on the data in flight and the group
+         * cannot be used anymore
+         */
+        bool isBroken() const
+        {
+            return m_broken;
+        }
+
+        /**
+         * Give up on a transfer when the neighbours make no progress for this long. A neighbour that exits closes
+         * its links and fails the transfer at once, over TCP and shared memory alike, so the timeout only
+         * catches neighbours that hang.
+         */
+        void setTimeout(std::chrono::milliseconds timeout)
+        {
+            m_timeout = timeout;
+        }
+
+    private:
+        static const size_t SEGMENT_BYTES = 1 << 18; ///< Bytes exchanged per ring step before they are reduced
+
+        int nextRank() const
+        {
+            return (m_rank + 1) % m_worldSize;
+        }
+
+        int previousRank() const
+        {
+            return (m_rank + m_worldSize - 1) % m_worldSize;
+        }
+
+        /**
+         * Whether the group is connected and not broken, reported on std::cerr for the calling method otherwise
+         */
+        bool isUsable(const char *caller) const
+        {
+            if (!m_output)
+            {
+                std::cerr << "ProcessGroup::" << caller << " called before connect" << std::endl;
+                return false;
+            }
+            if (m_broken)
+            {
+                std::cerr << "ProcessGroup::" << caller << " called after an earlier transfer failed" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool exchange(const void *sendData, size_t sendBytes, void *receiveData, size_t receiveBytes)
+        {
+            if (!internal::exchange(*m_output, static_cast<const char *>(sendData), sendBytes,
+                                    *m_input, static_cast<char *>(receiveData), receiveBytes, m_timeout))
+            {
+                m_broken = true;
+                return false;
+            }
+            return true;
+        }
+
+        int m_rank;
+        int m_worldSize;
+        int m_basePort;
+        std::vector<std::string> m_hosts;
+        bool m_useSharedMemory;
+        std::chrono::milliseconds m_timeout = std::chrono::milliseconds(60000);
+        std::atomic<bool> m_broken{false}; ///< Set by the first failed transfer, never cleared
+
+        std::unique_ptr<Channel> m_output;   ///< The link to the next rank
+        std::unique_ptr<Channel> m_input;    ///< The link from the previous rank
+        std::vector<char> m_receiveBuffer; ///< Segment received from the previous rank, before it is reduced
+    };
+
+    inline bool ProcessGroup::connect(std::chrono::milliseconds timeout)
+    {
+        if (m_rank < 0 || m_rank >= m_worldSize || static_cast<int>(m_hosts.size()) != m_worldSize)
+        {
+            std::cerr << "ProcessGroup needs 0 <= rank < worldSize and one host per rank" << std::endl;
+            return false;
+        }
+        if (m_worldSize == 1)
+        {
+            return true;
+        }
+
+        // Listen before connecting, so neighbours that start in any order find each other
+        const int listener = internal::listenSocket(m_basePort + m_rank);
+        if (listener < 0)
+        {
+            return false;
+        }
+        const int nextSocket = internal::connectSocket(m_hosts[nextRank()], m_basePort + nextRank(), timeout);
+        const int previousSocket = nextSocket >= 0 ? internal::acceptSocket(listener, timeout) : -1;
+        close(listener);
+        if (previousSocket < 0)
+        {
+            if (nextSocket >= 0)
+            {
+                close(nextSocket);
+            }
+            return false;
+        }
+        std::unique_ptr<TcpChannel> next(new TcpChannel(nextSocket));
+        std::unique_ptr<TcpChannel> previous(new TcpChannel(previousSocket));
+
+        // Agree on the transport of each link: the sender creates the shared memory segment and names it,
+        // an empty name keeps the link on TCP
+        const int32_t rank = m_rank;
+        int32_t previousRankSeen;
+        if (!internal::sendAll(*next, &rank, sizeof(rank), timeout) ||
+            !internal::receiveAll(*previous, &previousRankSeen, sizeof(previousRankSeen), timeout))
+        {
+            return false;
+        }
+        if (previousRankSeen != previousRank())
+        {
+            std::cerr << "Rank " << m_rank << " expected rank " << previousRank() << " to connect, got rank "
+                      << previousRankSeen << std::endl;
+            return false;
+        }
+
+        std::unique_ptr<SharedMemoryChannel> sharedOutput;
+        std::string segmentName;
+        if (m_useSharedMemory && m_hosts[nextRank()] == m_hosts[m_rank])
+        {
+            segmentName = "/cpp-nn-" + std::to_string(m_basePort) + "-" + std::to_string(m_rank) + "-" +
+                          std::to_string(getpid());
+            sharedOutput.reset(SharedMemoryChannel::create(segmentName));
+            if (!sharedOutput)
+            {
+                segmentName.clear();
+            }
+        }
+
+        const uint32_t nameSize = segmentName.size();
+        uint32_t previousNameSize;
+        if (!internal::sendAll(*next, &nameSize, sizeof(nameSize), timeout) ||
+            !internal::sendAll(*next, segmentName.data(), nameSize, timeout) ||
+            !internal::receiveAll(*previous, &previousNameSize, sizeof(previousNameSize), timeout))
+        {
+            return false;
+        }
+        std::string previousName(previousNameSize, '\0');
+        if (!internal::receiveAll(*previous, &previousName[0], previousNameSize, timeout))
+        {
+            return false;
+        }
+
+        std::unique_ptr<SharedMemoryChannel> sharedInput;
+        if (!previousName.empty())
+        {
+            sharedInput.reset(SharedMemoryChannel::open(previousName));
+        }
+
+        // Confirm the receiving side attached, which unlinks the segment, before the sender moves the link off TCP.
+        // Until then the sending channel owns the segment and removes it if the setup fails.
+        const char attached = previousName.empty() || sharedInput;
+        char nextAttached = 0;
+        const bool confirmed = internal::sendAll(*previous, &attached, 1, timeout) &&
+                               internal::receiveAll(*next, &nextAttached, 1, timeout);
+        if (sharedOutput && nextAttached)
+        {
+            sharedOutput->handOver();
+        }
+        if (!confirmed || !attached || !nextAttached)
+        {
+            std::cerr << "Rank " << m_rank << " could not set up the links to its neighbours" << std::endl;
+            return false;
+        }
+
+        if (sharedOutput)
+        {
+            sharedOutput->watchPeer(std::move(next));
+            m_output = std::move(sharedOutput);
+        }
+        else
+        {
+            m_output = std::move(next);
+        }
+        if (sharedInput)
+        {
+            sharedInput->watchPeer(std::move(previous));
+            m_input = std::move(sharedInput);
+        }
+        else
+        {
+            m_input = std::move(previous);
+        }
+        return true;
+    }
+
+    template <typename Dtype>
+    bool ProcessGroup::allReduce(Dtype *data, Eigen::Index count)
+    {
+        if (m_worldSize == 1)
+        {
+            return true;
+        }
+        if (!isUsable("allReduce"))
+        {
+            return false;
+        }
+
+        // Rank r ends the reduce-scatter owning the sum of chunk r + 1, then the all-gather passes the sums on
+        auto chunkBegin = [&](int chunk)
+        {
+            return count * chunk / m_worldSize;
+        };
+        auto chunkOf = [&](int step)
+        {
+            return ((step % m_worldSize) + m_worldSize) % m_worldSize;
+        };
+
+        const Eigen::Index segmentSize = std::max<Eigen::Index>(1, SEGMENT_BYTES / sizeof(Dtype));
+        m_receiveBuffer.resize(segmentSize * sizeof(Dtype));
+        Dtype *received = reinterpret_cast<Dtype *>(m_receiveBuffer.data());
+
+        for (int step = 0; step < m_worldSize - 1; ++step)
+        {
+            const int sendChunk = chunkOf(m_rank - step);
+            const int receiveChunk = chunkOf(m_rank - step - 1);
+            const Eigen::Index sendBegin = chunkBegin(sendChunk), sendEnd = chunkBegin(sendChunk + 1);
+            const Eigen::Index receiveBegin = chunkBegin(receiveChunk), receiveEnd = chunkBegin(receiveChunk + 1);
+
+            // Exchange the chunks segment by segment, so every received segment is reduced while still in cache
+            for (Eigen::Index offset = 0; sendBegin + offset < sendEnd || receiveBegin + offset < receiveEnd; offset += segmentSize)
+            {
+                const Eigen::Index sendSize = std::max<Eigen::Index>(0, std::min(segmentSize, sendEnd - sendBegin - offset));
+                const Eigen::Index receiveSize = std::max<Eigen::Index>(0, std::min(segmentSize, receiveEnd - receiveBegin - offset));
+                if (!exchange(data + sendBegin + offset, sendSize * sizeof(Dtype), received, receiveSize * sizeof(Dtype)))
+                {
+                    return false;
+                }
+
+                Eigen::TensorMap<Eigen::Tensor<Dtype, 1>> target(data + receiveBegin + offset, receiveSize);
+                target += Eigen::TensorMap<Eigen::Tensor<const Dtype, 1>>(received, receiveSize);
+            }
+        }
+
+        for (int step = 0; step < m_worldSize - 1; ++step)
+        {
+            const int sendChunk = chunkOf(m_rank + 1 - step);
+            const int receiveChunk = chunkOf(m_rank - step);
+            const Eigen::Index sendBegin = chunkBegin(sendChunk), sendEnd = chunkBegin(sendChunk + 1);
+            const Eigen::Index receiveBegin = chunkBegin(receiveChunk), receiveEnd = chunkBegin(receiveChunk + 1);
+            if (!exchange(data + sendBegin, (sendEnd - sendBegin) * sizeof(Dtype),
+                          data + receiveBegin, (receiveEnd - receiveBegin) * sizeof(Dtype)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Dtype>
+    bool ProcessGroup::broadcast(Dtype *data, Eigen::Index count, int root)
+    {
+        if (m_worldSize == 1)
+        {
+            return true;
+        }
+        if (!isUsable("broadcast"))
+        {
+            return false;
+        }
+
+        // Pass the data along the ring, every rank but the one before root forwards it
+        const size_t bytes = count * sizeof(Dtype);
+        if (m_rank != root && !exchange(nullptr, 0, data, bytes))
+        {
+            return false;
+        }
+        return nextRank() == root || exchange(data, bytes, nullptr, 0);
+    }
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "layers/Layer.h"
+#include "layers/Dense.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace nn
+{
+    /**
+     * Batch normalization over the feature dimension of a (batchSize, numFeatures) input.
+     *
+     * Each feature column is contiguous in Eigen's column-major layout, so a feature is handled while its column
+     * is hot in cache: one pass computes the mean and variance from shifted sums, a second one normalizes, scales
+     * and shifts. In inference mode the running
+     * statistics collapse into a per-feature scale and shift, which Net::foldBatchNorm can fold into the weights
+     * of a preceding Dense layer, turning this layer into a pass-through.
+     */
+    template <typename Dtype = float, int Dims = 2>
+    class BatchNorm : public Layer<Dtype, Dims>
+    {
+    public:
+        explicit BatchNorm(int numFeatures, Dtype momentum = 0.9, Dtype epsilon = 1e-5);
+
+        const std::string &getName()
+        {
+            const static std::string name = "BatchNorm";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+        void step();
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer);
+
+        void saveState(Snapshot<Dtype> &snapshot) const;
+
+        bool loadState(Snapshot<Dtype> &snapshot);
+
+        MemoryUsage memoryUsage() const;
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const;
+
+        void collectParameters(std::vector<ParameterView<Dtype>> &parameters)
+        {
+            parameters.push_back({m_gamma.data(), m_gammaGrad.data(), m_gamma.size()});
+            parameters.push_back({m_beta.data(), m_betaGrad.data(), m_beta.size()});
+        }
+
+        /**
+         * Fold the inference-time normalization into the preceding Dense layer, after which this layer
+         * passes its input through unchanged. Only valid in inference mode, the layer cannot be trained anymore.
+         */
+        void foldInto(Dense<Dtype, Dims> &dense);
+
+        bool isFolded() const
+        {
+            return m_isFolded;
+        }
+
+        bool passesThrough() const
+        {
+            return m_isFolded;
+        }
+
+    private:
+        /**
+         * Compute the inference-time y = x * scale + shift from the running statistics
+         */
+        void inferenceAffine(Eigen::Tensor<Dtype, Dims> &scale, Eigen::Tensor<Dtype, Dims> &shift) const;
+
+        int m_numFeatures; ///< The number of features normalized
+        Dtype m_momentum;  ///< How much of the running statistics is kept on every update
+        Dtype m_epsilon;   ///< Added to the variance for numerical stability
+
+        Eigen::Tensor<Dtype, Dims> m_gamma;       ///< The learned scale, shape (1, numFeatures)
+        Eigen::Tensor<Dtype, Dims> m_beta;        ///< The learned shift, shape (1, numFeatures)
+        Eigen::Tensor<Dtype, Dims> m_runningMean; ///< Running mean used in inference
+        Eigen::Tensor<Dtype, Dims> m_runningVar;  ///< Running variance used in inference
+
+        Eigen::Tensor<Dtype, Dims> m_normalized; ///< Cache of the normalized input to calculate gradient
+        Eigen::Tensor<Dtype, Dims> m_invStd;     ///< Cache of 1 / sqrt(var + epsilon) of the last batch
+
+        // Gradients
+        Eigen::Tensor<Dtype, Dims> m_gammaGrad;                       ///< The gradient of the scale
+        Eigen::Tensor<Dtype, Dims> m_betaGrad;                        ///< The gradient of the shift
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> m_gammaOptimizer; ///< The optimizer of our scale
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> m_betaOptimizer;  ///< The optimizer of our shift
+
+        bool m_isFolded; ///< Whether the normalization was folded into the preceding layer
+    };
+
+    template <typename Dtype, int Dims>
+    BatchNorm<Dtype, Dims>::BatchNorm(int numFeatures, Dtype momentum, Dtype epsilon) : m_numFeatures(numFeatures),
+                                                                                         m_momentum(momentum),
+                                                                                         m_epsilon(epsilon),
+                                                                                         m_isFolded(false)
+    {
+        m_gamma = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_gamma.setConstant(1);
+        m_beta = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_beta.setZero();
+
+        m_runningMean = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_runningMean.setZero();
+        m_runningVar = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_runningVar.setConstant(1);
+
+        m_gammaGrad = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_gammaGrad.setZero();
+        m_betaGrad = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_betaGrad.setZero();
+    }
+
+    template <typename Dtype, int Dims>
+    void BatchNorm<Dtype, Dims>::inferenceAffine(Eigen::Tensor<Dtype, Dims> &scale, Eigen::Tensor<Dtype, Dims> &shift) const
+    {
+        scale = m_gamma * (m_runningVar + m_runningVar.constant(m_epsilon)).rsqrt();
+        shift = m_beta - m_runningMean * scale;
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> BatchNorm<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        assert(input.dimensions()[1] == m_numFeatures && "BatchNorm::forward dimensions of input do not match");
+        if (m_isFolded)
+        {
+            return input;
+        }
+
+        const Eigen::Index batchSize = input.dimensions()[0];
+        if (!this->isTraining())
+        {
+            Eigen::Tensor<Dtype, Dims> scale, shift;
+            inferenceAffine(scale, shift);
+            return input * scale.broadcast(Eigen::array<Eigen::Index, 2>{batchSize, 1}) +
+                   shift.broadcast(Eigen::array<Eigen::Index, 2>{batchSize, 1});
+        }
+
+        Eigen::Tensor<Dtype, Dims> output(input.dimensions());
+        m_normalized = Eigen::Tensor<Dtype, Dims>(input.dimensions());
+        m_invStd = Eigen::Tensor<Dtype, Dims>(1, m_numFeatures);
+
+        for (Eigen::Index feature = 0; feature < m_numFeatures; ++feature)
+        {
+            const Dtype *in = input.data() + feature * batchSize;
+            Dtype *normalized = m_normalized.data() + feature * batchSize;
+            Dtype *out = output.data() + feature * batchSize;
+
+            // One pass for both statistics. The first value of the column is a shift, which keeps
+            // sum(x^2) - sum(x)^2 / n from cancelling when the mean is far from zero.
+            const Dtype shift = in[0];
+            Dtype sum = 0, shiftedSquaredSum = 0;
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                const Dtype shifted = in[ii] - shift;
+                sum += shifted;
+                shiftedSquaredSum += shifted * shifted;
+            }
+            const Dtype shiftedMean = sum / batchSize;
+            const Dtype mean = shiftedMean + shift;
+            const Dtype squaredSum = std::max(shiftedSquaredSum - sum * shiftedMean, Dtype(0));
+            const Dtype variance = squaredSum / batchSize;
+            const Dtype invStd = 1 / std::sqrt(variance + m_epsilon);
+
+            const Dtype gamma = m_gamma(0, feature);
+            const Dtype beta = m_beta(0, feature);
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                normalized[ii] = (in[ii] - mean) * invStd;
+                out[ii] = normalized[ii] * gamma + beta;
+            }
+
+            // The running variance uses the unbiased estimate, as it estimates the population variance
+            const Dtype unbiasedVariance = batchSize > 1 ? squaredSum / (batchSize - 1) : variance;
+            m_invStd(0, feature) = invStd;
+            m_runningMean(0, feature) = m_momentum * m_runningMean(0, feature) + (1 - m_momentum) * mean;
+            m_runningVar(0, feature) = m_momentum * m_runningVar(0, feature) + (1 - m_momentum) * unbiasedVariance;
+        }
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> BatchNorm<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        if (m_isFolded)
+        {
+            return accumulatedGrad;
+        }
+
+        const Eigen::Index batchSize = accumulatedGrad.dimensions()[0];
+        if (!this->isTraining())
+        {
+            Eigen::Tensor<Dtype, Dims> scale, shift;
+            inferenceAffine(scale, shift);
+            return accumulatedGrad * scale.broadcast(Eigen::array<Eigen::Index, 2>{batchSize, 1});
+        }
+
+        assert(accumulatedGrad.dimensions() == m_normalized.dimensions() &&
+               "BatchNorm::backward dimensions of accumulatedGrad and cache do not match");
+        Eigen::Tensor<Dtype, Dims> inputGrad(accumulatedGrad.dimensions());
+
+        for (Eigen::Index feature = 0; feature < m_numFeatures; ++feature)
+        {
+            const Dtype *grad = accumulatedGrad.data() + feature * batchSize;
+            const Dtype *normalized = m_normalized.data() + feature * batchSize;
+            Dtype *out = inputGrad.data() + feature * batchSize;
+
+            Dtype gradSum = 0;
+            Dtype gradNormalizedSum = 0;
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                gradSum += grad[ii];
+                gradNormalizedSum += grad[ii] * normalized[ii];
+            }
+            m_betaGrad(0, feature) = gradSum;
+            m_gammaGrad(0, feature) = gradNormalizedSum;
+
+            // dx = gamma * invStd / N * (N * dy - sum(dy) - xhat * sum(dy * xhat))
+            const Dtype factor = m_gamma(0, feature) * m_invStd(0, feature) / batchSize;
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                out[ii] = factor * (batchSize * grad[ii] - gradSum - normalized[ii] * gradNormalizedSum);
+            }
+        }
+        return inputGrad;
+    }
+
+    template <typename Dtype, int Dims>
+    void BatchNorm<Dtype, Dims>::step()
+    {
+        if (m_isFolded || !m_gammaOptimizer)
+        {
+            return;
+        }
+
+        m_gammaOptimizer->update(m_gamma, m_gammaGrad);
+        m_betaOptimizer->update(m_beta, m_betaGrad);
+    }
+
+    template <typename Dtype, int Dims>
+    void BatchNorm<Dtype, Dims>::registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer)
+    {
+        m_gammaOptimizer = std::move(optimizer->template createOptimizer<Dims>(/*decayWeights*/ false));
+        m_betaOptimizer = std::move(optimizer->template createOptimizer<Dims>(/*decayWeights*/ false));
+    }
+
+    template <typename Dtype, int Dims>
+    void BatchNorm<Dtype, Dims>::foldInto(Dense<Dtype, Dims> &dense)
+    {
+        assert(!this->isTraining() && "BatchNorm::foldInto is only valid in inference mode");
+        Eigen::Tensor<Dtype, Dims> scale, shift;
+        inferenceAffine(scale, shift);
+        dense.foldAffine(scale, shift);
+        m_isFolded = true;
+
+        // A folded layer never runs backward again, so the caches of the last training batch are dead
+        m_normalized = Eigen::Tensor<Dtype, Dims>();
+        m_invStd = Eigen::Tensor<Dtype, Dims>();
+    }
+
+    template <typename Dtype, int Dims>
+    void BatchNorm<Dtype, Dims>::saveState(Snapshot<Dtype> &snapshot) const
+    {
+        snapshot.addTensor("BatchNorm.gamma", m_gamma);
+        snapshot.addTensor("BatchNorm.beta", m_beta);
+        snapshot.addTensor("BatchNorm.runningMean", m_runningMean);
+        snapshot.addTensor("BatchNorm.runningVar", m_runningVar);
+        snapshot.addInteger("BatchNorm.folded", m_isFolded);
+
+        snapshot.addInteger("BatchNorm.hasOptimizer", m_gammaOptimizer != nullptr);
+        if (m_gammaOptimizer)
+        {
+            m_gammaOptimizer->saveState(snapshot);
+            m_betaOptimizer->saveState(snapshot);
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    bool BatchNorm<Dtype, Dims>::loadState(Snapshot<Dtype> &snapshot)
+    {
+        Eigen::Tensor<Dtype, Dims> gamma, beta, runningMean, runningVar;
+        uint64_t isFolded, hasOptimizer;
+        if (!snapshot.readTensor("BatchNorm.gamma", gamma) || !snapshot.readTensor("BatchNorm.beta", beta) ||
+            !snapshot.readTensor("BatchNorm.runningMean", runningMean) ||
+            !snapshot.readTensor("BatchNorm.runningVar", runningVar) ||
+            !snapshot.readInteger("BatchNorm.folded", isFolded) ||
+            !snapshot.readInteger("BatchNorm.hasOptimizer", hasOptimizer))
+        {
+            return false;
+        }
+
+        if (gamma.dimensions() != m_gamma.dimensions() || beta.dimensions() != m_gamma.dimensions() ||
+            runningMean.dimensions() != m_gamma.dimensions() || runningVar.dimensions() != m_gamma.dimensions())
+        {
+            std::cerr << "BatchNorm::loadState number of features in snapshot does not match the layer" << std::endl;
+            return false;
+        }
+        // A folded layer passes its input through, which is only valid in inference
+        if (isFolded && this->isTraining())
+        {
+            std::cerr << "BatchNorm::loadState snapshot was folded for inference, call setTraining(false) first" << std::endl;
+            return false;
+        }
+        m_gamma = gamma;
+        m_beta = beta;
+        m_runningMean = runningMean;
+        m_runningVar = runningVar;
+        m_isFolded = isFolded != 0;
+
+        if (hasOptimizer)
+        {
+            if (!m_gammaOptimizer)
+            {
+                std::cerr << "BatchNorm::loadState snapshot has optimizer state, register an optimizer first" << std::endl;
+                return false;
+            }
+            return m_gammaOptimizer->loadState(snapshot, m_gamma) && m_betaOptimizer->loadState(snapshot, m_beta);
+        }
+        return true;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage BatchNorm<Dtype, Dims>::memoryUsage() const
+    {
+        // The running statistics are counted as parameters since they are saved and restored with them
+        MemoryUsage usage;
+        usage.parameterBytes = tensorBytes(m_gamma) + tensorBytes(m_beta) +
+                               tensorBytes(m_runningMean) + tensorBytes(m_runningVar);
+        usage.gradientBytes = tensorBytes(m_gammaGrad) + tensorBytes(m_betaGrad);
+        if (m_gammaOptimizer)
+        {
+            usage.optimizerStateBytes = m_gammaOptimizer->stateBytes() + m_betaOptimizer->stateBytes();
+        }
+        usage.activationBytes = tensorBytes(m_normalized) + tensorBytes(m_invStd);
+        usage.temporaryBytes = m_isFolded ? 0 : tensorBytes(m_normalized);
+        return usage;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage BatchNorm<Dtype, Dims>::predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+    {
+        assert(shape[1] == m_numFeatures && "BatchNorm::predictMemoryUsage dimensions of input do not match");
+        MemoryUsage usage;
+        usage.parameterBytes = 4 * m_numFeatures * sizeof(Dtype);
+        usage.gradientBytes = 2 * m_numFeatures * sizeof(Dtype);
+        if (m_gammaOptimizer)
+        {
+            usage.optimizerStateBytes = 2 * m_gammaOptimizer->predictStateBytes(m_numFeatures);
+        }
+        if (!m_isFolded)
+        {
+            usage.activationBytes = (shape[0] + 1) * m_numFeatures * sizeof(Dtype);
+            usage.temporaryBytes = shape[0] * m_numFeatures * sizeof(Dtype);
+        }
+        return usage;
+    }
+}
@@ -0,0 +1,956 @@
+#pragma once
+
+#include "layers/Layer.h"
+#include "utils/Parallel.h"
+#include "utils/WeightInitializers.h"
+
+namespace nn
+{
+    /**
+     * 2-D convolution over a (batchSize, height, width, channels) input.
+     *
+     * Tensors are column-major, so the batch dimension is the contiguous one: every pixel of every channel is a
+     * contiguous run of batchSize values. The direct convolution below keeps the batch in the innermost loop,
+     * which turns the kernel into vectorized multiply-adds without an im2col copy of the input. A small tile of
+     * batch entries times output channels is accumulated in registers, reusing every loaded input vector for
+     * several channels. Work is split into blocks of the batch and of the output channels, so a block's input
+     * patch stays in cache while it is reused for every output channel of the block, and the blocks are spread
+     * over threads. Backward is built the same way: the weight gradient accumulates a register tile of output
+     * channels over cache blocks of output pixels, and the input gradient is gathered per input pixel with the
+     * transposed kernel, split over blocks of the batch, groups of input channels and input columns.
+     */
+    template <typename Dtype = float, int Dims = 4>
+    class Conv2D : public Layer<Dtype, Dims>
+    {
+    public:
+        explicit Conv2D(int inChannels, int outChannels, int kernelHeight, int kernelWidth, int stride = 1,
+                        int padding = 0, bool useBias = true,
+                        InitializationScheme weightInitializer = InitializationScheme::GlorotUniform);
+
+        const std::string &getName()
+        {
+            const static std::string name = "Conv2D";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+        void step();
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer);
+
+        void saveState(Snapshot<Dtype> &snapshot) const;
+
+        bool loadState(Snapshot<Dtype> &snapshot);
+
+        MemoryUsage memoryUsage() const;
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const;
+
+        /**
+         * Hands out writable views of the weights, so the packed copy forward uses is rebuilt on the next call
+         */
+        void collectParameters(std::vector<ParameterView<Dtype>> &parameters)
+        {
+            m_packedWeightsValid = false;
+            parameters.push_back({m_weights.data(), m_weightsGrad.data(), m_weights.size()});
+            if (m_useBias)
+            {
+                parameters.push_back({m_bias.data(), m_biasGrad.data(), m_bias.size()});
+            }
+        }
+
+        /**
+         * @return The (batchSize, height, width, channels) shape of the output for an input of the given shape
+         */
+        Eigen::array<Eigen::Index, Dims> getOutputShape(const Eigen::array<Eigen::Index, Dims> &inputShape) const;
+
+        const Eigen::Tensor<Dtype, Dims> &getWeights() const
+        {
+            return m_weights;
+        }
+
+        const Eigen::Tensor<Dtype, Dims> &getBias() const
+        {
+            return m_bias;
+        }
+
+    private:
+        typedef typename Eigen::internal::packet_traits<Dtype>::type Packet;
+        static const int PACKET_SIZE = Eigen::internal::packet_traits<Dtype>::size;
+
+        static const int BATCH_PACKETS = 2;                             ///< SIMD packets of batch entries per tile
+        static const int BATCH_LANES = BATCH_PACKETS * PACKET_SIZE;     ///< Batch entries accumulated in registers at once
+        static const int CHANNEL_LANES = 4;                             ///< Output channels accumulated in registers at once
+        static const Eigen::Index BATCH_BLOCK = 4 * BATCH_LANES;        ///< Batch entries per task
+        static const Eigen::Index CHANNEL_BLOCK = 4 * CHANNEL_LANES;    ///< Output channels per task sharing one input patch in cache
+        static const Eigen::Index PIXEL_BLOCK = 4;                      ///< Output rows and columns per cache block of the weight gradient
+
+        /**
+         * Call tapFunction(tap) for every kernel tap of the window at input pixel (ih0, iw0) that lies inside
+         * the input, where tap = kh + kernelHeight * (kw + kernelWidth * inChannel)
+         */
+        /**
+         * Repack the kernel so the CHANNEL_LANES output channels of a group are adjacent for every tap,
+         * zero-padding the last group, unless the packed copy still matches the weights
+         */
+        void packWeights();
+
+        template <typename TapFunction>
+        void forEachTap(Eigen::Index ih0, Eigen::Index iw0, Eigen::Index height, Eigen::Index width,
+                        TapFunction tapFunction) const;
+
+        /**
+         * Compute output pixel (oh, ow) for a group of CHANNEL_LANES output channels and NumPackets packets of
+         * batch entries. The accumulator tile is held in SIMD registers and every loaded input packet is reused
+         * for all channels of the group. tapOffsets holds the input offset of every tap relative to the window.
+         */
+        template <typename PacketType, int NumPackets>
+        void convolvePixel(const TensorView<Dtype, Dims> &input, const Eigen::Index *tapOffsets,
+                           const Dtype *packedGroup, Eigen::Index batchStart, Eigen::Index oh, Eigen::Index ow,
+                           Eigen::Index channelStart, Eigen::Tensor<Dtype, Dims> &output) const;
+
+        /**
+         * convolvePixel for the last numBatch < BATCH_LANES batch entries of a block, e.g. all of a small batch:
+         * one PacketType packet at a time, then with ever smaller packets down to the smallest the architecture
+         * has, e.g. 16, 8 and 4 floats with AVX-512. Only the entries left after that are computed one by one.
+         */
+        template <typename PacketType>
+        void convolvePixelTail(const TensorView<Dtype, Dims> &input, const Eigen::Index *tapOffsets,
+                               const Dtype *packedGroup, Eigen::Index batchStart, Eigen::Index numBatch,
+                               Eigen::Index oh, Eigen::Index ow, Eigen::Index channelStart,
+                               Eigen::Tensor<Dtype, Dims> &output, std::true_type hasPacket) const;
+
+        template <typename PacketType>
+        void convolvePixelTail(const TensorView<Dtype, Dims> &input, const Eigen::Index *tapOffsets,
+                               const Dtype *packedGroup, Eigen::Index batchStart, Eigen::Index numBatch,
+                               Eigen::Index oh, Eigen::Index ow, Eigen::Index channelStart,
+                               Eigen::Tensor<Dtype, Dims> &output, std::false_type hasPacket) const;
+
+        /**
+         * Add the weight gradient of tap (kh, kw, inChannel) over the output pixels [ohStart, ohEnd) x
+         * [owStart, owEnd) for a group of CHANNEL_LANES output channels. The accumulator tile is held in SIMD
+         * registers and every loaded input packet is reused for all channels of the group.
+         */
+        void accumulateWeightGrad(const TensorView<Dtype, Dims> &accumulatedGrad, Eigen::Index kh, Eigen::Index kw,
+                                  Eigen::Index inChannel, Eigen::Index channelStart, Eigen::Index ohStart,
+                                  Eigen::Index ohEnd, Eigen::Index owStart, Eigen::Index owEnd);
+
+        /**
+         * Call tapFunction(kh, kw, oh, ow) for every kernel tap (kh, kw) through which output pixel (oh, ow)
+         * reads input pixel (ih, iw)
+         */
+        template <typename TapFunction>
+        void forEachOutputTap(Eigen::Index ih, Eigen::Index iw, Eigen::Index outHeight, Eigen::Index outWidth,
+                              TapFunction tapFunction) const;
+
+        /**
+         * The transpose of convolvePixel: compute the input gradient at pixel (ih, iw) for a group of
+         * CHANNEL_LANES input channels and NumPackets packets of batch entries. PacketType may be Dtype itself
+         * for the entries left after the last full packet. packedGroup is the group in the transposed packing
+         * of backward.
+         */
+        template <typename PacketType, int NumPackets>
+        void backwardPixel(const TensorView<Dtype, Dims> &accumulatedGrad, const Dtype *packedGroup,
+                           Eigen::Index batchStart, Eigen::Index ih, Eigen::Index iw, Eigen::Index channelStart,
+                           Eigen::Tensor<Dtype, Dims> &inputGrad) const;
+
+        /**
+         * backwardPixel for the last numBatch < BATCH_LANES batch entries of a block, with ever smaller packets
+         * like convolvePixelTail
+         */
+        template <typename PacketType>
+        void backwardPixelTail(const TensorView<Dtype, Dims> &accumulatedGrad, const Dtype *packedGroup,
+                               Eigen::Index batchStart, Eigen::Index numBatch, Eigen::Index ih, Eigen::Index iw,
+                               Eigen::Index channelStart, Eigen::Tensor<Dtype, Dims> &inputGrad,
+                               std::true_type hasPacket) const;
+
+        template <typename PacketType>
+        void backwardPixelTail(const TensorView<Dtype, Dims> &accumulatedGrad, const Dtype *packedGroup,
+                               Eigen::Index batchStart, Eigen::Index numBatch, Eigen::Index ih, Eigen::Index iw,
+                               Eigen::Index channelStart, Eigen::Tensor<Dtype, Dims> &inputGrad,
+                               std::false_type hasPacket) const;
+
+        /**
+         * Add the dot products of in with grads[channel] over the batch entries [start, end) to sums[channel], for
+         * the entries after the last full packet: with ever smaller packets, then one by one
+         */
+        template <typename PacketType>
+        static void dotTail(const Dtype *in, const Dtype *const *grads, Eigen::Index start, Eigen::Index end,
+                            Dtype *sums, std::true_type hasPacket);
+
+        template <typename PacketType>
+        static void dotTail(const Dtype *in, const Dtype *const *grads, Eigen::Index start, Eigen::Index end,
+                            Dtype *sums, std::false_type hasPacket);
+
+        int m_inChannels;
+        int m_outChannels;
+        int m_kernelHeight;
+        int m_kernelWidth;
+        int m_stride;
+        int m_padding;
+
+        Eigen::Tensor<Dtype, Dims> m_inputCache; ///< Cache the input to calculate gradient
+        Eigen::Tensor<Dtype, Dims> m_weights;    ///< Kernel of shape (kernelHeight, kernelWidth, inChannels, outChannels)
+        Eigen::Tensor<Dtype, Dims> m_bias;       ///< The bias of shape (1, 1, 1, outChannels) if specified
+        Eigen::Tensor<Dtype, 1> m_packedWeights; ///< The kernel in the layout of forward, see packWeights
+        bool m_packedWeightsValid = false;       ///< Whether m_packedWeights matches m_weights
+
+        // Gradients
+        Eigen::Tensor<Dtype, Dims> m_weightsGrad;                      ///< The gradient of the weights
+        Eigen::Tensor<Dtype, Dims> m_biasGrad;                         ///< The gradient of the bias
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> m_weightOptimizer; ///< The optimizer of our weights
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> m_biasOptimizer;   ///< The optimizer of our bias
+
+        bool m_useBias; ///< Whether we use the bias
+    };
+
+    template <typename Dtype, int Dims>
+    Conv2D<Dtype, Dims>::Conv2D(int inChannels, int outChannels, int kernelHeight, int kernelWidth, int stride,
+                                int padding, bool useBias, InitializationScheme weightInitializer) : m_inChannels(inChannels),
+                                                                                                     m_outChannels(outChannels),
+                                                                                                     m_kernelHeight(kernelHeight),
+                                                                                                     m_kernelWidth(kernelWidth),
+                                                                                                     m_stride(stride),
+                                                                                                     m_padding(padding),
+                                                                                                     m_useBias(useBias)
+    {
+        static_assert(Dims == 4, "Conv2D operates on (batchSize, height, width, channels) tensors");
+        assert(stride > 0 && padding >= 0 && "Conv2D stride has to be positive and padding non-negative");
+        assert(inChannels > 0 && outChannels > 0 && kernelHeight > 0 && kernelWidth > 0 &&
+               "Conv2D channels and kernel size have to be positive");
+
+        const int receptiveField = kernelHeight * kernelWidth;
+        m_weights = getRandomWeights<Dtype, Dims>({kernelHeight, kernelWidth, inChannels, outChannels},
+                                                  receptiveField * inChannels, receptiveField * outChannels,
+                                                  weightInitializer);
+        m_weightsGrad = Eigen::Tensor<Dtype, Dims>(m_weights.dimensions());
+        m_weightsGrad.setZero();
+
+        if (useBias)
+        {
+            m_bias = Eigen::Tensor<Dtype, Dims>(1, 1, 1, outChannels);
+            m_bias.setZero();
+            m_biasGrad = Eigen::Tensor<Dtype, Dims>(1, 1, 1, outChannels);
+            m_biasGrad.setZero();
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::array<Eigen::Index, Dims> Conv2D<Dtype, Dims>::getOutputShape(const Eigen::array<Eigen::Index, Dims> &inputShape) const
+    {
+        // The padded input has to fit at least one kernel window, or the output would have negative dimensions
+        assert(inputShape[1] + 2 * m_padding >= m_kernelHeight && inputShape[2] + 2 * m_padding >= m_kernelWidth &&
+               "Conv2D kernel is larger than the padded input");
+        return {inputShape[0],
+                (inputShape[1] + 2 * m_padding - m_kernelHeight) / m_stride + 1,
+                (inputShape[2] + 2 * m_padding - m_kernelWidth) / m_stride + 1,
+                m_outChannels};
+    }
+
+    template <typename Dtype, int Dims>
+    void Conv2D<Dtype, Dims>::packWeights()
+    {
+        if (m_packedWeightsValid)
+        {
+            return;
+        }
+
+        const Eigen::Index numGroups = (m_outChannels + CHANNEL_LANES - 1) / CHANNEL_LANES;
+        const Eigen::Index taps = m_kernelHeight * m_kernelWidth * m_inChannels;
+        if (m_packedWeights.size() == 0)
+        {
+            m_packedWeights = Eigen::Tensor<Dtype, 1>(numGroups * taps * CHANNEL_LANES);
+            m_packedWeights.setZero();
+        }
+        for (Eigen::Index outChannel = 0; outChannel < m_outChannels; ++outChannel)
+        {
+            const Dtype *weights = m_weights.data() + outChannel * taps;
+            Dtype *packed = m_packedWeights.data() + (outChannel / CHANNEL_LANES) * taps * CHANNEL_LANES + outChannel % CHANNEL_LANES;
+            for (Eigen::Index tap = 0; tap < taps; ++tap)
+            {
+                packed[tap * CHANNEL_LANES] = weights[tap];
+            }
+        }
+        m_packedWeightsValid = true;
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename TapFunction>
+    void Conv2D<Dtype, Dims>::forEachTap(Eigen::Index ih0, Eigen::Index iw0, Eigen::Index height, Eigen::Index width,
+                                         TapFunction tapFunction) const
+    {
+        // Clip the kernel window to the input once instead of testing every tap
+        const Eigen::Index khStart = std::max<Eigen::Index>(0, -ih0);
+        const Eigen::Index khEnd = std::min<Eigen::Index>(m_kernelHeight, height - ih0);
+        const Eigen::Index kwStart = std::max<Eigen::Index>(0, -iw0);
+        const Eigen::Index kwEnd = std::min<Eigen::Index>(m_kernelWidth, width - iw0);
+
+        if (khStart == 0 && kwStart == 0 && khEnd == m_kernelHeight && kwEnd == m_kernelWidth)
+        {
+            // Interior pixel: every tap is valid, so walk them as one flat loop
+            const Eigen::Index taps = m_kernelHeight * m_kernelWidth * m_inChannels;
+            for (Eigen::Index tap = 0; tap < taps; ++tap)
+            {
+                tapFunction(tap);
+            }
+            return;
+        }
+
+        for (Eigen::Index inChannel = 0; inChannel < m_inChannels; ++inChannel)
+        {
+            for (Eigen::Index kw = kwStart; kw < kwEnd; ++kw)
+            {
+                for (Eigen::Index kh = khStart; kh < khEnd; ++kh)
+                {
+                    tapFunction(kh + m_kernelHeight * (kw + m_kernelWidth * inChannel));
+                }
+            }
+        }
+    }
+
+    // Forced inline: without it GCC keeps the accumulator tile of an out-of-line call in memory
+    template <typename Dtype, int Dims>
+    template <typename PacketType, int NumPackets>
+    EIGEN_ALWAYS_INLINE void Conv2D<Dtype, Dims>::convolvePixel(const TensorView<Dtype, Dims> &input, const Eigen::Index *tapOffsets,
+                                            const Dtype *packedGroup, Eigen::Index batchStart, Eigen::Index oh,
+                                            Eigen::Index ow, Eigen::Index channelStart,
+                                            Eigen::Tensor<Dtype, Dims> &output) const
+    {
+        using namespace Eigen::internal;
+        const Eigen::Index height = input.dimensions()[1];
+        const Eigen::Index width = input.dimensions()[2];
+        const Eigen::Index numChannels = std::min<Eigen::Index>(CHANNEL_LANES, m_outChannels - channelStart);
+        const Eigen::Index ih0 = oh * m_stride - m_padding;
+        const Eigen::Index iw0 = ow * m_stride - m_padding;
+        const Dtype *base = input.data() + batchStart + input.dimensions()[0] * (ih0 + height * iw0);
+
+        PacketType accumulator[CHANNEL_LANES][NumPackets];
+        for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+        {
+            const Dtype bias = m_useBias && channel < numChannels ? m_bias(0, 0, 0, channelStart + channel) : Dtype(0);
+            for (int packet = 0; packet < NumPackets; ++packet)
+            {
+                accumulator[channel][packet] = pset1<PacketType>(bias);
+            }
+        }
+
+        forEachTap(ih0, iw0, height, width, [&](Eigen::Index tap)
+                   {
+            const Dtype *in = base + tapOffsets[tap];
+            const Dtype *weights = packedGroup + tap * CHANNEL_LANES;
+            PacketType values[NumPackets];
+            for (int packet = 0; packet < NumPackets; ++packet)
+            {
+                values[packet] = ploadu<PacketType>(in + packet * unpacket_traits<PacketType>::size);
+            }
+            for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+            {
+                const PacketType weight = pset1<PacketType>(weights[channel]);
+                for (int packet = 0; packet < NumPackets; ++packet)
+                {
+                    accumulator[channel][packet] = pmadd(weight, values[packet], accumulator[channel][packet]);
+                }
+            } });
+
+        for (Eigen::Index channel = 0; channel < numChannels; ++channel)
+        {
+            Dtype *out = &output(batchStart, oh, ow, channelStart + channel);
+            for (int packet = 0; packet < NumPackets; ++packet)
+            {
+                pstoreu(out + packet * unpacket_traits<PacketType>::size, accumulator[channel][packet]);
+            }
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename PacketType>
+    void Conv2D<Dtype, Dims>::convolvePixelTail(const TensorView<Dtype, Dims> &input, const Eigen::Index *tapOffsets,
+                                                const Dtype *packedGroup, Eigen::Index batchStart, Eigen::Index numBatch,
+                                                Eigen::Index oh, Eigen::Index ow, Eigen::Index channelStart,
+                                                Eigen::Tensor<Dtype, Dims> &output, std::true_type) const
+    {
+        using namespace Eigen::internal;
+        const Eigen::Index packetSize = unpacket_traits<PacketType>::size;
+        for (; numBatch >= packetSize; batchStart += packetSize, numBatch -= packetSize)
+        {
+            convolvePixel<PacketType, 1>(input, tapOffsets, packedGroup, batchStart, oh, ow, channelStart, output);
+        }
+
+        // Eigen's smallest packets are their own half, which ends the recursion in the scalar version
+        typedef typename unpacket_traits<PacketType>::half HalfPacket;
+        if (numBatch > 0)
+        {
+            convolvePixelTail<HalfPacket>(input, tapOffsets, packedGroup, batchStart, numBatch, oh, ow, channelStart, output,
+                                          std::integral_constant<bool, (sizeof(HalfPacket) < sizeof(PacketType))>());
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename PacketType>
+    void Conv2D<Dtype, Dims>::convolvePixelTail(const TensorView<Dtype, Dims> &input, const Eigen::Index *tapOffsets,
+                                                const Dtype *packedGroup, Eigen::Index batchStart, Eigen::Index numBatch,
+                                                Eigen::Index oh, Eigen::Index ow, Eigen::Index channelStart,
+                                                Eigen::Tensor<Dtype, Dims> &output, std::false_type) const
+    {
+        const Eigen::Index height = input.dimensions()[1];
+        const Eigen::Index width = input.dimensions()[2];
+        const Eigen::Index numChannels = std::min<Eigen::Index>(CHANNEL_LANES, m_outChannels - channelStart);
+        const Eigen::Index ih0 = oh * m_stride - m_padding;
+        const Eigen::Index iw0 = ow * m_stride - m_padding;
+        const Dtype *base = input.data() + batchStart + input.dimensions()[0] * (ih0 + height * iw0);
+
+        for (Eigen::Index channel = 0; channel < numChannels; ++channel)
+        {
+            Dtype *out = &output(batchStart, oh, ow, channelStart + channel);
+            std::fill(out, out + numBatch, m_useBias ? m_bias(0, 0, 0, channelStart + channel) : Dtype(0));
+
+            forEachTap(ih0, iw0, height, width, [&](Eigen::Index tap)
+                       {
+                const Dtype *in = base + tapOffsets[tap];
+                const Dtype weight = packedGroup[tap * CHANNEL_LANES + channel];
+                for (Eigen::Index n = 0; n < numBatch; ++n)
+                {
+                    out[n] += weight * in[n];
+                } });
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> Conv2D<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        assert(input.dimensions()[3] == m_inChannels && "Conv2D::forward channels of input and weights do not match");
+        m_inputCache = input;
+
+        const Eigen::Index batchSize = input.dimensions()[0];
+        const auto outputShape = getOutputShape(input.dimensions());
+        const Eigen::Index outHeight = outputShape[1];
+        const Eigen::Index outWidth = outputShape[2];
+        Eigen::Tensor<Dtype, Dims> output(outputShape);
+
+        packWeights();
+        const Eigen::Index numGroups = (m_outChannels + CHANNEL_LANES - 1) / CHANNEL_LANES;
+        const Eigen::Index taps = m_kernelHeight * m_kernelWidth * m_inChannels;
+
+        const Eigen::Index height = input.dimensions()[1];
+        const Eigen::Index width = input.dimensions()[2];
+        Eigen::Tensor<Eigen::Index, 1> tapOffsets(taps);
+        for (Eigen::Index inChannel = 0; inChannel < m_inChannels; ++inChannel)
+        {
+            for (Eigen::Index kw = 0; kw < m_kernelWidth; ++kw)
+            {
+                for (Eigen::Index kh = 0; kh < m_kernelHeight; ++kh)
+                {
+                    tapOffsets(kh + m_kernelHeight * (kw + m_kernelWidth * inChannel)) =
+                        batchSize * (kh + height * (kw + width * inChannel));
+                }
+            }
+        }
+
+        const Eigen::Index numBatchBlocks = (batchSize + BATCH_BLOCK - 1) / BATCH_BLOCK;
+        const Eigen::Index groupsPerBlock = CHANNEL_BLOCK / CHANNEL_LANES;
+        const Eigen::Index numChannelBlocks = (numGroups + groupsPerBlock - 1) / groupsPerBlock;
+
+        parallelFor(numBatchBlocks * numChannelBlocks, [&](Eigen::Index task)
+                    {
+            const Eigen::Index batchBlockStart = (task % numBatchBlocks) * BATCH_BLOCK;
+            const Eigen::Index batchBlockEnd = std::min(batchBlockStart + BATCH_BLOCK, batchSize);
+            const Eigen::Index groupStart = (task / numBatchBlocks) * groupsPerBlock;
+            const Eigen::Index groupEnd = std::min(groupStart + groupsPerBlock, numGroups);
+
+            for (Eigen::Index ow = 0; ow < outWidth; ++ow)
+            {
+                for (Eigen::Index oh = 0; oh < outHeight; ++oh)
+                {
+                    for (Eigen::Index group = groupStart; group < groupEnd; ++group)
+                    {
+                        const Dtype *packedGroup = m_packedWeights.data() + group * taps * CHANNEL_LANES;
+                        Eigen::Index batchStart = batchBlockStart;
+                        for (; batchStart + BATCH_LANES <= batchBlockEnd; batchStart += BATCH_LANES)
+                        {
+                            convolvePixel<Packet, BATCH_PACKETS>(input, tapOffsets.data(), packedGroup, batchStart, oh, ow,
+                                                                 group * CHANNEL_LANES, output);
+                        }
+                        if (batchStart < batchBlockEnd)
+                        {
+                            convolvePixelTail<Packet>(input, tapOffsets.data(), packedGroup, batchStart, batchBlockEnd - batchStart,
+                                                      oh, ow, group * CHANNEL_LANES, output, std::true_type());
+                        }
+                    }
+                }
+            } });
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    void Conv2D<Dtype, Dims>::accumulateWeightGrad(const TensorView<Dtype, Dims> &accumulatedGrad, Eigen::Index kh,
+                                                   Eigen::Index kw, Eigen::Index inChannel, Eigen::Index channelStart,
+                                                   Eigen::Index ohStart, Eigen::Index ohEnd, Eigen::Index owStart,
+                                                   Eigen::Index owEnd)
+    {
+        using namespace Eigen::internal;
+        const Eigen::Index batchSize = m_inputCache.dimensions()[0];
+        const Eigen::Index height = m_inputCache.dimensions()[1];
+        const Eigen::Index width = m_inputCache.dimensions()[2];
+        const Eigen::Index numChannels = std::min<Eigen::Index>(CHANNEL_LANES, m_outChannels - channelStart);
+        const Eigen::Index vectorEnd = batchSize - batchSize % PACKET_SIZE;
+
+        Packet accumulator[CHANNEL_LANES];
+        Dtype tail[CHANNEL_LANES];
+        for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+        {
+            accumulator[channel] = pset1<Packet>(Dtype(0));
+            tail[channel] = 0;
+        }
+
+        for (Eigen::Index ow = owStart; ow < owEnd; ++ow)
+        {
+            const Eigen::Index iw = ow * m_stride - m_padding + kw;
+            if (iw < 0 || iw >= width)
+            {
+                continue;
+            }
+
+            for (Eigen::Index oh = ohStart; oh < ohEnd; ++oh)
+            {
+                const Eigen::Index ih = oh * m_stride - m_padding + kh;
+                if (ih < 0 || ih >= height)
+                {
+                    continue;
+                }
+
+                // Lanes past the last channel of a partial group repeat it, and their sums are dropped
+                const Dtype *in = &m_inputCache(0, ih, iw, inChannel);
+                const Dtype *grads[CHANNEL_LANES];
+                for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+                {
+                    grads[channel] = &accumulatedGrad(0, oh, ow, channelStart + std::min<Eigen::Index>(channel, numChannels - 1));
+                }
+                for (Eigen::Index n = 0; n < vectorEnd; n += PACKET_SIZE)
+                {
+                    const Packet values = ploadu<Packet>(in + n);
+                    for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+                    {
+                        accumulator[channel] = pmadd(ploadu<Packet>(grads[channel] + n), values, accumulator[channel]);
+                    }
+                }
+                if (vectorEnd < batchSize)
+                {
+                    dotTail<Packet>(in, grads, vectorEnd, batchSize, tail, std::true_type());
+                }
+            }
+        }
+
+        for (Eigen::Index channel = 0; channel < numChannels; ++channel)
+        {
+            m_weightsGrad(kh, kw, inChannel, channelStart + channel) += predux(accumulator[channel]) + tail[channel];
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename PacketType>
+    void Conv2D<Dtype, Dims>::dotTail(const Dtype *in, const Dtype *const *grads, Eigen::Index start, Eigen::Index end,
+                                      Dtype *sums, std::true_type)
+    {
+        using namespace Eigen::internal;
+        const Eigen::Index packetSize = unpacket_traits<PacketType>::size;
+        for (; start + packetSize <= end; start += packetSize)
+        {
+            const PacketType values = ploadu<PacketType>(in + start);
+            for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+            {
+                sums[channel] += predux(pmul(ploadu<PacketType>(grads[channel] + start), values));
+            }
+        }
+
+        typedef typename unpacket_traits<PacketType>::half HalfPacket;
+        if (start < end)
+        {
+            dotTail<HalfPacket>(in, grads, start, end, sums, std::integral_constant<bool, (sizeof(HalfPacket) < sizeof(PacketType))>());
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename PacketType>
+    void Conv2D<Dtype, Dims>::dotTail(const Dtype *in, const Dtype *const *grads, Eigen::Index start, Eigen::Index end,
+                                      Dtype *sums, std::false_type)
+    {
+        for (Eigen::Index n = start; n < end; ++n)
+        {
+            for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+            {
+                sums[channel] += grads[channel][n] * in[n];
+            }
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename TapFunction>
+    void Conv2D<Dtype, Dims>::forEachOutputTap(Eigen::Index ih, Eigen::Index iw, Eigen::Index outHeight,
+                                               Eigen::Index outWidth, TapFunction tapFunction) const
+    {
+        for (Eigen::Index kw = 0; kw < m_kernelWidth; ++kw)
+        {
+            const Eigen::Index strided = iw + m_padding - kw;
+            if (strided < 0 || strided % m_stride != 0 || strided / m_stride >= outWidth)
+            {
+                continue;
+            }
+
+            for (Eigen::Index kh = 0; kh < m_kernelHeight; ++kh)
+            {
+                const Eigen::Index stridedHeight = ih + m_padding - kh;
+                if (stridedHeight < 0 || stridedHeight % m_stride != 0 || stridedHeight / m_stride >= outHeight)
+                {
+                    continue;
+                }
+                tapFunction(kh, kw, stridedHeight / m_stride, strided / m_stride);
+            }
+        }
+    }
+
+    // Forced inline for the same reason as convolvePixel
+    template <typename Dtype, int Dims>
+    template <typename PacketType, int NumPackets>
+    EIGEN_ALWAYS_INLINE void Conv2D<Dtype, Dims>::backwardPixel(const TensorView<Dtype, Dims> &accumulatedGrad,
+                                                                const Dtype *packedGroup, Eigen::Index batchStart,
+                                                                Eigen::Index ih, Eigen::Index iw, Eigen::Index channelStart,
+                                                                Eigen::Tensor<Dtype, Dims> &inputGrad) const
+    {
+        using namespace Eigen::internal;
+        const Eigen::Index batchSize = accumulatedGrad.dimensions()[0];
+        const Eigen::Index outHeight = accumulatedGrad.dimensions()[1];
+        const Eigen::Index outWidth = accumulatedGrad.dimensions()[2];
+        const Eigen::Index numChannels = std::min<Eigen::Index>(CHANNEL_LANES, m_inChannels - channelStart);
+        const Eigen::Index packetSize = unpacket_traits<PacketType>::size;
+        const Eigen::Index gradChannelStride = batchSize * outHeight * outWidth;
+        const Eigen::Index weightChannelStride = m_kernelHeight * m_kernelWidth * CHANNEL_LANES;
+
+        PacketType accumulator[CHANNEL_LANES][NumPackets];
+        for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+        {
+            for (int packet = 0; packet < NumPackets; ++packet)
+            {
+                accumulator[channel][packet] = pset1<PacketType>(Dtype(0));
+            }
+        }
+
+        forEachOutputTap(ih, iw, outHeight, outWidth, [&](Eigen::Index kh, Eigen::Index kw, Eigen::Index oh, Eigen::Index ow)
+                         {
+            const Dtype *grad = accumulatedGrad.data() + batchStart + batchSize * (oh + outHeight * ow);
+            const Dtype *weights = packedGroup + (kh + m_kernelHeight * kw) * CHANNEL_LANES;
+            for (Eigen::Index outChannel = 0; outChannel < m_outChannels; ++outChannel)
+            {
+                PacketType values[NumPackets];
+                for (int packet = 0; packet < NumPackets; ++packet)
+                {
+                    values[packet] = ploadu<PacketType>(grad + outChannel * gradChannelStride + packet * packetSize);
+                }
+                for (int channel = 0; channel < CHANNEL_LANES; ++channel)
+                {
+                    const PacketType weight = pset1<PacketType>(weights[outChannel * weightChannelStride + channel]);
+                    for (int packet = 0; packet < NumPackets; ++packet)
+                    {
+                        accumulator[channel][packet] = pmadd(weight, values[packet], accumulator[channel][packet]);
+                    }
+                }
+            } });
+
+        for (Eigen::Index channel = 0; channel < numChannels; ++channel)
+        {
+            Dtype *out = &inputGrad(batchStart, ih, iw, channelStart + channel);
+            for (int packet = 0; packet < NumPackets; ++packet)
+            {
+                pstoreu(out + packet * packetSize, accumulator[channel][packet]);
+            }
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename PacketType>
+    void Conv2D<Dtype, Dims>::backwardPixelTail(const TensorView<Dtype, Dims> &accumulatedGrad, const Dtype *packedGroup,
+                                                Eigen::Index batchStart, Eigen::Index numBatch, Eigen::Index ih,
+                                                Eigen::Index iw, Eigen::Index channelStart,
+                                                Eigen::Tensor<Dtype, Dims> &inputGrad, std::true_type) const
+    {
+        using namespace Eigen::internal;
+        const Eigen::Index packetSize = unpacket_traits<PacketType>::size;
+        for (; numBatch >= packetSize; batchStart += packetSize, numBatch -= packetSize)
+        {
+            backwardPixel<PacketType, 1>(accumulatedGrad, packedGroup, batchStart, ih, iw, channelStart, inputGrad);
+        }
+
+        typedef typename unpacket_traits<PacketType>::half HalfPacket;
+        if (numBatch > 0)
+        {
+            backwardPixelTail<HalfPacket>(accumulatedGrad, packedGroup, batchStart, numBatch, ih, iw, channelStart, inputGrad,
+                                          std::integral_constant<bool, (sizeof(HalfPacket) < sizeof(PacketType))>());
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    template <typename PacketType>
+    void Conv2D<Dtype, Dims>::backwardPixelTail(const TensorView<Dtype, Dims> &accumulatedGrad, const Dtype *packedGroup,
+                                                Eigen::Index batchStart, Eigen::Index numBatch, Eigen::Index ih,
+                                                Eigen::Index iw, Eigen::Index channelStart,
+                                                Eigen::Tensor<Dtype, Dims> &inputGrad, std::false_type) const
+    {
+        // Dtype is a packet of one entry to Eigen's packet functions
+        for (; numBatch > 0; ++batchStart, --numBatch)
+        {
+            backwardPixel<Dtype, 1>(accumulatedGrad, packedGroup, batchStart, ih, iw, channelStart, inputGrad);
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> Conv2D<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        const Eigen::Index batchSize = m_inputCache.dimensions()[0];
+        const Eigen::Index height = m_inputCache.dimensions()[1];
+        const Eigen::Index width = m_inputCache.dimensions()[2];
+        const Eigen::Index outHeight = accumulatedGrad.dimensions()[1];
+        const Eigen::Index outWidth = accumulatedGrad.dimensions()[2];
+        assert(accumulatedGrad.dimensions() == getOutputShape(m_inputCache.dimensions()) &&
+               "Conv2D::backward dimensions of accumulatedGrad and inputCache do not match");
+
+        // Every task owns the weight gradient of one input channel for a group of output channels, and the bias
+        // gradient of the group in the task of the first input channel
+        const Eigen::Index numOutGroups = (m_outChannels + CHANNEL_LANES - 1) / CHANNEL_LANES;
+        parallelFor(numOutGroups * m_inChannels, [&](Eigen::Index task)
+                    {
+            const Eigen::Index inChannel = task % m_inChannels;
+            const Eigen::Index channelStart = (task / m_inChannels) * CHANNEL_LANES;
+            const Eigen::Index channelEnd = std::min<Eigen::Index>(channelStart + CHANNEL_LANES, m_outChannels);
+
+            if (m_useBias && inChannel == 0)
+            {
+                for (Eigen::Index outChannel = channelStart; outChannel < channelEnd; ++outChannel)
+                {
+                    const Dtype *grad = &accumulatedGrad(0, 0, 0, outChannel);
+                    Dtype biasGrad = 0;
+                    for (Eigen::Index ii = 0; ii < batchSize * outHeight * outWidth; ++ii)
+                    {
+                        biasGrad += grad[ii];
+                    }
+                    m_biasGrad(0, 0, 0, outChannel) = biasGrad;
+                }
+            }
+
+            for (Eigen::Index outChannel = channelStart; outChannel < channelEnd; ++outChannel)
+            {
+                for (Eigen::Index kw = 0; kw < m_kernelWidth; ++kw)
+                {
+                    for (Eigen::Index kh = 0; kh < m_kernelHeight; ++kh)
+                    {
+                        m_weightsGrad(kh, kw, inChannel, outChannel) = 0;
+                    }
+                }
+            }
+
+            // A block of output pixels keeps its gradient and input patch in cache while every tap reads them
+            for (Eigen::Index owStart = 0; owStart < outWidth; owStart += PIXEL_BLOCK)
+            {
+                for (Eigen::Index ohStart = 0; ohStart < outHeight; ohStart += PIXEL_BLOCK)
+                {
+                    for (Eigen::Index kw = 0; kw < m_kernelWidth; ++kw)
+                    {
+                        for (Eigen::Index kh = 0; kh < m_kernelHeight; ++kh)
+                        {
+                            accumulateWeightGrad(accumulatedGrad, kh, kw, inChannel, channelStart,
+                                                 ohStart, std::min(ohStart + PIXEL_BLOCK, outHeight),
+                                                 owStart, std::min(owStart + PIXEL_BLOCK, outWidth));
+                        }
+                    }
+                }
+            } });
+
+        // Pack the kernel transposed, so the CHANNEL_LANES input channels of a group are adjacent for every tap
+        // kh + kernelHeight * (kw + kernelWidth * outChannel), zero-padding the last group
+        const Eigen::Index numInGroups = (m_inChannels + CHANNEL_LANES - 1) / CHANNEL_LANES;
+        const Eigen::Index taps = m_kernelHeight * m_kernelWidth * m_outChannels;
+        Eigen::Tensor<Dtype, 1> packedWeights(numInGroups * taps * CHANNEL_LANES);
+        packedWeights.setZero();
+        for (Eigen::Index outChannel = 0; outChannel < m_outChannels; ++outChannel)
+        {
+            for (Eigen::Index inChannel = 0; inChannel < m_inChannels; ++inChannel)
+            {
+                Dtype *packed = packedWeights.data() + (inChannel / CHANNEL_LANES) * taps * CHANNEL_LANES + inChannel % CHANNEL_LANES;
+                for (Eigen::Index kw = 0; kw < m_kernelWidth; ++kw)
+                {
+                    for (Eigen::Index kh = 0; kh < m_kernelHeight; ++kh)
+                    {
+                        packed[(kh + m_kernelHeight * (kw + m_kernelWidth * outChannel)) * CHANNEL_LANES] =
+                            m_weights(kh, kw, inChannel, outChannel);
+                    }
+                }
+            }
+        }
+
+        // The input gradient is gathered per input pixel, so every task owns its entries: a block of the batch, a
+        // group of input channels and one input column, which keeps small batches and few channels parallel
+        Eigen::Tensor<Dtype, Dims> inputGrad(m_inputCache.dimensions());
+        const Eigen::Index numBatchBlocks = (batchSize + BATCH_BLOCK - 1) / BATCH_BLOCK;
+        parallelFor(numBatchBlocks * numInGroups * width, [&](Eigen::Index task)
+                    {
+            const Eigen::Index batchBlockStart = (task % numBatchBlocks) * BATCH_BLOCK;
+            const Eigen::Index batchBlockEnd = std::min(batchBlockStart + BATCH_BLOCK, batchSize);
+            const Eigen::Index group = (task / numBatchBlocks) % numInGroups;
+            const Eigen::Index iw = task / (numBatchBlocks * numInGroups);
+            const Dtype *packedGroup = packedWeights.data() + group * taps * CHANNEL_LANES;
+
+            for (Eigen::Index ih = 0; ih < height; ++ih)
+            {
+                Eigen::Index batchStart = batchBlockStart;
+                for (; batchStart + BATCH_LANES <= batchBlockEnd; batchStart += BATCH_LANES)
+                {
+                    backwardPixel<Packet, BATCH_PACKETS>(accumulatedGrad, packedGroup, batchStart, ih, iw,
+                                                         group * CHANNEL_LANES, inputGrad);
+                }
+                if (batchStart < batchBlockEnd)
+                {
+                    backwardPixelTail<Packet>(accumulatedGrad, packedGroup, batchStart, batchBlockEnd - batchStart, ih, iw,
+                                              group * CHANNEL_LANES, inputGrad, std::true_type());
+                }
+            } });
+        return inputGrad;
+    }
+
+    template <typename Dtype, int Dims>
+    void Conv2D<Dtype, Dims>::step()
+    {
+        if (!m_weightOptimizer)
+        {
+            return;
+        }
+
+        m_weightOptimizer->update(m_weights, m_weightsGrad);
+        m_packedWeightsValid = false;
+
+        if (m_useBias)
+        {
+            m_biasOptimizer->update(m_bias, m_biasGrad);
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void Conv2D<Dtype, Dims>::registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer)
+    {
+        m_weightOptimizer = std::move(optimizer->template createOptimizer<Dims>());
+
+        if (m_useBias)
+        {
+            m_biasOptimizer = std::move(optimizer->template createOptimizer<Dims>(/*decayWeights*/ false));
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void Conv2D<Dtype, Dims>::saveState(Snapshot<Dtype> &snapshot) const
+    {
+        snapshot.addTensor("Conv2D.weights", m_weights);
+        if (m_useBias)
+        {
+            snapshot.addTensor("Conv2D.bias", m_bias);
+        }
+
+        snapshot.addInteger("Conv2D.hasOptimizer", m_weightOptimizer != nullptr);
+        if (m_weightOptimizer)
+        {
+            m_weightOptimizer->saveState(snapshot);
+            if (m_useBias)
+            {
+                m_biasOptimizer->saveState(snapshot);
+            }
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    bool Conv2D<Dtype, Dims>::loadState(Snapshot<Dtype> &snapshot)
+    {
+        Eigen::Tensor<Dtype, Dims> weights, bias;
+        if (!snapshot.readTensor("Conv2D.weights", weights) || (m_useBias && !snapshot.readTensor("Conv2D.bias", bias)))
+        {
+            return false;
+        }
+
+        if (weights.dimensions() != m_weights.dimensions() || (m_useBias && bias.dimensions() != m_bias.dimensions()))
+        {
+            std::cerr << "Conv2D::loadState weights in snapshot do not match the layer shape" << std::endl;
+            return false;
+        }
+        m_weights = weights;
+        m_packedWeightsValid = false;
+        if (m_useBias)
+        {
+            m_bias = bias;
+        }
+
+        uint64_t hasOptimizer;
+        if (!snapshot.readInteger("Conv2D.hasOptimizer", hasOptimizer))
+        {
+            return false;
+        }
+
+        if (hasOptimizer)
+        {
+            if (!m_weightOptimizer)
+            {
+                std::cerr << "Conv2D::loadState snapshot has optimizer state, register an optimizer first" << std::endl;
+                return false;
+            }
+
+            if (!m_weightOptimizer->loadState(snapshot, m_weights) || (m_useBias && !m_biasOptimizer->loadState(snapshot, m_bias)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage Conv2D<Dtype, Dims>::memoryUsage() const
+    {
+        // The packed copy of the kernel lives as long as the weights, so it is counted with them
+        MemoryUsage usage;
+        usage.parameterBytes = tensorBytes(m_weights) + tensorBytes(m_bias) + tensorBytes(m_packedWeights);
+        usage.gradientBytes = tensorBytes(m_weightsGrad) + tensorBytes(m_biasGrad);
+        if (m_weightOptimizer)
+        {
+            usage.optimizerStateBytes = m_weightOptimizer->stateBytes() + (m_useBias ? m_biasOptimizer->stateBytes() : 0);
+        }
+        // Before the first forward there is no input, and no output shape to derive from it
+        if (m_inputCache.size() == 0)
+        {
+            return usage;
+        }
+        usage.activationBytes = tensorBytes(m_inputCache);
+
+        const auto outputShape = getOutputShape(m_inputCache.dimensions());
+        usage.temporaryBytes = std::max<size_t>(tensorBytes(m_inputCache),
+                                                outputShape[0] * outputShape[1] * outputShape[2] * outputShape[3] * sizeof(Dtype));
+        return usage;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage Conv2D<Dtype, Dims>::predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+    {
+        assert(shape[3] == m_inChannels && "Conv2D::predictMemoryUsage channels of input and weights do not match");
+        const size_t inputBytes = shape[0] * shape[1] * shape[2] * shape[3] * sizeof(Dtype);
+
+        MemoryUsage usage;
+        const Eigen::Index numGroups = (m_outChannels + CHANNEL_LANES - 1) / CHANNEL_LANES;
+        usage.gradientBytes = (m_weights.size() + m_bias.size()) * sizeof(Dtype);
+        usage.parameterBytes = usage.gradientBytes + numGroups * m_kernelHeight * m_kernelWidth * m_inChannels * CHANNEL_LANES * sizeof(Dtype);
+        if (m_weightOptimizer)
+        {
+            usage.optimizerStateBytes = m_weightOptimizer->predictStateBytes(m_weights.size()) +
+                                        (m_useBias ? m_biasOptimizer->predictStateBytes(m_bias.size()) : 0);
+        }
+        usage.activationBytes = inputBytes;
+
+        shape = getOutputShape(shape);
+        usage.temporaryBytes = std::max<size_t>(inputBytes, shape[0] * shape[1] * shape[2] * shape[3] * sizeof(Dtype));
+        return usage;
+    }
+}
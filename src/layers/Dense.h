@@ -19,9 +19,9 @@ namespace nn
             return name;
         }
 
-        Eigen::Tensor<Dtype, Dims> forward(const Eigen::Tensor<Dtype, Dims> &input);
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
 
-        Eigen::Tensor<Dtype, Dims> backward(const Eigen::Tensor<Dtype, Dims> &accumulatedGrad);
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
 
         Eigen::array<Eigen::Index, Dims> getOutputShape()
         {
@@ -30,9 +30,39 @@ namespace nn
 
         void step();
 
-        void registerOptimizer(std::shared_ptr<StochasticGradientDescent<Dtype>> optimizer);
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer);
 
-        void registerOptimizer(std::shared_ptr<Adam<Dtype>> optimizer);
+        void saveState(Snapshot<Dtype> &snapshot) const;
+
+        bool loadState(Snapshot<Dtype> &snapshot);
+
+        MemoryUsage memoryUsage() const;
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const;
+
+        void collectParameters(std::vector<ParameterView<Dtype>> &parameters)
+        {
+            parameters.push_back({m_weights.data(), m_weightsGrad.data(), m_weights.size()});
+            if (m_useBias)
+            {
+                parameters.push_back({m_bias.data(), m_biasGrad.data(), m_bias.size()});
+            }
+        }
+
+        bool usesBias() const
+        {
+            return m_useBias;
+        }
+
+        /**
+         * Fold a per-output affine transform y * scale + shift into the weights and bias of this layer.
+         * The layer must use a bias to take the shift, so its parameters and checkpoint layout stay the same.
+         * Drops the optimizer state, which no longer matches the folded weights. Register an optimizer again to
+         * fine-tune the folded layer.
+         * @param scale Tensor of shape (1, outputDimension)
+         * @param shift Tensor of shape (1, outputDimension)
+         */
+        void foldAffine(const Eigen::Tensor<Dtype, Dims> &scale, const Eigen::Tensor<Dtype, Dims> &shift);
 
     private:
         Eigen::array<Eigen::Index, Dims> m_outputShape; ///< The output shape of this layer
@@ -69,7 +99,7 @@ namespace nn
     };
 
     template <typename Dtype, int Dims>
-    Eigen::Tensor<Dtype, Dims> Dense<Dtype, Dims>::forward(const Eigen::Tensor<Dtype, Dims> &input)
+    Eigen::Tensor<Dtype, Dims> Dense<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
     {
         assert(input.dimensions()[1] == m_weights.dimensions()[0] &&
                "Dense::forward dimensions of input and weights do not match");
@@ -89,7 +119,7 @@ namespace nn
     }
 
     template <typename Dtype, int Dims>
-    Eigen::Tensor<Dtype, Dims> Dense<Dtype, Dims>::backward(const Eigen::Tensor<Dtype, Dims> &accumulatedGrad)
+    Eigen::Tensor<Dtype, Dims> Dense<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
     {
         assert(accumulatedGrad.dimensions()[0] == m_inputCache.dimensions()[0] &&
                "Dense::backward dimensions of accumulatedGrad and inputCache do not match");
@@ -112,33 +142,144 @@ namespace nn
     template <typename Dtype, int Dims>
     void Dense<Dtype, Dims>::step()
     {
-        m_weights -= m_weightOptimizer->weightUpdate(m_weightsGrad);
+        if (!m_weightOptimizer)
+        {
+            return;
+        }
+
+        m_weightOptimizer->update(m_weights, m_weightsGrad);
 
         if (m_useBias)
         {
-            m_bias -= m_biasOptimizer->weightUpdate(m_biasGrad);
+            m_biasOptimizer->update(m_bias, m_biasGrad);
         }
     }
 
     template <typename Dtype, int Dims>
-    void Dense<Dtype, Dims>::registerOptimizer(std::shared_ptr<StochasticGradientDescent<Dtype>> optimizer)
+    void Dense<Dtype, Dims>::registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer)
     {
         m_weightOptimizer = std::move(optimizer->template createOptimizer<Dims>());
 
         if (m_useBias)
         {
-            m_biasOptimizer = std::move(optimizer->template createOptimizer<Dims>());
+            m_biasOptimizer = std::move(optimizer->template createOptimizer<Dims>(/*decayWeights*/ false));
         }
     }
 
     template <typename Dtype, int Dims>
-    void Dense<Dtype, Dims>::registerOptimizer(std::shared_ptr<Adam<Dtype>> optimizer)
+    void Dense<Dtype, Dims>::saveState(Snapshot<Dtype> &snapshot) const
     {
-        m_weightOptimizer = std::move(optimizer->template createOptimizer<Dims>());
+        snapshot.addTensor("Dense.weights", m_weights);
+        if (m_useBias)
+        {
+            snapshot.addTensor("Dense.bias", m_bias);
+        }
+
+        // Optimizer state is optional so that inference-only networks can be checkpointed too
+        snapshot.addInteger("Dense.hasOptimizer", m_weightOptimizer != nullptr);
+        if (m_weightOptimizer)
+        {
+            m_weightOptimizer->saveState(snapshot);
+            if (m_useBias)
+            {
+                m_biasOptimizer->saveState(snapshot);
+            }
+        }
+    }
 
+    template <typename Dtype, int Dims>
+    bool Dense<Dtype, Dims>::loadState(Snapshot<Dtype> &snapshot)
+    {
+        Eigen::Tensor<Dtype, Dims> weights, bias;
+        if (!snapshot.readTensor("Dense.weights", weights) || (m_useBias && !snapshot.readTensor("Dense.bias", bias)))
+        {
+            return false;
+        }
+
+        if (weights.dimensions() != m_weights.dimensions() || (m_useBias && bias.dimensions() != m_bias.dimensions()))
+        {
+            std::cerr << "Dense::loadState weights in snapshot do not match the layer shape" << std::endl;
+            return false;
+        }
+        m_weights = weights;
         if (m_useBias)
         {
-            m_biasOptimizer = std::move(optimizer->template createOptimizer<Dims>());
+            m_bias = bias;
         }
+
+        uint64_t hasOptimizer;
+        if (!snapshot.readInteger("Dense.hasOptimizer", hasOptimizer))
+        {
+            return false;
+        }
+
+        if (hasOptimizer)
+        {
+            if (!m_weightOptimizer)
+            {
+                std::cerr << "Dense::loadState snapshot has optimizer state, register an optimizer first" << std::endl;
+                return false;
+            }
+
+            if (!m_weightOptimizer->loadState(snapshot, m_weights) || (m_useBias && !m_biasOptimizer->loadState(snapshot, m_bias)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage Dense<Dtype, Dims>::memoryUsage() const
+    {
+        MemoryUsage usage;
+        usage.parameterBytes = tensorBytes(m_weights) + tensorBytes(m_bias);
+        usage.gradientBytes = tensorBytes(m_weightsGrad) + tensorBytes(m_biasGrad);
+        if (m_weightOptimizer)
+        {
+            usage.optimizerStateBytes = m_weightOptimizer->stateBytes() + (m_useBias ? m_biasOptimizer->stateBytes() : 0);
+        }
+        usage.activationBytes = tensorBytes(m_inputCache);
+
+        // forward hands on a (batchSize, outputDimension) tensor, backward a (batchSize, inputDimension) one
+        usage.temporaryBytes = m_inputCache.dimensions()[0] *
+                               std::max(m_weights.dimensions()[0], m_weights.dimensions()[1]) * sizeof(Dtype);
+        return usage;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage Dense<Dtype, Dims>::predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+    {
+        assert(shape[1] == m_weights.dimensions()[0] &&
+               "Dense::predictMemoryUsage dimensions of input and weights do not match");
+        const Eigen::Index numWeights = m_weights.size();
+        const Eigen::Index numBias = m_bias.size();
+
+        MemoryUsage usage;
+        usage.parameterBytes = (numWeights + numBias) * sizeof(Dtype);
+        usage.gradientBytes = usage.parameterBytes;
+        if (m_weightOptimizer)
+        {
+            usage.optimizerStateBytes = m_weightOptimizer->predictStateBytes(numWeights) +
+                                        (m_useBias ? m_biasOptimizer->predictStateBytes(numBias) : 0);
+        }
+        usage.activationBytes = shape[0] * shape[1] * sizeof(Dtype);
+        usage.temporaryBytes = shape[0] * std::max(m_weights.dimensions()[0], m_weights.dimensions()[1]) * sizeof(Dtype);
+
+        shape[1] = m_weights.dimensions()[1];
+        return usage;
+    }
+
+    template <typename Dtype, int Dims>
+    void Dense<Dtype, Dims>::foldAffine(const Eigen::Tensor<Dtype, Dims> &scale, const Eigen::Tensor<Dtype, Dims> &shift)
+    {
+        assert(scale.dimensions()[1] == m_weights.dimensions()[1] && shift.dimensions()[1] == m_weights.dimensions()[1] &&
+               "Dense::foldAffine dimensions of scale/shift and weights do not match");
+        assert(m_useBias && "Dense::foldAffine needs a layer with a bias to take the shift");
+        m_weights = m_weights * scale.broadcast(Eigen::array<Eigen::Index, 2>{m_weights.dimensions()[0], 1});
+        m_bias = m_bias * scale + shift;
+
+        m_weightOptimizer.reset();
+        m_biasOptimizer.reset();
     }
 }
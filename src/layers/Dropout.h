@@ -0,0 +1,173 @@
+#pragma once
+
+#include "layers/Layer.h"
+
+#include <cstdint>
+#include <random>
+
+namespace nn
+{
+    namespace internal
+    {
+        /**
+         * Stateless 32 bit integer hash (lowbias32), used as a counter-based random number generator
+         */
+        inline uint32_t hashCounter(uint32_t x)
+        {
+            x ^= x >> 16;
+            x *= 0x7feb352dU;
+            x ^= x >> 15;
+            x *= 0x846ca68bU;
+            x ^= x >> 16;
+            return x;
+        }
+    }
+
+    /**
+     * Inverted dropout: in training every element is zeroed with probability rate and the rest scaled by
+     * 1 / (1 - rate), in inference the input is passed through untouched.
+     *
+     * The mask is drawn from a counter-based generator, hash(element index ^ hash(seed, call counter)), so
+     * it is computed in a branch-free loop that vectorizes, and backward regenerates it instead of caching it.
+     */
+    template <typename Dtype = float, int Dims = 2>
+    class Dropout : public Layer<Dtype, Dims>
+    {
+    public:
+        explicit Dropout(Dtype rate, uint32_t seed = std::random_device()());
+
+        const std::string &getName()
+        {
+            const static std::string name = "Dropout";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+        bool passesThrough() const
+        {
+            return !this->isTraining() || m_rate == 0;
+        }
+
+        void step() {}
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> /*optimizer*/) {}
+
+        void saveState(Snapshot<Dtype> &snapshot) const;
+
+        bool loadState(Snapshot<Dtype> &snapshot);
+
+        MemoryUsage memoryUsage() const
+        {
+            MemoryUsage usage;
+            usage.temporaryBytes = m_maskApplied ? m_lastInputSize * sizeof(Dtype) : 0;
+            return usage;
+        }
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+        {
+            MemoryUsage usage;
+            usage.temporaryBytes = passesThrough() ? 0 : shapeBytes<Dtype>(shape);
+            return usage;
+        }
+
+    protected:
+        void passThrough(const TensorView<Dtype, Dims> &input)
+        {
+            m_lastInputSize = input.size();
+            m_maskApplied = false;
+        }
+
+    private:
+        /**
+         * Multiply every element by the mask of the given call, i.e. 0 or 1 / (1 - rate)
+         */
+        Eigen::Tensor<Dtype, Dims> applyMask(const TensorView<Dtype, Dims> &tensor, uint32_t counter) const;
+
+        Dtype m_rate;                 ///< The probability of dropping an element
+        uint32_t m_threshold;         ///< Hashes below this value drop their element
+        uint32_t m_seed;              ///< The seed of the mask generator
+        uint32_t m_counter;           ///< The number of masks drawn so far
+        bool m_maskApplied;           ///< Whether the last forward applied a mask that backward has to apply too
+        Eigen::Index m_lastInputSize; ///< The number of elements of the last input
+    };
+
+    template <typename Dtype, int Dims>
+    Dropout<Dtype, Dims>::Dropout(Dtype rate, uint32_t seed) : m_rate(rate),
+                                                               m_seed(seed),
+                                                               m_counter(0),
+                                                               m_maskApplied(false),
+                                                               m_lastInputSize(0)
+    {
+        assert(rate >= 0 && rate < 1 && "Dropout rate has to be in [0, 1)");
+        m_threshold = static_cast<uint32_t>(static_cast<double>(rate) * 4294967296.0);
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> Dropout<Dtype, Dims>::applyMask(const TensorView<Dtype, Dims> &tensor,
+                                                               uint32_t counter) const
+    {
+        const uint32_t key = internal::hashCounter(m_seed ^ internal::hashCounter(counter));
+        const Dtype scale = 1 / (1 - m_rate);
+        const uint32_t threshold = m_threshold;
+
+        Eigen::Tensor<Dtype, Dims> output(tensor.dimensions());
+        const Dtype *in = tensor.data();
+        Dtype *out = output.data();
+        const Eigen::Index size = tensor.size();
+        for (Eigen::Index ii = 0; ii < size; ++ii)
+        {
+            const uint32_t bits = internal::hashCounter(static_cast<uint32_t>(ii) ^ key);
+            out[ii] = bits >= threshold ? in[ii] * scale : Dtype(0);
+        }
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> Dropout<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        m_lastInputSize = input.size();
+        m_maskApplied = this->isTraining() && m_rate > 0;
+        if (!m_maskApplied)
+        {
+            return input;
+        }
+
+        m_counter++;
+        return applyMask(input, m_counter);
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> Dropout<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        assert(accumulatedGrad.size() == m_lastInputSize &&
+               "Dropout::backward dimensions of accumulatedGrad and last input do not match");
+        if (!m_maskApplied)
+        {
+            return accumulatedGrad;
+        }
+        return applyMask(accumulatedGrad, m_counter);
+    }
+
+    template <typename Dtype, int Dims>
+    void Dropout<Dtype, Dims>::saveState(Snapshot<Dtype> &snapshot) const
+    {
+        snapshot.addInteger("Dropout.seed", m_seed);
+        snapshot.addInteger("Dropout.counter", m_counter);
+    }
+
+    template <typename Dtype, int Dims>
+    bool Dropout<Dtype, Dims>::loadState(Snapshot<Dtype> &snapshot)
+    {
+        uint64_t seed, counter;
+        if (!snapshot.readInteger("Dropout.seed", seed) || !snapshot.readInteger("Dropout.counter", counter))
+        {
+            return false;
+        }
+        m_seed = static_cast<uint32_t>(seed);
+        m_counter = static_cast<uint32_t>(counter);
+        return true;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "layers/Layer.h"
+
+namespace nn
+{
+    /**
+     * Flattens a (batchSize, d1, ..., dn) input of any rank to the (batchSize, d1 * ... * dn) input of Dense.
+     *
+     * With column-major storage the batch stays the contiguous dimension on both sides, so flattening only
+     * changes the shape of the activation handle and never touches its buffer.
+     */
+    template <typename Dtype = float>
+    class Flatten : public LayerBase<Dtype>
+    {
+    public:
+        Flatten() = default;
+
+        const std::string &getName()
+        {
+            const static std::string name = "Flatten";
+            return name;
+        }
+
+        Activation<Dtype> forwardActivation(const Activation<Dtype> &input)
+        {
+            m_inputShape = input.shape();
+            return input.reshape({input.dimension(0), input.size() / input.dimension(0)});
+        }
+
+        Activation<Dtype> backwardActivation(const Activation<Dtype> &accumulatedGrad)
+        {
+            return accumulatedGrad.reshape(m_inputShape);
+        }
+
+        bool passesThrough() const
+        {
+            return true;
+        }
+
+        void step() {}
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> /*optimizer*/) {}
+
+        void saveState(Snapshot<Dtype> & /*snapshot*/) const {}
+
+        bool loadState(Snapshot<Dtype> & /*snapshot*/) { return true; }
+
+        MemoryUsage memoryUsage() const
+        {
+            return MemoryUsage();
+        }
+
+        MemoryUsage predictActivationMemory(std::vector<Eigen::Index> &shape) const
+        {
+            Eigen::Index features = 1;
+            for (size_t ii = 1; ii < shape.size(); ++ii)
+            {
+                features *= shape[ii];
+            }
+            shape = {shape[0], features};
+            return MemoryUsage();
+        }
+
+    private:
+        std::vector<Eigen::Index> m_inputShape; ///< The shape of the last input
+    };
+}
@@ -3,24 +3,145 @@
 #include <iostream>
 #include <unsupported/Eigen/CXX11/Tensor>
 #include "optimizers/Optimizers.h"
+#include "utils/Activation.h"
+#include "utils/Checkpoint.h"
+#include "utils/MemoryUsage.h"
 
 namespace nn
 {
-    template <typename Dtype = float, int Dims = 2>
-    class Layer
+    /**
+     * A weight tensor of a layer and its gradient, viewed as flat buffers of the same size
+     */
+    template <typename Dtype>
+    struct ParameterView
+    {
+        Dtype *weights;
+        Dtype *gradient;
+        Eigen::Index size;
+    };
+
+    /**
+     * The rank independent part of a layer, which lets nn::Net chain layers of different ranks.
+     * Activations and gradients are passed as rank-agnostic handles, so a layer can change the rank of
+     * its input, e.g. Flatten, without copying it.
+     */
+    template <typename Dtype = float>
+    class LayerBase
     {
     public:
+        virtual ~LayerBase() = default;
+
         virtual const std::string &getName() = 0;
 
-        virtual Eigen::Tensor<Dtype, Dims> forward(const Eigen::Tensor<Dtype, Dims> &input) = 0;
+        virtual Activation<Dtype> forwardActivation(const Activation<Dtype> &input) = 0;
 
-        virtual Eigen::Tensor<Dtype, Dims> backward(const Eigen::Tensor<Dtype, Dims> &output) = 0;
+        virtual Activation<Dtype> backwardActivation(const Activation<Dtype> &accumulatedGrad) = 0;
 
         virtual void step() = 0;
 
-        virtual void registerOptimizer(std::shared_ptr<StochasticGradientDescent<Dtype>> optimizer) = 0;
+        virtual void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer) = 0;
+
+        virtual void saveState(Snapshot<Dtype> &snapshot) const = 0;
+
+        virtual bool loadState(Snapshot<Dtype> &snapshot) = 0;
+
+        virtual MemoryUsage memoryUsage() const = 0;
+
+        /**
+         * Predict the memory usage of this layer for an input of the given shape, of any rank
+         * @param shape The input shape, updated in place to the output shape of this layer
+         */
+        virtual MemoryUsage predictActivationMemory(std::vector<Eigen::Index> &shape) const = 0;
+
+        /**
+         * Append the weights of this layer and their gradients, in a fixed order, e.g. to reduce the gradients
+         * across processes. Layers without weights have none.
+         */
+        virtual void collectParameters(std::vector<ParameterView<Dtype>> & /*parameters*/) {}
+
+        /**
+         * Whether forward and backward currently hand on their input without allocating a new buffer, because
+         * the layer leaves it unchanged, e.g. Dropout in inference, or only reshapes it, e.g. Flatten
+         */
+        virtual bool passesThrough() const
+        {
+            return false;
+        }
+
+        /**
+         * Switch between training and inference behaviour, e.g. for Dropout and BatchNorm
+         */
+        void setTraining(bool training)
+        {
+            m_isTraining = training;
+        }
+
+        bool isTraining() const
+        {
+            return m_isTraining;
+        }
 
-        virtual void registerOptimizer(std::shared_ptr<Adam<Dtype>> optimizer) = 0;
+    protected:
+        bool m_isTraining = true; ///< Whether the layer is used for training or inference
     };
-}
 
+    /**
+     * A layer whose input and output are tensors of rank Dims
+     */
+    template <typename Dtype = float, int Dims = 2>
+    class Layer : public LayerBase<Dtype>
+    {
+    public:
+        virtual Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input) = 0;
+
+        virtual Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &output) = 0;
+
+        /**
+         * Predict the memory usage of this layer for an input of the given shape
+         * @param shape The input shape, updated in place to the output shape of this layer
+         */
+        virtual MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const = 0;
+
+        Activation<Dtype> forwardActivation(const Activation<Dtype> &input) final
+        {
+            // Hand on the incoming handle instead of copying it into the tensor forward would return. Backward
+            // follows what forward did, even if the layer switched between training and inference since.
+            m_passedThrough = this->passesThrough();
+            if (m_passedThrough)
+            {
+                passThrough(input.template view<Dims>());
+                return input;
+            }
+            return Activation<Dtype>(forward(input.template view<Dims>()));
+        }
+
+        Activation<Dtype> backwardActivation(const Activation<Dtype> &accumulatedGrad) final
+        {
+            if (m_passedThrough)
+            {
+                return accumulatedGrad;
+            }
+            return Activation<Dtype>(backward(accumulatedGrad.template view<Dims>()));
+        }
+
+        MemoryUsage predictActivationMemory(std::vector<Eigen::Index> &shape) const final
+        {
+            assert(shape.size() == Dims && "Layer::predictActivationMemory rank of shape does not match the layer");
+            Eigen::array<Eigen::Index, Dims> dimensions;
+            std::copy(shape.begin(), shape.end(), dimensions.begin());
+            const MemoryUsage usage = predictMemoryUsage(dimensions);
+            shape.assign(dimensions.begin(), dimensions.end());
+            return usage;
+        }
+
+    protected:
+        /**
+         * Called instead of forward when the layer passes its input through, to record what memoryUsage and a
+         * direct call of backward need to know about the input
+         */
+        virtual void passThrough(const TensorView<Dtype, Dims> & /*input*/) {}
+
+    private:
+        bool m_passedThrough = false; ///< Whether the last forward passed its input through
+    };
+}
@@ -0,0 +1,278 @@
+#pragma once
+
+#include "layers/Layer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace nn
+{
+    /**
+     * Layer normalization over the features of every sample of a (batchSize, numFeatures) input.
+     *
+     * A row of Eigen's column-major layout is strided, so rather than walking rows the kernel sweeps the input
+     * column by column once, accumulating the sum and squared sum of every row in contiguous per-row buffers.
+     * The inner loops run over contiguous memory and vectorize, and the input is read only once for the
+     * statistics and once for the normalization.
+     */
+    template <typename Dtype = float, int Dims = 2>
+    class LayerNorm : public Layer<Dtype, Dims>
+    {
+    public:
+        explicit LayerNorm(int numFeatures, Dtype epsilon = 1e-5);
+
+        const std::string &getName()
+        {
+            const static std::string name = "LayerNorm";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+        void step();
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer);
+
+        void saveState(Snapshot<Dtype> &snapshot) const;
+
+        bool loadState(Snapshot<Dtype> &snapshot);
+
+        MemoryUsage memoryUsage() const;
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const;
+
+        void collectParameters(std::vector<ParameterView<Dtype>> &parameters)
+        {
+            parameters.push_back({m_gamma.data(), m_gammaGrad.data(), m_gamma.size()});
+            parameters.push_back({m_beta.data(), m_betaGrad.data(), m_beta.size()});
+        }
+
+    private:
+        int m_numFeatures; ///< The number of features normalized per sample
+        Dtype m_epsilon;   ///< Added to the variance for numerical stability
+
+        Eigen::Tensor<Dtype, Dims> m_gamma; ///< The learned scale, shape (1, numFeatures)
+        Eigen::Tensor<Dtype, Dims> m_beta;  ///< The learned shift, shape (1, numFeatures)
+
+        Eigen::Tensor<Dtype, Dims> m_normalized; ///< Cache of the normalized input to calculate gradient
+        Eigen::Tensor<Dtype, 1> m_invStd;        ///< Cache of 1 / sqrt(var + epsilon) of every sample
+
+        // Gradients
+        Eigen::Tensor<Dtype, Dims> m_gammaGrad;                       ///< The gradient of the scale
+        Eigen::Tensor<Dtype, Dims> m_betaGrad;                        ///< The gradient of the shift
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> m_gammaOptimizer; ///< The optimizer of our scale
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> m_betaOptimizer;  ///< The optimizer of our shift
+    };
+
+    template <typename Dtype, int Dims>
+    LayerNorm<Dtype, Dims>::LayerNorm(int numFeatures, Dtype epsilon) : m_numFeatures(numFeatures), m_epsilon(epsilon)
+    {
+        m_gamma = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_gamma.setConstant(1);
+        m_beta = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_beta.setZero();
+
+        m_gammaGrad = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_gammaGrad.setZero();
+        m_betaGrad = Eigen::Tensor<Dtype, Dims>(1, numFeatures);
+        m_betaGrad.setZero();
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> LayerNorm<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        assert(input.dimensions()[1] == m_numFeatures && "LayerNorm::forward dimensions of input do not match");
+        const Eigen::Index batchSize = input.dimensions()[0];
+
+        Eigen::Tensor<Dtype, Dims> output(input.dimensions());
+        m_normalized = Eigen::Tensor<Dtype, Dims>(input.dimensions());
+
+        // Use the first feature of every row as a shift, which keeps sum(x^2) - sum(x)^2 / n from cancelling
+        // catastrophically when the mean is large compared to the spread
+        Eigen::Tensor<Dtype, 1> shift(batchSize), sum(batchSize), squaredSum(batchSize);
+        std::copy(input.data(), input.data() + batchSize, shift.data());
+        sum.setZero();
+        squaredSum.setZero();
+
+        for (Eigen::Index feature = 0; feature < m_numFeatures; ++feature)
+        {
+            const Dtype *in = input.data() + feature * batchSize;
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                const Dtype shifted = in[ii] - shift(ii);
+                sum(ii) += shifted;
+                squaredSum(ii) += shifted * shifted;
+            }
+        }
+
+        // Reuse the sum buffer for the per-row mean
+        m_invStd = Eigen::Tensor<Dtype, 1>(batchSize);
+        for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+        {
+            const Dtype shiftedMean = sum(ii) / m_numFeatures;
+            const Dtype variance = std::max(squaredSum(ii) / m_numFeatures - shiftedMean * shiftedMean, Dtype(0));
+            sum(ii) = shiftedMean + shift(ii);
+            m_invStd(ii) = 1 / std::sqrt(variance + m_epsilon);
+        }
+
+        for (Eigen::Index feature = 0; feature < m_numFeatures; ++feature)
+        {
+            const Dtype *in = input.data() + feature * batchSize;
+            Dtype *normalized = m_normalized.data() + feature * batchSize;
+            Dtype *out = output.data() + feature * batchSize;
+            const Dtype gamma = m_gamma(0, feature);
+            const Dtype beta = m_beta(0, feature);
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                normalized[ii] = (in[ii] - sum(ii)) * m_invStd(ii);
+                out[ii] = normalized[ii] * gamma + beta;
+            }
+        }
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> LayerNorm<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        assert(accumulatedGrad.dimensions() == m_normalized.dimensions() &&
+               "LayerNorm::backward dimensions of accumulatedGrad and cache do not match");
+        const Eigen::Index batchSize = accumulatedGrad.dimensions()[0];
+
+        Eigen::Tensor<Dtype, 1> gradSum(batchSize), gradNormalizedSum(batchSize);
+        gradSum.setZero();
+        gradNormalizedSum.setZero();
+
+        for (Eigen::Index feature = 0; feature < m_numFeatures; ++feature)
+        {
+            const Dtype *grad = accumulatedGrad.data() + feature * batchSize;
+            const Dtype *normalized = m_normalized.data() + feature * batchSize;
+            const Dtype gamma = m_gamma(0, feature);
+
+            Dtype betaGrad = 0;
+            Dtype gammaGrad = 0;
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                const Dtype scaledGrad = grad[ii] * gamma;
+                gradSum(ii) += scaledGrad;
+                gradNormalizedSum(ii) += scaledGrad * normalized[ii];
+                betaGrad += grad[ii];
+                gammaGrad += grad[ii] * normalized[ii];
+            }
+            m_betaGrad(0, feature) = betaGrad;
+            m_gammaGrad(0, feature) = gammaGrad;
+        }
+
+        // dx = invStd / D * (D * dxhat - sum(dxhat) - xhat * sum(dxhat * xhat)) with dxhat = dy * gamma
+        Eigen::Tensor<Dtype, Dims> inputGrad(accumulatedGrad.dimensions());
+        for (Eigen::Index feature = 0; feature < m_numFeatures; ++feature)
+        {
+            const Dtype *grad = accumulatedGrad.data() + feature * batchSize;
+            const Dtype *normalized = m_normalized.data() + feature * batchSize;
+            Dtype *out = inputGrad.data() + feature * batchSize;
+            const Dtype gamma = m_gamma(0, feature);
+            for (Eigen::Index ii = 0; ii < batchSize; ++ii)
+            {
+                out[ii] = m_invStd(ii) / m_numFeatures *
+                          (m_numFeatures * grad[ii] * gamma - gradSum(ii) - normalized[ii] * gradNormalizedSum(ii));
+            }
+        }
+        return inputGrad;
+    }
+
+    template <typename Dtype, int Dims>
+    void LayerNorm<Dtype, Dims>::step()
+    {
+        if (!m_gammaOptimizer)
+        {
+            return;
+        }
+
+        m_gammaOptimizer->update(m_gamma, m_gammaGrad);
+        m_betaOptimizer->update(m_beta, m_betaGrad);
+    }
+
+    template <typename Dtype, int Dims>
+    void LayerNorm<Dtype, Dims>::registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer)
+    {
+        m_gammaOptimizer = std::move(optimizer->template createOptimizer<Dims>(/*decayWeights*/ false));
+        m_betaOptimizer = std::move(optimizer->template createOptimizer<Dims>(/*decayWeights*/ false));
+    }
+
+    template <typename Dtype, int Dims>
+    void LayerNorm<Dtype, Dims>::saveState(Snapshot<Dtype> &snapshot) const
+    {
+        snapshot.addTensor("LayerNorm.gamma", m_gamma);
+        snapshot.addTensor("LayerNorm.beta", m_beta);
+
+        snapshot.addInteger("LayerNorm.hasOptimizer", m_gammaOptimizer != nullptr);
+        if (m_gammaOptimizer)
+        {
+            m_gammaOptimizer->saveState(snapshot);
+            m_betaOptimizer->saveState(snapshot);
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    bool LayerNorm<Dtype, Dims>::loadState(Snapshot<Dtype> &snapshot)
+    {
+        Eigen::Tensor<Dtype, Dims> gamma, beta;
+        uint64_t hasOptimizer;
+        if (!snapshot.readTensor("LayerNorm.gamma", gamma) || !snapshot.readTensor("LayerNorm.beta", beta) ||
+            !snapshot.readInteger("LayerNorm.hasOptimizer", hasOptimizer))
+        {
+            return false;
+        }
+
+        if (gamma.dimensions() != m_gamma.dimensions() || beta.dimensions() != m_gamma.dimensions())
+        {
+            std::cerr << "LayerNorm::loadState number of features in snapshot does not match the layer" << std::endl;
+            return false;
+        }
+        m_gamma = gamma;
+        m_beta = beta;
+
+        if (hasOptimizer)
+        {
+            if (!m_gammaOptimizer)
+            {
+                std::cerr << "LayerNorm::loadState snapshot has optimizer state, register an optimizer first" << std::endl;
+                return false;
+            }
+            return m_gammaOptimizer->loadState(snapshot, m_gamma) && m_betaOptimizer->loadState(snapshot, m_beta);
+        }
+        return true;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage LayerNorm<Dtype, Dims>::memoryUsage() const
+    {
+        MemoryUsage usage;
+        usage.parameterBytes = tensorBytes(m_gamma) + tensorBytes(m_beta);
+        usage.gradientBytes = tensorBytes(m_gammaGrad) + tensorBytes(m_betaGrad);
+        if (m_gammaOptimizer)
+        {
+            usage.optimizerStateBytes = m_gammaOptimizer->stateBytes() + m_betaOptimizer->stateBytes();
+        }
+        usage.activationBytes = tensorBytes(m_normalized) + tensorBytes(m_invStd);
+        usage.temporaryBytes = tensorBytes(m_normalized);
+        return usage;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage LayerNorm<Dtype, Dims>::predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+    {
+        assert(shape[1] == m_numFeatures && "LayerNorm::predictMemoryUsage dimensions of input do not match");
+        MemoryUsage usage;
+        usage.parameterBytes = 2 * m_numFeatures * sizeof(Dtype);
+        usage.gradientBytes = usage.parameterBytes;
+        if (m_gammaOptimizer)
+        {
+            usage.optimizerStateBytes = 2 * m_gammaOptimizer->predictStateBytes(m_numFeatures);
+        }
+        usage.activationBytes = shape[0] * (m_numFeatures + 1) * sizeof(Dtype);
+        usage.temporaryBytes = shape[0] * m_numFeatures * sizeof(Dtype);
+        return usage;
+    }
+}
@@ -4,4 +4,11 @@
 #include "Dense.h"
 #include "Softmax.h"
 #include "Relu.h"
-
+#include "BatchNorm.h"
+#include "LayerNorm.h"
+#include "Dropout.h"
+#include "Conv2D.h"
+#include "Pooling.h"
+#include "Recurrent.h"
+#include "Flatten.h"
+#include "Reshape.h"
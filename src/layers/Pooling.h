@@ -0,0 +1,294 @@
+#pragma once
+
+#include "layers/Layer.h"
+#include "utils/Parallel.h"
+
+#include <limits>
+
+namespace nn
+{
+    namespace internal
+    {
+        inline Eigen::array<Eigen::Index, 4> poolOutputShape(const Eigen::array<Eigen::Index, 4> &inputShape,
+                                                             int poolHeight, int poolWidth, int strideHeight, int strideWidth)
+        {
+            // The input has to fit at least one window, or the output would have no or negative extent
+            assert(inputShape[1] >= poolHeight && inputShape[2] >= poolWidth && "Pooling window is larger than the input");
+            return {inputShape[0],
+                    (inputShape[1] - poolHeight) / strideHeight + 1,
+                    (inputShape[2] - poolWidth) / strideWidth + 1,
+                    inputShape[3]};
+        }
+    }
+
+    /**
+     * Max pooling over the height and width of a (batchSize, height, width, channels) input.
+     * Channels are independent and processed in parallel; within a window the batch is the contiguous,
+     * vectorized dimension, as in Conv2D.
+     */
+    template <typename Dtype = float, int Dims = 4>
+    class MaxPool2D : public Layer<Dtype, Dims>
+    {
+    public:
+        /**
+         * @param stride Step between windows, 0 for non-overlapping windows
+         */
+        explicit MaxPool2D(int poolHeight, int poolWidth, int stride = 0) : m_poolHeight(poolHeight),
+                                                                            m_poolWidth(poolWidth),
+                                                                            m_strideHeight(stride > 0 ? stride : poolHeight),
+                                                                            m_strideWidth(stride > 0 ? stride : poolWidth)
+        {
+            static_assert(Dims == 4, "MaxPool2D operates on (batchSize, height, width, channels) tensors");
+            assert(poolHeight > 0 && poolWidth > 0 && stride >= 0 && "MaxPool2D window has to be positive and stride non-negative");
+        }
+
+        const std::string &getName()
+        {
+            const static std::string name = "MaxPool2D";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+        void step() {}
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> /*optimizer*/) {}
+
+        void saveState(Snapshot<Dtype> & /*snapshot*/) const {}
+
+        bool loadState(Snapshot<Dtype> & /*snapshot*/) { return true; }
+
+        MemoryUsage memoryUsage() const
+        {
+            MemoryUsage usage;
+            usage.activationBytes = m_argmax.size() * sizeof(int);
+            usage.temporaryBytes = m_inputShape[0] * m_inputShape[1] * m_inputShape[2] * m_inputShape[3] * sizeof(Dtype);
+            return usage;
+        }
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+        {
+            MemoryUsage usage;
+            usage.temporaryBytes = shape[0] * shape[1] * shape[2] * shape[3] * sizeof(Dtype);
+            shape = internal::poolOutputShape(shape, m_poolHeight, m_poolWidth, m_strideHeight, m_strideWidth);
+            usage.activationBytes = shape[0] * shape[1] * shape[2] * shape[3] * sizeof(int);
+            return usage;
+        }
+
+    private:
+        int m_poolHeight;
+        int m_poolWidth;
+        int m_strideHeight;
+        int m_strideWidth;
+
+        Eigen::array<Eigen::Index, Dims> m_inputShape{}; ///< The shape of the last input
+        Eigen::Tensor<int, Dims> m_argmax;               ///< Position of the maximum within every window
+    };
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> MaxPool2D<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        m_inputShape = input.dimensions();
+        const auto outputShape = internal::poolOutputShape(m_inputShape, m_poolHeight, m_poolWidth,
+                                                           m_strideHeight, m_strideWidth);
+        const Eigen::Index batchSize = outputShape[0];
+        Eigen::Tensor<Dtype, Dims> output(outputShape);
+        m_argmax = Eigen::Tensor<int, Dims>(outputShape);
+
+        parallelFor(outputShape[3], [&](Eigen::Index channel)
+                    {
+            for (Eigen::Index ow = 0; ow < outputShape[2]; ++ow)
+            {
+                for (Eigen::Index oh = 0; oh < outputShape[1]; ++oh)
+                {
+                    Dtype *out = &output(0, oh, ow, channel);
+                    int *argmax = &m_argmax(0, oh, ow, channel);
+                    for (Eigen::Index n = 0; n < batchSize; ++n)
+                    {
+                        out[n] = -std::numeric_limits<Dtype>::infinity();
+                        argmax[n] = 0;
+                    }
+
+                    for (int kw = 0; kw < m_poolWidth; ++kw)
+                    {
+                        for (int kh = 0; kh < m_poolHeight; ++kh)
+                        {
+                            const int position = kh + kw * m_poolHeight;
+                            const Dtype *in = &input(0, oh * m_strideHeight + kh, ow * m_strideWidth + kw, channel);
+                            for (Eigen::Index n = 0; n < batchSize; ++n)
+                            {
+                                const bool larger = in[n] > out[n];
+                                out[n] = larger ? in[n] : out[n];
+                                argmax[n] = larger ? position : argmax[n];
+                            }
+                        }
+                    }
+                }
+            } });
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> MaxPool2D<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        assert(accumulatedGrad.dimensions() == m_argmax.dimensions() &&
+               "MaxPool2D::backward dimensions of accumulatedGrad and last output do not match");
+        const Eigen::Index batchSize = m_inputShape[0];
+        Eigen::Tensor<Dtype, Dims> inputGrad(m_inputShape);
+        inputGrad.setZero();
+
+        parallelFor(m_inputShape[3], [&](Eigen::Index channel)
+                    {
+            for (Eigen::Index ow = 0; ow < accumulatedGrad.dimensions()[2]; ++ow)
+            {
+                for (Eigen::Index oh = 0; oh < accumulatedGrad.dimensions()[1]; ++oh)
+                {
+                    const Dtype *grad = &accumulatedGrad(0, oh, ow, channel);
+                    const int *argmax = &m_argmax(0, oh, ow, channel);
+                    for (Eigen::Index n = 0; n < batchSize; ++n)
+                    {
+                        const int kh = argmax[n] % m_poolHeight;
+                        const int kw = argmax[n] / m_poolHeight;
+                        inputGrad(n, oh * m_strideHeight + kh, ow * m_strideWidth + kw, channel) += grad[n];
+                    }
+                }
+            } });
+        return inputGrad;
+    }
+
+    /**
+     * Average pooling over the height and width of a (batchSize, height, width, channels) input
+     */
+    template <typename Dtype = float, int Dims = 4>
+    class AvgPool2D : public Layer<Dtype, Dims>
+    {
+    public:
+        /**
+         * @param stride Step between windows, 0 for non-overlapping windows
+         */
+        explicit AvgPool2D(int poolHeight, int poolWidth, int stride = 0) : m_poolHeight(poolHeight),
+                                                                            m_poolWidth(poolWidth),
+                                                                            m_strideHeight(stride > 0 ? stride : poolHeight),
+                                                                            m_strideWidth(stride > 0 ? stride : poolWidth)
+        {
+            static_assert(Dims == 4, "AvgPool2D operates on (batchSize, height, width, channels) tensors");
+            assert(poolHeight > 0 && poolWidth > 0 && stride >= 0 && "AvgPool2D window has to be positive and stride non-negative");
+        }
+
+        const std::string &getName()
+        {
+            const static std::string name = "AvgPool2D";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+        void step() {}
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> /*optimizer*/) {}
+
+        void saveState(Snapshot<Dtype> & /*snapshot*/) const {}
+
+        bool loadState(Snapshot<Dtype> & /*snapshot*/) { return true; }
+
+        MemoryUsage memoryUsage() const
+        {
+            MemoryUsage usage;
+            usage.temporaryBytes = m_inputShape[0] * m_inputShape[1] * m_inputShape[2] * m_inputShape[3] * sizeof(Dtype);
+            return usage;
+        }
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+        {
+            MemoryUsage usage;
+            usage.temporaryBytes = shape[0] * shape[1] * shape[2] * shape[3] * sizeof(Dtype);
+            shape = internal::poolOutputShape(shape, m_poolHeight, m_poolWidth, m_strideHeight, m_strideWidth);
+            return usage;
+        }
+
+    private:
+        int m_poolHeight;
+        int m_poolWidth;
+        int m_strideHeight;
+        int m_strideWidth;
+
+        Eigen::array<Eigen::Index, Dims> m_inputShape{}; ///< The shape of the last input
+    };
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> AvgPool2D<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        m_inputShape = input.dimensions();
+        const auto outputShape = internal::poolOutputShape(m_inputShape, m_poolHeight, m_poolWidth,
+                                                           m_strideHeight, m_strideWidth);
+        const Eigen::Index batchSize = outputShape[0];
+        const Dtype scale = Dtype(1) / (m_poolHeight * m_poolWidth);
+        Eigen::Tensor<Dtype, Dims> output(outputShape);
+        output.setZero();
+
+        parallelFor(outputShape[3], [&](Eigen::Index channel)
+                    {
+            for (Eigen::Index ow = 0; ow < outputShape[2]; ++ow)
+            {
+                for (Eigen::Index oh = 0; oh < outputShape[1]; ++oh)
+                {
+                    Dtype *out = &output(0, oh, ow, channel);
+                    for (int kw = 0; kw < m_poolWidth; ++kw)
+                    {
+                        for (int kh = 0; kh < m_poolHeight; ++kh)
+                        {
+                            const Dtype *in = &input(0, oh * m_strideHeight + kh, ow * m_strideWidth + kw, channel);
+                            for (Eigen::Index n = 0; n < batchSize; ++n)
+                            {
+                                out[n] += in[n];
+                            }
+                        }
+                    }
+
+                    for (Eigen::Index n = 0; n < batchSize; ++n)
+                    {
+                        out[n] *= scale;
+                    }
+                }
+            } });
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> AvgPool2D<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        assert(accumulatedGrad.dimensions() == internal::poolOutputShape(m_inputShape, m_poolHeight, m_poolWidth,
+                                                                         m_strideHeight, m_strideWidth) &&
+               "AvgPool2D::backward dimensions of accumulatedGrad and last output do not match");
+        const Eigen::Index batchSize = m_inputShape[0];
+        const Dtype scale = Dtype(1) / (m_poolHeight * m_poolWidth);
+        Eigen::Tensor<Dtype, Dims> inputGrad(m_inputShape);
+        inputGrad.setZero();
+
+        parallelFor(m_inputShape[3], [&](Eigen::Index channel)
+                    {
+            for (Eigen::Index ow = 0; ow < accumulatedGrad.dimensions()[2]; ++ow)
+            {
+                for (Eigen::Index oh = 0; oh < accumulatedGrad.dimensions()[1]; ++oh)
+                {
+                    const Dtype *grad = &accumulatedGrad(0, oh, ow, channel);
+                    for (int kw = 0; kw < m_poolWidth; ++kw)
+                    {
+                        for (int kh = 0; kh < m_poolHeight; ++kh)
+                        {
+                            Dtype *out = &inputGrad(0, oh * m_strideHeight + kh, ow * m_strideWidth + kw, channel);
+                            for (Eigen::Index n = 0; n < batchSize; ++n)
+                            {
+                                out[n] += grad[n] * scale;
+                            }
+                        }
+                    }
+                }
+            } });
+        return inputGrad;
+    }
+}
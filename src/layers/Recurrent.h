@@ -0,0 +1,791 @@
+#pragma once
+
+#include "layers/Layer.h"
+#include "utils/WeightInitializers.h"
+
+namespace nn
+{
+    /**
+     * Shared parameters and buffers of the recurrent layers over (batchSize, timeSteps, features) inputs.
+     *
+     * With column-major storage a (batchSize, timeSteps, features) tensor is also a (batchSize * timeSteps,
+     * features) matrix whose rows [batchSize * t, batchSize * (t + 1)) hold timestep t. That lets the input
+     * projection of all timesteps, the weight gradients and the input gradient each be one large GEMM over the
+     * whole sequence, while only the recurrent matmul runs per timestep. The weights of all gates are
+     * concatenated, so that per-step matmul is a single GEMM for every gate.
+     *
+     * The gate buffers are kept transposed, as (columns, batchSize * timeSteps) matrices, so the
+     * (columns, batchSize) block of every timestep is contiguous for the per-step GEMM and the gate math.
+     * The hidden states keep the layout of the output, so returning them is a plain copy.
+     * For long sequences the input projection is split into a few GEMMs over blocks of timesteps, each run
+     * right before its block is consumed, so the projected gates are still in cache when the recurrence reads
+     * them instead of streaming the whole sequence through memory twice.
+     *
+     * The per-sequence buffers for the gates, states and their gradients are kept between calls and only
+     * reallocated when the batch size or sequence length changes.
+     */
+    template <typename Dtype = float, int Dims = 3>
+    class RecurrentLayer : public Layer<Dtype, Dims>
+    {
+    public:
+        void step();
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer);
+
+        void saveState(Snapshot<Dtype> &snapshot) const;
+
+        bool loadState(Snapshot<Dtype> &snapshot);
+
+        MemoryUsage memoryUsage() const;
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const;
+
+        void collectParameters(std::vector<ParameterView<Dtype>> &parameters)
+        {
+            parameters.push_back({m_inputWeights.data(), m_inputWeightsGrad.data(), m_inputWeights.size()});
+            parameters.push_back({m_recurrentWeights.data(), m_recurrentWeightsGrad.data(), m_recurrentWeights.size()});
+            parameters.push_back({m_bias.data(), m_biasGrad.data(), m_bias.size()});
+            if (m_useRecurrentBias)
+            {
+                parameters.push_back({m_recurrentBias.data(), m_recurrentBiasGrad.data(), m_recurrentBias.size()});
+            }
+        }
+
+        const Eigen::Tensor<Dtype, 2> &getInputWeights() const
+        {
+            return m_inputWeights;
+        }
+
+        const Eigen::Tensor<Dtype, 2> &getRecurrentWeights() const
+        {
+            return m_recurrentWeights;
+        }
+
+    protected:
+        typedef Eigen::Matrix<Dtype, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+        typedef Eigen::Map<Matrix> MatrixMap;
+        typedef Eigen::Map<const Matrix> ConstMatrixMap;
+        typedef Eigen::Map<Matrix, Eigen::Unaligned, Eigen::OuterStride<>> StridedMap;
+        typedef Eigen::Map<const Matrix, Eigen::Unaligned, Eigen::OuterStride<>> ConstStridedMap;
+
+        /**
+         * @param name Prefix of the checkpoint records
+         * @param numGates The number of gates, whose weights are concatenated along the columns
+         * @param returnSequences Whether to output the hidden state of every timestep, or only of the last one
+         * as a (batchSize, 1, hiddenSize) tensor
+         * @param useRecurrentBias Whether the recurrent projection has a bias of its own
+         */
+        RecurrentLayer(const std::string &name, int inputSize, int hiddenSize, int numGates, bool returnSequences,
+                       bool useRecurrentBias, InitializationScheme weightInitializer);
+
+        static MatrixMap matrix(Eigen::Tensor<Dtype, 2> &tensor)
+        {
+            return MatrixMap(tensor.data(), tensor.dimension(0), tensor.dimension(1));
+        }
+
+        static ConstMatrixMap matrix(const Eigen::Tensor<Dtype, 2> &tensor)
+        {
+            return ConstMatrixMap(tensor.data(), tensor.dimension(0), tensor.dimension(1));
+        }
+
+        /**
+         * The contiguous (columns, batchSize) block of timestep t of a (columns, batchSize * timeSteps) buffer
+         */
+        MatrixMap stepColumns(Eigen::Tensor<Dtype, 2> &buffer, Eigen::Index t) const
+        {
+            return MatrixMap(buffer.data() + buffer.dimension(0) * m_batchSize * t, buffer.dimension(0), m_batchSize);
+        }
+
+        ConstMatrixMap stepColumns(const Eigen::Tensor<Dtype, 2> &buffer, Eigen::Index t) const
+        {
+            return ConstMatrixMap(buffer.data() + buffer.dimension(0) * m_batchSize * t, buffer.dimension(0), m_batchSize);
+        }
+
+        /**
+         * The (batchSize, hiddenSize) hidden state of timestep t, rows of the (batchSize * timeSteps, hiddenSize) m_hidden
+         */
+        StridedMap hiddenRows(Eigen::Index t)
+        {
+            return StridedMap(m_hidden.data() + m_batchSize * t, m_batchSize, m_hiddenSize,
+                              Eigen::OuterStride<>(m_batchSize * m_timeSteps));
+        }
+
+        /**
+         * Store the hidden state of timestep t, computed transposed in m_hiddenStep, in m_hidden. The state stays
+         * in m_hiddenStep as the contiguous input of the next recurrent GEMM.
+         */
+        void storeHidden(Eigen::Index t)
+        {
+            hiddenRows(t) = matrix(m_hiddenStep).transpose();
+        }
+
+        /**
+         * Cache the input and reallocate the sequence buffers if its shape changed
+         */
+        void beginForward(const TensorView<Dtype, Dims> &input);
+
+        /**
+         * At the start of every block of timesteps, project the input of the whole block with one GEMM:
+         * m_gates = (input * inputWeights + bias)^T
+         */
+        void projectInput(Eigen::Index t);
+
+        /**
+         * Copy the hidden states to the output, every timestep or only the last one
+         */
+        Eigen::Tensor<Dtype, Dims> hiddenOutput() const;
+
+        /**
+         * Add the gradient the output passes to the hidden state of timestep t to m_hiddenGrad
+         */
+        void addOutputGrad(const TensorView<Dtype, Dims> &accumulatedGrad, Eigen::Index t);
+
+        /**
+         * Calculate the weight gradients of the whole sequence with one GEMM each and return the input gradient
+         * @param inputSideGrad The transposed gradient of the input projection of every timestep
+         * @param recurrentSideGrad The transposed gradient of the recurrent projection of every timestep
+         */
+        Eigen::Tensor<Dtype, Dims> endBackward(const Eigen::Tensor<Dtype, 2> &inputSideGrad,
+                                               const Eigen::Tensor<Dtype, 2> &recurrentSideGrad);
+
+        /**
+         * Allocate the buffers the subclass needs on top of the shared ones for a new batch size or sequence length
+         */
+        virtual void resizeBuffers() = 0;
+
+        /**
+         * The number of (hiddenSize, batchSize * timeSteps) sized buffers and of (hiddenSize, batchSize) sized
+         * buffers the subclass keeps on top of the shared ones
+         */
+        virtual void bufferCounts(Eigen::Index &sequenceBuffers, Eigen::Index &stepBuffers) const = 0;
+
+        int m_inputSize;
+        int m_hiddenSize;
+        int m_numGates;
+        bool m_returnSequences;
+        bool m_useRecurrentBias;
+        std::string m_name;
+
+        Eigen::Index m_batchSize = 0; ///< The batch size of the current buffers
+        Eigen::Index m_timeSteps = 0; ///< The sequence length of the current buffers
+        Eigen::Index m_blockSteps = 0; ///< The number of timesteps projected by one GEMM
+
+        static const size_t PROJECTION_BLOCK_BYTES = 1 << 20; ///< Size of the gates projected at once, about a L2 cache
+
+        Eigen::Tensor<Dtype, Dims> m_inputCache; ///< Cache the input to calculate gradient
+        Eigen::Tensor<Dtype, 2> m_gates;         ///< The activated gates of every timestep, (numGates * hiddenSize, batchSize * timeSteps)
+        Eigen::Tensor<Dtype, 2> m_hidden;        ///< The hidden state of every timestep, (batchSize * timeSteps, hiddenSize)
+        Eigen::Tensor<Dtype, 2> m_gatesGrad;     ///< The gradient of the gate pre-activations of every timestep
+        Eigen::Tensor<Dtype, 2> m_hiddenStep;    ///< The hidden state of the current timestep, transposed to (hiddenSize, batchSize)
+        Eigen::Tensor<Dtype, 2> m_hiddenGrad;    ///< The gradient of the hidden state of the current timestep, (hiddenSize, batchSize)
+
+        Eigen::Tensor<Dtype, 2> m_inputWeights;     ///< The input weights of all gates, (inputSize, numGates * hiddenSize)
+        Eigen::Tensor<Dtype, 2> m_recurrentWeights; ///< The recurrent weights of all gates, (hiddenSize, numGates * hiddenSize)
+        Eigen::Tensor<Dtype, 2> m_bias;             ///< The bias of the input projection, (1, numGates * hiddenSize)
+        Eigen::Tensor<Dtype, 2> m_recurrentBias;    ///< The bias of the recurrent projection if used
+
+        // Gradients
+        Eigen::Tensor<Dtype, 2> m_inputWeightsGrad;
+        Eigen::Tensor<Dtype, 2> m_recurrentWeightsGrad;
+        Eigen::Tensor<Dtype, 2> m_biasGrad;
+        Eigen::Tensor<Dtype, 2> m_recurrentBiasGrad;
+        std::unique_ptr<OptimizerImpl<Dtype, 2>> m_inputWeightsOptimizer;
+        std::unique_ptr<OptimizerImpl<Dtype, 2>> m_recurrentWeightsOptimizer;
+        std::unique_ptr<OptimizerImpl<Dtype, 2>> m_biasOptimizer;
+        std::unique_ptr<OptimizerImpl<Dtype, 2>> m_recurrentBiasOptimizer;
+    };
+
+    template <typename Dtype, int Dims>
+    RecurrentLayer<Dtype, Dims>::RecurrentLayer(const std::string &name, int inputSize, int hiddenSize, int numGates,
+                                                bool returnSequences, bool useRecurrentBias,
+                                                InitializationScheme weightInitializer) : m_inputSize(inputSize),
+                                                                                          m_hiddenSize(hiddenSize),
+                                                                                          m_numGates(numGates),
+                                                                                          m_returnSequences(returnSequences),
+                                                                                          m_useRecurrentBias(useRecurrentBias),
+                                                                                          m_name(name)
+    {
+        static_assert(Dims == 3, "Recurrent layers operate on (batchSize, timeSteps, features) tensors");
+
+        const int gateColumns = numGates * hiddenSize;
+        m_inputWeights = getRandomWeights<Dtype>(inputSize, gateColumns, weightInitializer);
+        m_recurrentWeights = getRandomWeights<Dtype>(hiddenSize, gateColumns, weightInitializer);
+        m_bias = Eigen::Tensor<Dtype, 2>(1, gateColumns);
+        m_bias.setZero();
+
+        m_inputWeightsGrad = Eigen::Tensor<Dtype, 2>(m_inputWeights.dimensions());
+        m_inputWeightsGrad.setZero();
+        m_recurrentWeightsGrad = Eigen::Tensor<Dtype, 2>(m_recurrentWeights.dimensions());
+        m_recurrentWeightsGrad.setZero();
+        m_biasGrad = Eigen::Tensor<Dtype, 2>(1, gateColumns);
+        m_biasGrad.setZero();
+
+        if (useRecurrentBias)
+        {
+            m_recurrentBias = Eigen::Tensor<Dtype, 2>(1, gateColumns);
+            m_recurrentBias.setZero();
+            m_recurrentBiasGrad = Eigen::Tensor<Dtype, 2>(1, gateColumns);
+            m_recurrentBiasGrad.setZero();
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void RecurrentLayer<Dtype, Dims>::beginForward(const TensorView<Dtype, Dims> &input)
+    {
+        assert(input.dimension(2) == m_inputSize && "Recurrent layer forward dimensions of input and weights do not match");
+        m_inputCache = input;
+
+        if (input.dimension(0) != m_batchSize || input.dimension(1) != m_timeSteps)
+        {
+            m_batchSize = input.dimension(0);
+            m_timeSteps = input.dimension(1);
+            const Eigen::Index rows = m_batchSize * m_timeSteps;
+            m_gates = Eigen::Tensor<Dtype, 2>(m_numGates * m_hiddenSize, rows);
+            m_gatesGrad = Eigen::Tensor<Dtype, 2>(m_numGates * m_hiddenSize, rows);
+            m_hidden = Eigen::Tensor<Dtype, 2>(rows, m_hiddenSize);
+            m_hiddenStep = Eigen::Tensor<Dtype, 2>(m_hiddenSize, m_batchSize);
+            m_hiddenGrad = Eigen::Tensor<Dtype, 2>(m_hiddenSize, m_batchSize);
+            m_blockSteps = std::max<Eigen::Index>(1, PROJECTION_BLOCK_BYTES / (m_gates.dimension(0) * m_batchSize * sizeof(Dtype)));
+            resizeBuffers();
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void RecurrentLayer<Dtype, Dims>::projectInput(Eigen::Index t)
+    {
+        if (t % m_blockSteps != 0)
+        {
+            return;
+        }
+
+        const Eigen::Index columns = m_batchSize * std::min(m_blockSteps, m_timeSteps - t);
+        ConstStridedMap block(m_inputCache.data() + m_batchSize * t, columns, m_inputSize,
+                              Eigen::OuterStride<>(m_batchSize * m_timeSteps));
+        auto gates = matrix(m_gates).middleCols(m_batchSize * t, columns);
+        gates.noalias() = matrix(m_inputWeights).transpose() * block.transpose();
+        gates.colwise() += matrix(m_bias).row(0).transpose();
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> RecurrentLayer<Dtype, Dims>::hiddenOutput() const
+    {
+        if (m_returnSequences)
+        {
+            Eigen::Tensor<Dtype, Dims> output(m_batchSize, m_timeSteps, m_hiddenSize);
+            std::copy(m_hidden.data(), m_hidden.data() + m_hidden.size(), output.data());
+            return output;
+        }
+
+        Eigen::Tensor<Dtype, Dims> output(m_batchSize, 1, m_hiddenSize);
+        MatrixMap(output.data(), m_batchSize, m_hiddenSize) = matrix(m_hidden).bottomRows(m_batchSize);
+        return output;
+    }
+
+    template <typename Dtype, int Dims>
+    void RecurrentLayer<Dtype, Dims>::addOutputGrad(const TensorView<Dtype, Dims> &accumulatedGrad, Eigen::Index t)
+    {
+        if (!m_returnSequences && t != m_timeSteps - 1)
+        {
+            return;
+        }
+
+        // Rows [batchSize * t, batchSize * (t + 1)) of the (batchSize * outputSteps, hiddenSize) gradient
+        const Eigen::Index outputSteps = m_returnSequences ? m_timeSteps : 1;
+        const Eigen::Index row = m_returnSequences ? m_batchSize * t : 0;
+        ConstStridedMap outputGrad(accumulatedGrad.data() + row, m_batchSize, m_hiddenSize,
+                                   Eigen::OuterStride<>(m_batchSize * outputSteps));
+        matrix(m_hiddenGrad) += outputGrad.transpose();
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> RecurrentLayer<Dtype, Dims>::endBackward(const Eigen::Tensor<Dtype, 2> &inputSideGrad,
+                                                                        const Eigen::Tensor<Dtype, 2> &recurrentSideGrad)
+    {
+        const Eigen::Index rows = m_batchSize * m_timeSteps;
+        ConstMatrixMap sequence(m_inputCache.data(), rows, m_inputSize);
+        const auto inputGrads = matrix(inputSideGrad);
+        const auto recurrentGrads = matrix(recurrentSideGrad);
+
+        matrix(m_inputWeightsGrad).noalias() = sequence.transpose() * inputGrads.transpose();
+        matrix(m_biasGrad).row(0).noalias() = inputGrads.rowwise().sum().transpose();
+
+        // The state before the first timestep is zero, so timestep t only pairs with the hidden state of t - 1
+        const Eigen::Index shiftedColumns = rows - m_batchSize;
+        matrix(m_recurrentWeightsGrad).noalias() = matrix(m_hidden).topRows(shiftedColumns).transpose() *
+                                                   recurrentGrads.rightCols(shiftedColumns).transpose();
+        if (m_useRecurrentBias)
+        {
+            matrix(m_recurrentBiasGrad).row(0).noalias() = recurrentGrads.rowwise().sum().transpose();
+        }
+
+        Eigen::Tensor<Dtype, Dims> inputGrad(m_batchSize, m_timeSteps, m_inputSize);
+        MatrixMap(inputGrad.data(), rows, m_inputSize).noalias() = inputGrads.transpose() * matrix(m_inputWeights).transpose();
+        return inputGrad;
+    }
+
+    template <typename Dtype, int Dims>
+    void RecurrentLayer<Dtype, Dims>::step()
+    {
+        if (!m_inputWeightsOptimizer)
+        {
+            return;
+        }
+
+        m_inputWeightsOptimizer->update(m_inputWeights, m_inputWeightsGrad);
+        m_recurrentWeightsOptimizer->update(m_recurrentWeights, m_recurrentWeightsGrad);
+        m_biasOptimizer->update(m_bias, m_biasGrad);
+        if (m_useRecurrentBias)
+        {
+            m_recurrentBiasOptimizer->update(m_recurrentBias, m_recurrentBiasGrad);
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void RecurrentLayer<Dtype, Dims>::registerOptimizer(std::shared_ptr<Optimizer<Dtype>> optimizer)
+    {
+        m_inputWeightsOptimizer = std::move(optimizer->template createOptimizer<2>());
+        m_recurrentWeightsOptimizer = std::move(optimizer->template createOptimizer<2>());
+        m_biasOptimizer = std::move(optimizer->template createOptimizer<2>(/*decayWeights*/ false));
+
+        if (m_useRecurrentBias)
+        {
+            m_recurrentBiasOptimizer = std::move(optimizer->template createOptimizer<2>(/*decayWeights*/ false));
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void RecurrentLayer<Dtype, Dims>::saveState(Snapshot<Dtype> &snapshot) const
+    {
+        snapshot.addTensor(m_name + ".inputWeights", m_inputWeights);
+        snapshot.addTensor(m_name + ".recurrentWeights", m_recurrentWeights);
+        snapshot.addTensor(m_name + ".bias", m_bias);
+        if (m_useRecurrentBias)
+        {
+            snapshot.addTensor(m_name + ".recurrentBias", m_recurrentBias);
+        }
+
+        snapshot.addInteger(m_name + ".hasOptimizer", m_inputWeightsOptimizer != nullptr);
+        if (m_inputWeightsOptimizer)
+        {
+            m_inputWeightsOptimizer->saveState(snapshot);
+            m_recurrentWeightsOptimizer->saveState(snapshot);
+            m_biasOptimizer->saveState(snapshot);
+            if (m_useRecurrentBias)
+            {
+                m_recurrentBiasOptimizer->saveState(snapshot);
+            }
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    bool RecurrentLayer<Dtype, Dims>::loadState(Snapshot<Dtype> &snapshot)
+    {
+        Eigen::Tensor<Dtype, 2> inputWeights, recurrentWeights, bias, recurrentBias;
+        if (!snapshot.readTensor(m_name + ".inputWeights", inputWeights) ||
+            !snapshot.readTensor(m_name + ".recurrentWeights", recurrentWeights) ||
+            !snapshot.readTensor(m_name + ".bias", bias) ||
+            (m_useRecurrentBias && !snapshot.readTensor(m_name + ".recurrentBias", recurrentBias)))
+        {
+            return false;
+        }
+
+        if (inputWeights.dimensions() != m_inputWeights.dimensions() ||
+            recurrentWeights.dimensions() != m_recurrentWeights.dimensions() || bias.dimensions() != m_bias.dimensions() ||
+            (m_useRecurrentBias && recurrentBias.dimensions() != m_recurrentBias.dimensions()))
+        {
+            std::cerr << m_name << "::loadState weights in snapshot do not match the layer shape" << std::endl;
+            return false;
+        }
+        m_inputWeights = inputWeights;
+        m_recurrentWeights = recurrentWeights;
+        m_bias = bias;
+        if (m_useRecurrentBias)
+        {
+            m_recurrentBias = recurrentBias;
+        }
+
+        uint64_t hasOptimizer;
+        if (!snapshot.readInteger(m_name + ".hasOptimizer", hasOptimizer))
+        {
+            return false;
+        }
+
+        if (hasOptimizer)
+        {
+            if (!m_inputWeightsOptimizer)
+            {
+                std::cerr << m_name << "::loadState snapshot has optimizer state, register an optimizer first" << std::endl;
+                return false;
+            }
+
+            if (!m_inputWeightsOptimizer->loadState(snapshot, m_inputWeights) ||
+                !m_recurrentWeightsOptimizer->loadState(snapshot, m_recurrentWeights) ||
+                !m_biasOptimizer->loadState(snapshot, m_bias) ||
+                (m_useRecurrentBias && !m_recurrentBiasOptimizer->loadState(snapshot, m_recurrentBias)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage RecurrentLayer<Dtype, Dims>::memoryUsage() const
+    {
+        MemoryUsage usage;
+        usage.parameterBytes = tensorBytes(m_inputWeights) + tensorBytes(m_recurrentWeights) +
+                               tensorBytes(m_bias) + tensorBytes(m_recurrentBias);
+        usage.gradientBytes = usage.parameterBytes;
+        if (m_inputWeightsOptimizer)
+        {
+            usage.optimizerStateBytes = m_inputWeightsOptimizer->stateBytes() +
+                                        m_recurrentWeightsOptimizer->stateBytes() + m_biasOptimizer->stateBytes() +
+                                        (m_useRecurrentBias ? m_recurrentBiasOptimizer->stateBytes() : 0);
+        }
+
+        // The sequence buffers persist between calls, so they count with the cached input
+        Eigen::Index sequenceBuffers, stepBuffers;
+        bufferCounts(sequenceBuffers, stepBuffers);
+        usage.activationBytes = tensorBytes(m_inputCache) + tensorBytes(m_gates) + tensorBytes(m_gatesGrad) +
+                                tensorBytes(m_hidden) + tensorBytes(m_hiddenStep) + tensorBytes(m_hiddenGrad) +
+                                (sequenceBuffers * m_timeSteps + stepBuffers) * m_batchSize * m_hiddenSize * sizeof(Dtype);
+
+        const Eigen::Index outputSteps = m_returnSequences ? m_timeSteps : 1;
+        usage.temporaryBytes = std::max(tensorBytes(m_inputCache),
+                                        static_cast<size_t>(m_batchSize * outputSteps * m_hiddenSize * sizeof(Dtype)));
+        return usage;
+    }
+
+    template <typename Dtype, int Dims>
+    MemoryUsage RecurrentLayer<Dtype, Dims>::predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+    {
+        assert(shape[2] == m_inputSize && "Recurrent layer predictMemoryUsage dimensions of input do not match");
+        const Eigen::Index batchSize = shape[0];
+        const Eigen::Index timeSteps = shape[1];
+        const Eigen::Index gateColumns = m_numGates * m_hiddenSize;
+
+        MemoryUsage usage;
+        usage.parameterBytes = (m_inputWeights.size() + m_recurrentWeights.size() + m_bias.size() +
+                                m_recurrentBias.size()) *
+                               sizeof(Dtype);
+        usage.gradientBytes = usage.parameterBytes;
+        if (m_inputWeightsOptimizer)
+        {
+            usage.optimizerStateBytes = m_inputWeightsOptimizer->predictStateBytes(m_inputWeights.size()) +
+                                        m_recurrentWeightsOptimizer->predictStateBytes(m_recurrentWeights.size()) +
+                                        m_biasOptimizer->predictStateBytes(m_bias.size()) +
+                                        (m_useRecurrentBias ? m_recurrentBiasOptimizer->predictStateBytes(m_recurrentBias.size()) : 0);
+        }
+
+        Eigen::Index sequenceBuffers, stepBuffers;
+        bufferCounts(sequenceBuffers, stepBuffers);
+        const size_t inputBytes = shapeBytes<Dtype>(shape);
+        usage.activationBytes = inputBytes +
+                                (2 * gateColumns * timeSteps + (sequenceBuffers + 1) * m_hiddenSize * timeSteps +
+                                 (stepBuffers + 2) * m_hiddenSize) *
+                                    batchSize * sizeof(Dtype);
+
+        shape = {batchSize, m_returnSequences ? timeSteps : 1, m_hiddenSize};
+        usage.temporaryBytes = std::max(inputBytes, shapeBytes<Dtype>(shape));
+        return usage;
+    }
+
+    /**
+     * Long short-term memory over a (batchSize, timeSteps, inputSize) input, with the gates ordered
+     * input, forget, cell and output along the columns of the weights
+     */
+    template <typename Dtype = float, int Dims = 3>
+    class LSTM : public RecurrentLayer<Dtype, Dims>
+    {
+    public:
+        explicit LSTM(int inputSize, int hiddenSize, bool returnSequences = true,
+                      InitializationScheme weightInitializer = InitializationScheme::GlorotUniform);
+
+        const std::string &getName()
+        {
+            const static std::string name = "LSTM";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+    private:
+        typedef RecurrentLayer<Dtype, Dims> Base;
+
+        void resizeBuffers();
+
+        void bufferCounts(Eigen::Index &sequenceBuffers, Eigen::Index &stepBuffers) const
+        {
+            sequenceBuffers = 1;
+            stepBuffers = 2;
+        }
+
+        Eigen::Tensor<Dtype, 2> m_cells;    ///< The cell state of every timestep, (hiddenSize, batchSize * timeSteps)
+        Eigen::Tensor<Dtype, 2> m_cellGrad; ///< The gradient of the cell state of the current timestep
+        Eigen::Tensor<Dtype, 2> m_cellTanh; ///< tanh of the cell state of the current timestep
+    };
+
+    template <typename Dtype, int Dims>
+    LSTM<Dtype, Dims>::LSTM(int inputSize, int hiddenSize, bool returnSequences,
+                            InitializationScheme weightInitializer) : Base("LSTM", inputSize, hiddenSize, 4,
+                                                                           returnSequences, false, weightInitializer)
+    {
+        // Start with an open forget gate so that the cell state, and its gradient, carry over timesteps
+        for (int ii = hiddenSize; ii < 2 * hiddenSize; ++ii)
+        {
+            this->m_bias(0, ii) = 1;
+        }
+    }
+
+    template <typename Dtype, int Dims>
+    void LSTM<Dtype, Dims>::resizeBuffers()
+    {
+        m_cells = Eigen::Tensor<Dtype, 2>(this->m_hiddenSize, this->m_batchSize * this->m_timeSteps);
+        m_cellGrad = Eigen::Tensor<Dtype, 2>(this->m_hiddenSize, this->m_batchSize);
+        m_cellTanh = Eigen::Tensor<Dtype, 2>(this->m_hiddenSize, this->m_batchSize);
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> LSTM<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        this->beginForward(input);
+        const Eigen::Index hiddenSize = this->m_hiddenSize;
+        const auto recurrentWeights = Base::matrix(this->m_recurrentWeights).transpose();
+        auto hiddenStep = Base::matrix(this->m_hiddenStep);
+
+        for (Eigen::Index t = 0; t < this->m_timeSteps; ++t)
+        {
+            this->projectInput(t);
+            auto gates = this->stepColumns(this->m_gates, t);
+            auto cell = this->stepColumns(m_cells, t).array();
+            if (t > 0)
+            {
+                // All four gates in a single recurrent GEMM
+                gates.noalias() += recurrentWeights * hiddenStep;
+            }
+
+            auto inputGate = gates.middleRows(0, hiddenSize).array();
+            auto forgetGate = gates.middleRows(hiddenSize, hiddenSize).array();
+            auto cellGate = gates.middleRows(2 * hiddenSize, hiddenSize).array();
+            auto outputGate = gates.middleRows(3 * hiddenSize, hiddenSize).array();
+            inputGate = inputGate.logistic();
+            forgetGate = forgetGate.logistic();
+            cellGate = cellGate.tanh();
+            outputGate = outputGate.logistic();
+
+            if (t > 0)
+            {
+                cell = forgetGate * this->stepColumns(m_cells, t - 1).array() + inputGate * cellGate;
+            }
+            else
+            {
+                cell = inputGate * cellGate;
+            }
+            hiddenStep.array() = outputGate * cell.tanh();
+            this->storeHidden(t);
+        }
+        return this->hiddenOutput();
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> LSTM<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        assert(accumulatedGrad.dimension(0) == this->m_batchSize &&
+               accumulatedGrad.dimension(1) == (this->m_returnSequences ? this->m_timeSteps : 1) &&
+               accumulatedGrad.dimension(2) == this->m_hiddenSize &&
+               "LSTM::backward dimensions of accumulatedGrad and last output do not match");
+        const Eigen::Index hiddenSize = this->m_hiddenSize;
+        const auto recurrentWeights = Base::matrix(this->m_recurrentWeights);
+
+        auto hiddenGrad = Base::matrix(this->m_hiddenGrad);
+        auto cellGrad = Base::matrix(m_cellGrad).array();
+        auto cellTanh = Base::matrix(m_cellTanh).array();
+        hiddenGrad.setZero();
+        cellGrad.setZero();
+
+        for (Eigen::Index t = this->m_timeSteps - 1; t >= 0; --t)
+        {
+            const auto gates = this->stepColumns(this->m_gates, t);
+            auto gatesGrad = this->stepColumns(this->m_gatesGrad, t);
+            const auto inputGate = gates.middleRows(0, hiddenSize).array();
+            const auto forgetGate = gates.middleRows(hiddenSize, hiddenSize).array();
+            const auto cellGate = gates.middleRows(2 * hiddenSize, hiddenSize).array();
+            const auto outputGate = gates.middleRows(3 * hiddenSize, hiddenSize).array();
+
+            this->addOutputGrad(accumulatedGrad, t);
+            cellTanh = this->stepColumns(m_cells, t).array().tanh();
+            cellGrad += hiddenGrad.array() * outputGate * (1 - cellTanh.square());
+
+            gatesGrad.middleRows(0, hiddenSize).array() = cellGrad * cellGate * inputGate * (1 - inputGate);
+            if (t > 0)
+            {
+                gatesGrad.middleRows(hiddenSize, hiddenSize).array() =
+                    cellGrad * this->stepColumns(m_cells, t - 1).array() * forgetGate * (1 - forgetGate);
+            }
+            else
+            {
+                gatesGrad.middleRows(hiddenSize, hiddenSize).setZero();
+            }
+            gatesGrad.middleRows(2 * hiddenSize, hiddenSize).array() = cellGrad * inputGate * (1 - cellGate.square());
+            gatesGrad.middleRows(3 * hiddenSize, hiddenSize).array() =
+                hiddenGrad.array() * cellTanh * outputGate * (1 - outputGate);
+
+            // Carry the state gradients to the previous timestep
+            cellGrad *= forgetGate;
+            hiddenGrad.noalias() = recurrentWeights * gatesGrad;
+        }
+        return this->endBackward(this->m_gatesGrad, this->m_gatesGrad);
+    }
+
+    /**
+     * Gated recurrent unit over a (batchSize, timeSteps, inputSize) input, with the gates ordered reset,
+     * update and new along the columns of the weights. The reset gate is applied to the recurrent projection
+     * of the new gate, so all three recurrent projections still come from one GEMM per step.
+     */
+    template <typename Dtype = float, int Dims = 3>
+    class GRU : public RecurrentLayer<Dtype, Dims>
+    {
+    public:
+        explicit GRU(int inputSize, int hiddenSize, bool returnSequences = true,
+                     InitializationScheme weightInitializer = InitializationScheme::GlorotUniform);
+
+        const std::string &getName()
+        {
+            const static std::string name = "GRU";
+            return name;
+        }
+
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
+
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
+
+    private:
+        typedef RecurrentLayer<Dtype, Dims> Base;
+
+        void resizeBuffers();
+
+        void bufferCounts(Eigen::Index &sequenceBuffers, Eigen::Index &stepBuffers) const
+        {
+            sequenceBuffers = 2 * this->m_numGates;
+            stepBuffers = 0;
+        }
+
+        Eigen::Tensor<Dtype, 2> m_recurrent;     ///< The recurrent projection of every timestep, (3 * hiddenSize, batchSize * timeSteps)
+        Eigen::Tensor<Dtype, 2> m_recurrentGrad; ///< The gradient of the recurrent projection of every timestep
+    };
+
+    template <typename Dtype, int Dims>
+    GRU<Dtype, Dims>::GRU(int inputSize, int hiddenSize, bool returnSequences,
+                          InitializationScheme weightInitializer) : Base("GRU", inputSize, hiddenSize, 3,
+                                                                         returnSequences, true, weightInitializer)
+    {
+    }
+
+    template <typename Dtype, int Dims>
+    void GRU<Dtype, Dims>::resizeBuffers()
+    {
+        const Eigen::Index columns = this->m_batchSize * this->m_timeSteps;
+        m_recurrent = Eigen::Tensor<Dtype, 2>(3 * this->m_hiddenSize, columns);
+        m_recurrentGrad = Eigen::Tensor<Dtype, 2>(3 * this->m_hiddenSize, columns);
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> GRU<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
+    {
+        this->beginForward(input);
+        const Eigen::Index hiddenSize = this->m_hiddenSize;
+        const auto recurrentWeights = Base::matrix(this->m_recurrentWeights).transpose();
+        const auto recurrentBias = Base::matrix(this->m_recurrentBias).row(0).transpose();
+        auto hiddenStep = Base::matrix(this->m_hiddenStep);
+
+        for (Eigen::Index t = 0; t < this->m_timeSteps; ++t)
+        {
+            this->projectInput(t);
+            auto gates = this->stepColumns(this->m_gates, t);
+            auto recurrent = this->stepColumns(m_recurrent, t);
+            // All three recurrent projections in a single GEMM
+            if (t > 0)
+            {
+                recurrent.noalias() = recurrentWeights * hiddenStep;
+                recurrent.colwise() += recurrentBias;
+            }
+            else
+            {
+                recurrent.colwise() = recurrentBias;
+            }
+
+            auto resetGate = gates.middleRows(0, hiddenSize).array();
+            auto updateGate = gates.middleRows(hiddenSize, hiddenSize).array();
+            auto newGate = gates.middleRows(2 * hiddenSize, hiddenSize).array();
+            resetGate = (resetGate + recurrent.middleRows(0, hiddenSize).array()).logistic();
+            updateGate = (updateGate + recurrent.middleRows(hiddenSize, hiddenSize).array()).logistic();
+            newGate = (newGate + resetGate * recurrent.middleRows(2 * hiddenSize, hiddenSize).array()).tanh();
+
+            if (t > 0)
+            {
+                hiddenStep.array() = (1 - updateGate) * newGate + updateGate * hiddenStep.array();
+            }
+            else
+            {
+                hiddenStep.array() = (1 - updateGate) * newGate;
+            }
+            this->storeHidden(t);
+        }
+        return this->hiddenOutput();
+    }
+
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> GRU<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
+    {
+        assert(accumulatedGrad.dimension(0) == this->m_batchSize &&
+               accumulatedGrad.dimension(1) == (this->m_returnSequences ? this->m_timeSteps : 1) &&
+               accumulatedGrad.dimension(2) == this->m_hiddenSize &&
+               "GRU::backward dimensions of accumulatedGrad and last output do not match");
+        const Eigen::Index hiddenSize = this->m_hiddenSize;
+        const auto recurrentWeights = Base::matrix(this->m_recurrentWeights);
+
+        auto hiddenGrad = Base::matrix(this->m_hiddenGrad);
+        auto hiddenStep = Base::matrix(this->m_hiddenStep);
+        hiddenGrad.setZero();
+
+        for (Eigen::Index t = this->m_timeSteps - 1; t >= 0; --t)
+        {
+            const auto gates = this->stepColumns(this->m_gates, t);
+            const auto recurrent = this->stepColumns(m_recurrent, t);
+            auto gatesGrad = this->stepColumns(this->m_gatesGrad, t);
+            auto recurrentGrad = this->stepColumns(m_recurrentGrad, t);
+            const auto resetGate = gates.middleRows(0, hiddenSize).array();
+            const auto updateGate = gates.middleRows(hiddenSize, hiddenSize).array();
+            const auto newGate = gates.middleRows(2 * hiddenSize, hiddenSize).array();
+
+            this->addOutputGrad(accumulatedGrad, t);
+
+            auto newGrad = gatesGrad.middleRows(2 * hiddenSize, hiddenSize).array();
+            newGrad = hiddenGrad.array() * (1 - updateGate) * (1 - newGate.square());
+            if (t > 0)
+            {
+                hiddenStep = this->hiddenRows(t - 1).transpose();
+                gatesGrad.middleRows(hiddenSize, hiddenSize).array() =
+                    hiddenGrad.array() * (hiddenStep.array() - newGate) * updateGate * (1 - updateGate);
+            }
+            else
+            {
+                gatesGrad.middleRows(hiddenSize, hiddenSize).array() = -hiddenGrad.array() * newGate * updateGate * (1 - updateGate);
+            }
+            gatesGrad.middleRows(0, hiddenSize).array() =
+                newGrad * recurrent.middleRows(2 * hiddenSize, hiddenSize).array() * resetGate * (1 - resetGate);
+
+            // The reset and update gates see the same gradient on both projections, the new gate's recurrent
+            // projection is scaled by the reset gate
+            recurrentGrad.topRows(2 * hiddenSize) = gatesGrad.topRows(2 * hiddenSize);
+            recurrentGrad.middleRows(2 * hiddenSize, hiddenSize).array() = newGrad * resetGate;
+
+            // Carry the hidden state gradient to the previous timestep
+            hiddenGrad.array() *= updateGate;
+            hiddenGrad.noalias() += recurrentWeights * recurrentGrad;
+        }
+        return this->endBackward(this->m_gatesGrad, m_recurrentGrad);
+    }
+}
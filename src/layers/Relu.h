@@ -16,29 +16,47 @@ namespace nn
             return name;
         }
 
-        Eigen::Tensor<Dtype, Dims> forward(const Eigen::Tensor<Dtype, Dims> &input);
+        Eigen::Tensor<Dtype, Dims> forward(const TensorView<Dtype, Dims> &input);
 
-        Eigen::Tensor<Dtype, Dims> backward(const Eigen::Tensor<Dtype, Dims> &accumulatedGrad);
+        Eigen::Tensor<Dtype, Dims> backward(const TensorView<Dtype, Dims> &accumulatedGrad);
 
         void step() {}
 
-        void registerOptimizer(std::shared_ptr<StochasticGradientDescent<Dtype>> optimizer) {}
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> /*optimizer*/) {}
 
-        void registerOptimizer(std::shared_ptr<Adam<Dtype>> optimizer) {}
+        void saveState(Snapshot<Dtype> & /*snapshot*/) const {}
+
+        bool loadState(Snapshot<Dtype> & /*snapshot*/) { return true; }
+
+        MemoryUsage memoryUsage() const
+        {
+            MemoryUsage usage;
+            usage.activationBytes = tensorBytes(m_output);
+            usage.temporaryBytes = tensorBytes(m_output);
+            return usage;
+        }
+
+        MemoryUsage predictMemoryUsage(Eigen::array<Eigen::Index, Dims> &shape) const
+        {
+            MemoryUsage usage;
+            usage.activationBytes = shapeBytes<Dtype>(shape);
+            usage.temporaryBytes = usage.activationBytes;
+            return usage;
+        }
 
     private:
         Eigen::Tensor<Dtype, Dims> m_output;
     };
 
     template <typename Dtype, int Dims>
-    Eigen::Tensor<Dtype, Dims> Relu<Dtype, Dims>::forward(const Eigen::Tensor<Dtype, Dims> &input)
+    Eigen::Tensor<Dtype, Dims> Relu<Dtype, Dims>::forward(const TensorView<Dtype, Dims> &input)
     {
         m_output = input.cwiseMax(static_cast<Dtype>(0));
         return m_output;
     };
 
     template <typename Dtype, int Dims>
-    Eigen::Tensor<Dtype, Dims> Relu<Dtype, Dims>::backward(const Eigen::Tensor<Dtype, Dims> &accumulatedGrad)
+    Eigen::Tensor<Dtype, Dims> Relu<Dtype, Dims>::backward(const TensorView<Dtype, Dims> &accumulatedGrad)
     {
         auto inputPositive = m_output > static_cast<Dtype>(0);
         return inputPositive.select(accumulatedGrad, accumulatedGrad.constant(0.0));
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "layers/Layer.h"
+
+namespace nn
+{
+    /**
+     * Reshapes every sample of the batch to a new shape with the same number of elements, e.g. a
+     * (batchSize, height * width * channels) input back to (batchSize, height, width, channels).
+     * Like Flatten, only the shape of the activation handle changes, its buffer is shared.
+     */
+    template <typename Dtype = float>
+    class Reshape : public LayerBase<Dtype>
+    {
+    public:
+        /**
+         * @param sampleShape The shape of a single sample, i.e. without the leading batch dimension
+         */
+        explicit Reshape(std::vector<Eigen::Index> sampleShape) : m_sampleShape(std::move(sampleShape))
+        {
+            assert(m_sampleShape.size() < Activation<Dtype>::MAX_RANK && "Reshape rank is limited to Activation::MAX_RANK");
+        }
+
+        const std::string &getName()
+        {
+            const static std::string name = "Reshape";
+            return name;
+        }
+
+        Activation<Dtype> forwardActivation(const Activation<Dtype> &input)
+        {
+            m_inputShape = input.shape();
+            std::vector<Eigen::Index> shape{input.dimension(0)};
+            shape.insert(shape.end(), m_sampleShape.begin(), m_sampleShape.end());
+            return input.reshape(shape);
+        }
+
+        Activation<Dtype> backwardActivation(const Activation<Dtype> &accumulatedGrad)
+        {
+            return accumulatedGrad.reshape(m_inputShape);
+        }
+
+        bool passesThrough() const
+        {
+            return true;
+        }
+
+        void step() {}
+
+        void registerOptimizer(std::shared_ptr<Optimizer<Dtype>> /*optimizer*/) {}
+
+        void saveState(Snapshot<Dtype> & /*snapshot*/) const {}
+
+        bool loadState(Snapshot<Dtype> & /*snapshot*/) { return true; }
+
+        MemoryUsage memoryUsage() const
+        {
+            return MemoryUsage();
+        }
+
+        MemoryUsage predictActivationMemory(std::vector<Eigen::Index> &shape) const
+        {
+            std::vector<Eigen::Index> output{shape[0]};
+            output.insert(output.end(), m_sampleShape.begin(), m_sampleShape.end());
+            shape = output;
+            return MemoryUsage();
+        }
+
+    private:
+        std::vector<Eigen::Index> m_sampleShape; ///< The shape every sample is reshaped to
+        std::vector<Eigen::Index> m_inputShape;  ///< The shape of the last input
+    };
+}
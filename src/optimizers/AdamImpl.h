@@ -6,48 +6,90 @@ namespace nn
 {
     namespace internal
     {
+        /**
+         * Adam, and AdamW when the weight decay is not zero. The decay is decoupled from the gradient, it
+         * shrinks the weights directly instead of being scaled by the second moment.
+         */
         template <typename Dtype, int Dims>
         class AdamImpl : public OptimizerImpl<Dtype, Dims>
         {
         public:
-            explicit AdamImpl(Dtype learningRate, Dtype beta1, Dtype beta2, Dtype epsilon) : m_learningRate(learningRate), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon),
-                                                                                             m_isInitialized(false), m_currentTimestep(1)
+            AdamImpl(std::shared_ptr<const Dtype> learningRate, Dtype beta1, Dtype beta2, Dtype epsilon, Dtype weightDecay) : m_learningRate(learningRate), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon),
+                                                                                                                             m_weightDecay(weightDecay), m_currentTimestep(1)
             {
             }
 
-            Eigen::Tensor<Dtype, Dims> weightUpdate(const Eigen::Tensor<Dtype, Dims> &gradWeights)
+            void update(Eigen::Tensor<Dtype, Dims> &weights, const Eigen::Tensor<Dtype, Dims> &gradWeights)
             {
-                if (!m_isInitialized)
-                {
-                    m_firstMoment = Eigen::Tensor<Dtype, Dims>(gradWeights.dimensions());
-                    m_firstMoment.setZero();
+                ensureState(m_firstMoment, weights);
+                ensureState(m_secondMoment, weights);
+
+                m_firstMoment = m_firstMoment * m_beta1 + gradWeights * (1 - m_beta1);
+                m_secondMoment = m_secondMoment * m_beta2 + gradWeights.square() * (1 - m_beta2);
+
+                const Dtype learningRate = *m_learningRate;
+                const Dtype firstCorrection = 1 / (1 - std::pow(m_beta1, static_cast<Dtype>(m_currentTimestep)));
+                const Dtype secondCorrection = 1 / (1 - std::pow(m_beta2, static_cast<Dtype>(m_currentTimestep)));
+                m_currentTimestep++;
+
+                // The bias correction and decay are folded into a single pass that writes the weights in place
+                weights -= (m_firstMoment * firstCorrection / ((m_secondMoment * secondCorrection).sqrt() + m_epsilon) +
+                            weights * m_weightDecay) *
+                           learningRate;
+            };
 
-                    m_secondMoment = Eigen::Tensor<Dtype, Dims>(gradWeights.dimensions());
-                    m_secondMoment.setZero();
-                    m_isInitialized = true;
+            void saveState(Snapshot<Dtype> &snapshot) const
+            {
+                const bool isInitialized = m_firstMoment.size() > 0;
+                snapshot.addInteger("Adam.timestep", m_currentTimestep);
+                snapshot.addInteger("Adam.initialized", isInitialized);
+                if (isInitialized)
+                {
+                    snapshot.addTensor("Adam.firstMoment", m_firstMoment);
+                    snapshot.addTensor("Adam.secondMoment", m_secondMoment);
                 }
+            }
 
-                m_firstMoment = m_firstMoment.constant(m_beta1) * m_firstMoment +
-                                gradWeights.constant(1 - m_beta1) * gradWeights;
+            bool loadState(Snapshot<Dtype> &snapshot, const Eigen::Tensor<Dtype, Dims> &weights)
+            {
+                uint64_t timestep, initialized;
+                if (!snapshot.readInteger("Adam.timestep", timestep) ||
+                    !snapshot.readInteger("Adam.initialized", initialized))
+                {
+                    return false;
+                }
 
-                m_secondMoment = m_secondMoment.constant(m_beta2) * m_secondMoment +
-                                 gradWeights.constant(1 - m_beta2) * gradWeights.square();
+                m_currentTimestep = timestep;
+                if (initialized)
+                {
+                    return snapshot.readTensor("Adam.firstMoment", m_firstMoment) &&
+                           snapshot.readTensor("Adam.secondMoment", m_secondMoment) &&
+                           stateMatches("Adam.firstMoment", m_firstMoment, weights) &&
+                           stateMatches("Adam.secondMoment", m_secondMoment, weights);
+                }
+                m_firstMoment = Eigen::Tensor<Dtype, Dims>();
+                m_secondMoment = Eigen::Tensor<Dtype, Dims>();
+                return true;
+            }
 
-                auto biasCorrectedFirstMoment = m_firstMoment / m_firstMoment.constant(1 - pow(m_beta1, m_currentTimestep));
-                auto biasCorrectedSecondMoment = m_secondMoment / m_secondMoment.constant(1 - pow(m_beta2, m_currentTimestep));
+            size_t stateBytes() const
+            {
+                return tensorBytes(m_firstMoment) + tensorBytes(m_secondMoment);
+            }
 
-                m_currentTimestep++;
-                return biasCorrectedFirstMoment * ((gradWeights.constant(m_learningRate) /
-                                                    (biasCorrectedSecondMoment.sqrt() + gradWeights.constant(m_epsilon))));
-            };
+            size_t predictStateBytes(Eigen::Index numWeights) const
+            {
+                // First and second moment per weight
+                return 2 * static_cast<size_t>(numWeights) * sizeof(Dtype);
+            }
 
         private:
-            Dtype m_learningRate;
+            std::shared_ptr<const Dtype> m_learningRate; ///< The current learning rate, shared with the optimizer
             Dtype m_beta1;
             Dtype m_beta2;
             Dtype m_epsilon;
+            Dtype m_weightDecay;
 
-            bool m_isInitialized;
             size_t m_currentTimestep;
 
             Eigen::Tensor<Dtype, Dims> m_firstMoment;
@@ -55,4 +97,3 @@ namespace nn
         };
     }
 }
-
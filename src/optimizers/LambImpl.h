@@ -0,0 +1,112 @@
+#pragma once
+
+#include "OptimizerImpl.h"
+
+namespace nn
+{
+    namespace internal
+    {
+        /**
+         * LAMB: the Adam direction plus decoupled weight decay, rescaled per weight tensor by the trust ratio
+         * ||weights|| / ||direction|| so every layer moves by a similar fraction of its weights, which keeps
+         * large-batch training with high learning rates stable. Without the trust ratio, for biases and
+         * normalization parameters, the step is the plain AdamW step.
+         */
+        template <typename Dtype, int Dims>
+        class LambImpl : public OptimizerImpl<Dtype, Dims>
+        {
+        public:
+            LambImpl(std::shared_ptr<const Dtype> learningRate, Dtype beta1, Dtype beta2, Dtype epsilon, Dtype weightDecay,
+                     bool useTrustRatio = true) : m_learningRate(learningRate), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon),
+                                                  m_weightDecay(weightDecay), m_useTrustRatio(useTrustRatio), m_currentTimestep(1)
+            {
+            }
+
+            void update(Eigen::Tensor<Dtype, Dims> &weights, const Eigen::Tensor<Dtype, Dims> &gradWeights)
+            {
+                ensureState(m_firstMoment, weights);
+                ensureState(m_secondMoment, weights);
+
+                m_firstMoment = m_firstMoment * m_beta1 + gradWeights * (1 - m_beta1);
+                m_secondMoment = m_secondMoment * m_beta2 + gradWeights.square() * (1 - m_beta2);
+
+                const Dtype firstCorrection = 1 / (1 - std::pow(m_beta1, static_cast<Dtype>(m_currentTimestep)));
+                const Dtype secondCorrection = 1 / (1 - std::pow(m_beta2, static_cast<Dtype>(m_currentTimestep)));
+                m_currentTimestep++;
+
+                // The direction is evaluated twice, for its norm and for the update, instead of being stored
+                auto direction = m_firstMoment * firstCorrection / ((m_secondMoment * secondCorrection).sqrt() + m_epsilon) +
+                                 weights * m_weightDecay;
+                if (!m_useTrustRatio)
+                {
+                    weights -= direction * *m_learningRate;
+                    return;
+                }
+                const Eigen::Tensor<Dtype, 0> weightNorm = weights.square().sum().sqrt();
+                const Eigen::Tensor<Dtype, 0> directionNorm = direction.square().sum().sqrt();
+
+                // Fall back to plain steps for zero initialized weights or a vanishing direction
+                const Dtype trustRatio = weightNorm() > 0 && directionNorm() > 0 ? weightNorm() / directionNorm() : Dtype(1);
+                weights -= direction * (*m_learningRate * trustRatio);
+            };
+
+            void saveState(Snapshot<Dtype> &snapshot) const
+            {
+                const bool isInitialized = m_firstMoment.size() > 0;
+                snapshot.addInteger("Lamb.timestep", m_currentTimestep);
+                snapshot.addInteger("Lamb.initialized", isInitialized);
+                if (isInitialized)
+                {
+                    snapshot.addTensor("Lamb.firstMoment", m_firstMoment);
+                    snapshot.addTensor("Lamb.secondMoment", m_secondMoment);
+                }
+            }
+
+            bool loadState(Snapshot<Dtype> &snapshot, const Eigen::Tensor<Dtype, Dims> &weights)
+            {
+                uint64_t timestep, initialized;
+                if (!snapshot.readInteger("Lamb.timestep", timestep) ||
+                    !snapshot.readInteger("Lamb.initialized", initialized))
+                {
+                    return false;
+                }
+
+                m_currentTimestep = timestep;
+                if (initialized)
+                {
+                    return snapshot.readTensor("Lamb.firstMoment", m_firstMoment) &&
+                           snapshot.readTensor("Lamb.secondMoment", m_secondMoment) &&
+                           stateMatches("Lamb.firstMoment", m_firstMoment, weights) &&
+                           stateMatches("Lamb.secondMoment", m_secondMoment, weights);
+                }
+                m_firstMoment = Eigen::Tensor<Dtype, Dims>();
+                m_secondMoment = Eigen::Tensor<Dtype, Dims>();
+                return true;
+            }
+
+            size_t stateBytes() const
+            {
+                return tensorBytes(m_firstMoment) + tensorBytes(m_secondMoment);
+            }
+
+            size_t predictStateBytes(Eigen::Index numWeights) const
+            {
+                // First and second moment per weight
+                return 2 * static_cast<size_t>(numWeights) * sizeof(Dtype);
+            }
+
+        private:
+            std::shared_ptr<const Dtype> m_learningRate; ///< The current learning rate, shared with the optimizer
+            Dtype m_beta1;
+            Dtype m_beta2;
+            Dtype m_epsilon;
+            Dtype m_weightDecay;
+            bool m_useTrustRatio; ///< Whether the step is scaled by ||weights|| / ||direction||
+
+            size_t m_currentTimestep;
+
+            Eigen::Tensor<Dtype, Dims> m_firstMoment;
+            Eigen::Tensor<Dtype, Dims> m_secondMoment;
+        };
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+namespace nn
+{
+    /**
+     * Maps the training step to a learning rate. Schedules are stateless, so resuming from a checkpoint only
+     * needs the step.
+     */
+    template <typename Dtype = float>
+    class LearningRateSchedule
+    {
+    public:
+        virtual ~LearningRateSchedule() = default;
+
+        /**
+         * @param baseRate The learning rate the optimizer was constructed with
+         * @param step The number of steps taken so far
+         */
+        virtual Dtype learningRate(Dtype baseRate, uint64_t step) const = 0;
+    };
+
+    /**
+     * Multiply the learning rate by gamma every stepSize steps
+     */
+    template <typename Dtype = float>
+    class StepDecay : public LearningRateSchedule<Dtype>
+    {
+    public:
+        StepDecay(uint64_t stepSize, Dtype gamma) : m_stepSize(stepSize), m_gamma(gamma)
+        {
+            assert(stepSize > 0 && "StepDecay stepSize has to be positive");
+        }
+
+        Dtype learningRate(Dtype baseRate, uint64_t step) const
+        {
+            return baseRate * std::pow(m_gamma, static_cast<Dtype>(step / m_stepSize));
+        }
+
+    private:
+        uint64_t m_stepSize;
+        Dtype m_gamma;
+    };
+
+    /**
+     * Anneal the learning rate from its base value to minRate along half a cosine over decaySteps steps,
+     * then keep it at minRate
+     */
+    template <typename Dtype = float>
+    class CosineDecay : public LearningRateSchedule<Dtype>
+    {
+    public:
+        explicit CosineDecay(uint64_t decaySteps, Dtype minRate = 0) : m_decaySteps(decaySteps), m_minRate(minRate)
+        {
+            assert(decaySteps > 0 && "CosineDecay decaySteps has to be positive");
+        }
+
+        Dtype learningRate(Dtype baseRate, uint64_t step) const
+        {
+            const Dtype progress = static_cast<Dtype>(std::min(step, m_decaySteps)) / m_decaySteps;
+            return m_minRate + (baseRate - m_minRate) * (1 + std::cos(std::acos(Dtype(-1)) * progress)) / 2;
+        }
+
+    private:
+        uint64_t m_decaySteps;
+        Dtype m_minRate;
+    };
+
+    /**
+     * Ramp the learning rate up linearly over the first warmupSteps steps, then hand over to another schedule,
+     * which sees the steps counted from the end of the warmup
+     */
+    template <typename Dtype = float>
+    class Warmup : public LearningRateSchedule<Dtype>
+    {
+    public:
+        /**
+         * @param after The schedule to follow the warmup with, the constant base rate if null. Takes ownership.
+         */
+        explicit Warmup(uint64_t warmupSteps, LearningRateSchedule<Dtype> *after = nullptr) : m_warmupSteps(warmupSteps),
+                                                                                             m_after(after)
+        {
+        }
+
+        Dtype learningRate(Dtype baseRate, uint64_t step) const
+        {
+            if (step < m_warmupSteps)
+            {
+                return baseRate * (step + 1) / m_warmupSteps;
+            }
+            return m_after ? m_after->learningRate(baseRate, step - m_warmupSteps) : baseRate;
+        }
+
+    private:
+        uint64_t m_warmupSteps;
+        std::unique_ptr<LearningRateSchedule<Dtype>> m_after;
+    };
+}
@@ -2,14 +2,73 @@
 
 #include <unsupported/Eigen/CXX11/Tensor>
 #include <iostream>
+#include <memory>
+#include "utils/Checkpoint.h"
+#include "utils/MemoryUsage.h"
 
 namespace nn
 {
+    /**
+     * The update rule and state of an optimizer for a single weight tensor
+     */
     template <typename Dtype, int Dims>
     class OptimizerImpl
     {
     public:
-        virtual Eigen::Tensor<Dtype, Dims> weightUpdate(const Eigen::Tensor<Dtype, Dims> &weights) = 0;
+        virtual ~OptimizerImpl() = default;
+
+        /**
+         * Apply one update to the weights in place
+         */
+        virtual void update(Eigen::Tensor<Dtype, Dims> &weights, const Eigen::Tensor<Dtype, Dims> &gradWeights) = 0;
+
+        virtual void saveState(Snapshot<Dtype> &snapshot) const = 0;
+
+        /**
+         * Restore the state saved by saveState, which has to match the weights this optimizer updates
+         */
+        virtual bool loadState(Snapshot<Dtype> &snapshot, const Eigen::Tensor<Dtype, Dims> &weights) = 0;
+
+        /**
+         * @return The bytes of optimizer state currently allocated
+         */
+        virtual size_t stateBytes() const = 0;
+
+        /**
+         * @return The bytes of optimizer state needed once numWeights weights have been updated
+         */
+        virtual size_t predictStateBytes(Eigen::Index numWeights) const = 0;
     };
-}
 
+    namespace internal
+    {
+        /**
+         * Allocate a zeroed state tensor the first time the weights are updated, or when their shape changes
+         */
+        template <typename Dtype, int Dims>
+        void ensureState(Eigen::Tensor<Dtype, Dims> &state, const Eigen::Tensor<Dtype, Dims> &weights)
+        {
+            if (state.dimensions() != weights.dimensions())
+            {
+                state = Eigen::Tensor<Dtype, Dims>(weights.dimensions());
+                state.setZero();
+            }
+        }
+
+        /**
+         * Check that a state tensor read from a snapshot belongs to the given weights. A state that was never
+         * allocated, because the weights were not updated before saving, matches any weights.
+         */
+        template <typename Dtype, int Dims>
+        bool stateMatches(const std::string &name, const Eigen::Tensor<Dtype, Dims> &state,
+                          const Eigen::Tensor<Dtype, Dims> &weights)
+        {
+            if (state.size() != 0 && state.dimensions() != weights.dimensions())
+            {
+                std::cerr << "Snapshot record " << name << " does not match the shape of the weights" << std::endl;
+                return false;
+            }
+            return true;
+        }
+    }
+}
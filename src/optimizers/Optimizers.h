@@ -2,46 +2,229 @@
 
 #include "StochasticGradientDescentImpl.h"
 #include "AdamImpl.h"
+#include "LambImpl.h"
+#include "LearningRateSchedules.h"
 #include <memory>
 
 namespace nn
 {
+    namespace internal
+    {
+        template <int Dims>
+        struct RankTag
+        {
+        };
+    }
+
+    /**
+     * Common interface of the optimizers, which layers register against without knowing the update rule.
+     *
+     * A layer asks for one OptimizerImpl per weight tensor with createOptimizer<Dims>(). Every OptimizerImpl
+     * reads the current learning rate from the optimizer, so advancing the schedule changes it for all of
+     * them without touching their per-tensor state.
+     *
+     * Layers exclude their biases and normalization scales and shifts from weight decay by passing
+     * decayWeights = false: shrinking them towards zero does not regularize the network. LAMB does not apply its
+     * trust ratio to them either.
+     *
+     * New optimizers derive from OptimizerFactory and implement makeOptimizer<Dims>(bool decayWeights).
+     */
+    template <typename Dtype>
+    class Optimizer
+    {
+    public:
+        explicit Optimizer(Dtype learningRate) : m_baseLearningRate(learningRate),
+                                                 m_learningRate(std::make_shared<Dtype>(learningRate))
+        {
+        }
+
+        virtual ~Optimizer() = default;
+
+        /**
+         * @param decayWeights false for tensors that weight decay must not shrink, such as biases
+         */
+        template <int Dims>
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> createOptimizer(bool decayWeights = true) const
+        {
+            static_assert(Dims >= 1 && Dims <= 5, "Optimizers support weight tensors of rank 1 to 5");
+            return createImpl(internal::RankTag<Dims>(), decayWeights);
+        }
+
+        /**
+         * Drive the learning rate with a schedule instead of keeping it constant. Takes ownership.
+         */
+        void setSchedule(LearningRateSchedule<Dtype> *schedule)
+        {
+            m_schedule.reset(schedule);
+            updateLearningRate();
+        }
+
+        /**
+         * Move the schedule on by one training step, called by Net::step after every layer is updated
+         */
+        void advance()
+        {
+            m_step++;
+            updateLearningRate();
+        }
+
+        uint64_t getStep() const
+        {
+            return m_step;
+        }
+
+        /**
+         * Jump to a step, e.g. when resuming from a checkpoint
+         */
+        void setStep(uint64_t step)
+        {
+            m_step = step;
+            updateLearningRate();
+        }
+
+        Dtype getLearningRate() const
+        {
+            return *m_learningRate;
+        }
+
+    protected:
+        virtual std::unique_ptr<OptimizerImpl<Dtype, 1>> createImpl(internal::RankTag<1>, bool decayWeights) const = 0;
+        virtual std::unique_ptr<OptimizerImpl<Dtype, 2>> createImpl(internal::RankTag<2>, bool decayWeights) const = 0;
+        virtual std::unique_ptr<OptimizerImpl<Dtype, 3>> createImpl(internal::RankTag<3>, bool decayWeights) const = 0;
+        virtual std::unique_ptr<OptimizerImpl<Dtype, 4>> createImpl(internal::RankTag<4>, bool decayWeights) const = 0;
+        virtual std::unique_ptr<OptimizerImpl<Dtype, 5>> createImpl(internal::RankTag<5>, bool decayWeights) const = 0;
+
+        void updateLearningRate()
+        {
+            *m_learningRate = m_schedule ? m_schedule->learningRate(m_baseLearningRate, m_step) : m_baseLearningRate;
+        }
+
+        Dtype m_baseLearningRate;
+        std::shared_ptr<Dtype> m_learningRate; ///< The current learning rate, read by every OptimizerImpl
+        std::unique_ptr<LearningRateSchedule<Dtype>> m_schedule;
+        uint64_t m_step = 0; ///< The number of training steps taken
+    };
+
+    /**
+     * Implements the rank dispatch of Optimizer with the templated makeOptimizer<Dims>() of Derived
+     */
+    template <typename Dtype, typename Derived>
+    class OptimizerFactory : public Optimizer<Dtype>
+    {
+    public:
+        explicit OptimizerFactory(Dtype learningRate) : Optimizer<Dtype>(learningRate) {}
+
+    protected:
+        std::unique_ptr<OptimizerImpl<Dtype, 1>> createImpl(internal::RankTag<1>, bool decayWeights) const { return make<1>(decayWeights); }
+        std::unique_ptr<OptimizerImpl<Dtype, 2>> createImpl(internal::RankTag<2>, bool decayWeights) const { return make<2>(decayWeights); }
+        std::unique_ptr<OptimizerImpl<Dtype, 3>> createImpl(internal::RankTag<3>, bool decayWeights) const { return make<3>(decayWeights); }
+        std::unique_ptr<OptimizerImpl<Dtype, 4>> createImpl(internal::RankTag<4>, bool decayWeights) const { return make<4>(decayWeights); }
+        std::unique_ptr<OptimizerImpl<Dtype, 5>> createImpl(internal::RankTag<5>, bool decayWeights) const { return make<5>(decayWeights); }
+
+    private:
+        template <int Dims>
+        std::unique_ptr<OptimizerImpl<Dtype, Dims>> make(bool decayWeights) const
+        {
+            return std::unique_ptr<OptimizerImpl<Dtype, Dims>>(static_cast<const Derived *>(this)->template makeOptimizer<Dims>(decayWeights));
+        }
+    };
+
+    /**
+     * SGD, with optional heavy-ball or Nesterov momentum
+     */
     template <typename Dtype>
-    class StochasticGradientDescent
+    class StochasticGradientDescent : public OptimizerFactory<Dtype, StochasticGradientDescent<Dtype>>
     {
     public:
-        explicit StochasticGradientDescent(Dtype learningRate) : m_learningRate(learningRate) {}
+        explicit StochasticGradientDescent(Dtype learningRate, Dtype momentum = 0, bool nesterov = false) : OptimizerFactory<Dtype, StochasticGradientDescent<Dtype>>(learningRate),
+                                                                                                           m_momentum(momentum), m_nesterov(nesterov)
+        {
+        }
 
         template <int Dims>
-        std::unique_ptr<OptimizerImpl<Dtype, Dims>> createOptimizer() const
+        OptimizerImpl<Dtype, Dims> *makeOptimizer(bool /*decayWeights*/) const
         {
-            return std::unique_ptr<OptimizerImpl<Dtype, Dims>>(new internal::StochasticGradientDescentImpl<Dtype, Dims>(m_learningRate));
+            return new internal::StochasticGradientDescentImpl<Dtype, Dims>(this->m_learningRate, m_momentum, m_nesterov);
         }
 
     private:
-        Dtype m_learningRate;
+        Dtype m_momentum;
+        bool m_nesterov;
     };
 
     template <typename Dtype>
-    class Adam
+    class Adam : public OptimizerFactory<Dtype, Adam<Dtype>>
     {
     public:
-        explicit Adam(Dtype learningRate, Dtype beta1 = 0.9, Dtype beta2 = 0.999, Dtype epsilon = 1e-8) : m_learningRate(learningRate), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon)
+        explicit Adam(Dtype learningRate, Dtype beta1 = 0.9, Dtype beta2 = 0.999, Dtype epsilon = 1e-8) : OptimizerFactory<Dtype, Adam<Dtype>>(learningRate),
+                                                                                                          m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon)
         {
         }
 
         template <int Dims>
-        std::unique_ptr<OptimizerImpl<Dtype, Dims>> createOptimizer() const
+        OptimizerImpl<Dtype, Dims> *makeOptimizer(bool /*decayWeights*/) const
         {
-            return std::unique_ptr<OptimizerImpl<Dtype, Dims>>(new internal::AdamImpl<Dtype, Dims>(m_learningRate, m_beta1, m_beta2, m_epsilon));
+            return new internal::AdamImpl<Dtype, Dims>(this->m_learningRate, m_beta1, m_beta2, m_epsilon, 0);
         };
 
     private:
-        Dtype m_learningRate;
         Dtype m_beta1;
         Dtype m_beta2;
         Dtype m_epsilon;
     };
 
-}
+    /**
+     * Adam with weight decay decoupled from the gradient. Tensors created with decayWeights = false take plain Adam
+     * steps.
+     */
+    template <typename Dtype>
+    class AdamW : public OptimizerFactory<Dtype, AdamW<Dtype>>
+    {
+    public:
+        explicit AdamW(Dtype learningRate, Dtype weightDecay = 0.01, Dtype beta1 = 0.9, Dtype beta2 = 0.999, Dtype epsilon = 1e-8) : OptimizerFactory<Dtype, AdamW<Dtype>>(learningRate),
+                                                                                                                                    m_weightDecay(weightDecay), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon)
+        {
+        }
+
+        template <int Dims>
+        OptimizerImpl<Dtype, Dims> *makeOptimizer(bool decayWeights) const
+        {
+            return new internal::AdamImpl<Dtype, Dims>(this->m_learningRate, m_beta1, m_beta2, m_epsilon,
+                                                        decayWeights ? m_weightDecay : Dtype(0));
+        };
 
+    private:
+        Dtype m_weightDecay;
+        Dtype m_beta1;
+        Dtype m_beta2;
+        Dtype m_epsilon;
+    };
+
+    /**
+     * LAMB, AdamW with a per-layer trust ratio for large-batch training. Tensors created with decayWeights = false
+     * take plain Adam steps, without decay or trust ratio.
+     */
+    template <typename Dtype>
+    class Lamb : public OptimizerFactory<Dtype, Lamb<Dtype>>
+    {
+    public:
+        explicit Lamb(Dtype learningRate, Dtype weightDecay = 0.01, Dtype beta1 = 0.9, Dtype beta2 = 0.999, Dtype epsilon = 1e-6) : OptimizerFactory<Dtype, Lamb<Dtype>>(learningRate),
+                                                                                                                                   m_weightDecay(weightDecay), m_beta1(beta1), m_beta2(beta2), m_epsilon(epsilon)
+        {
+        }
+
+        template <int Dims>
+        OptimizerImpl<Dtype, Dims> *makeOptimizer(bool decayWeights) const
+        {
+            return new internal::LambImpl<Dtype, Dims>(this->m_learningRate, m_beta1, m_beta2, m_epsilon,
+                                                        decayWeights ? m_weightDecay : Dtype(0), decayWeights);
+        };
+
+    private:
+        Dtype m_weightDecay;
+        Dtype m_beta1;
+        Dtype m_beta2;
+        Dtype m_epsilon;
+    };
+
+}
@@ -10,15 +10,62 @@ namespace nn
         class StochasticGradientDescentImpl : public OptimizerImpl<Dtype, Dims>
         {
         public:
-            explicit StochasticGradientDescentImpl(Dtype learningRate) : m_learningRate(learningRate) {}
+            StochasticGradientDescentImpl(std::shared_ptr<const Dtype> learningRate, Dtype momentum, bool nesterov) : m_learningRate(learningRate),
+                                                                                                                     m_momentum(momentum),
+                                                                                                                     m_nesterov(nesterov)
+            {
+            }
 
-            Eigen::Tensor<Dtype, Dims> weightUpdate(const Eigen::Tensor<Dtype, Dims> &gradWeights)
+            void update(Eigen::Tensor<Dtype, Dims> &weights, const Eigen::Tensor<Dtype, Dims> &gradWeights)
             {
-                return gradWeights * gradWeights.constant(m_learningRate);
+                const Dtype learningRate = *m_learningRate;
+                if (m_momentum == 0)
+                {
+                    weights -= gradWeights * learningRate;
+                    return;
+                }
+
+                ensureState(m_velocity, weights);
+                m_velocity = m_velocity * m_momentum + gradWeights;
+                if (m_nesterov)
+                {
+                    // Step along the gradient and the velocity it leads to, without materializing the look-ahead
+                    weights -= (gradWeights + m_velocity * m_momentum) * learningRate;
+                }
+                else
+                {
+                    weights -= m_velocity * learningRate;
+                }
             };
 
+            void saveState(Snapshot<Dtype> &snapshot) const
+            {
+                // Plain SGD is stateless, which keeps its checkpoints unchanged
+                if (m_momentum != 0)
+                {
+                    snapshot.addTensor("SGD.velocity", m_velocity);
+                }
+            }
+
+            bool loadState(Snapshot<Dtype> &snapshot, const Eigen::Tensor<Dtype, Dims> &weights)
+            {
+                return m_momentum == 0 || (snapshot.readTensor("SGD.velocity", m_velocity) &&
+                                           stateMatches("SGD.velocity", m_velocity, weights));
+            }
+
+            size_t stateBytes() const { return tensorBytes(m_velocity); }
+
+            size_t predictStateBytes(Eigen::Index numWeights) const
+            {
+                return m_momentum != 0 ? static_cast<size_t>(numWeights) * sizeof(Dtype) : 0;
+            }
+
         private:
-            Dtype m_learningRate;
+            std::shared_ptr<const Dtype> m_learningRate; ///< The current learning rate, shared with the optimizer
+            Dtype m_momentum;
+            bool m_nesterov;
+
+            Eigen::Tensor<Dtype, Dims> m_velocity;
         };
     }
 }
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <unsupported/Eigen/CXX11/Tensor>
+
+#include <cassert>
+#include <memory>
+#include <vector>
+
+namespace nn
+{
+    /**
+     * Read-only view of a tensor of fixed rank, used by layers to consume activations without copying them
+     */
+    template <typename Dtype, int Dims>
+    using TensorView = Eigen::TensorMap<const Eigen::Tensor<Dtype, Dims>>;
+
+    /**
+     * Rank-agnostic handle to the tensor handed from one layer to the next: a shape and a pointer into a
+     * buffer shared by every handle derived from it.
+     *
+     * Wrapping a tensor moves it into the shared buffer, viewing it at its own rank or reshaping it to
+     * another shape with the same number of elements never copies, so layers of different ranks can be
+     * chained without copies at their boundaries.
+     */
+    template <typename Dtype = float>
+    class Activation
+    {
+    public:
+        typedef Dtype Scalar;
+
+        static const int MAX_RANK = 5; ///< Highest rank a handle can describe
+
+        Activation() = default;
+
+        /**
+         * Take ownership of the tensor's buffer
+         */
+        template <int Rank>
+        explicit Activation(Eigen::Tensor<Dtype, Rank> &&tensor);
+
+        int rank() const
+        {
+            return m_rank;
+        }
+
+        Eigen::Index dimension(int index) const
+        {
+            assert(index < m_rank && "Activation::dimension index out of range");
+            return m_dimensions[index];
+        }
+
+        std::vector<Eigen::Index> shape() const
+        {
+            return std::vector<Eigen::Index>(m_dimensions.begin(), m_dimensions.begin() + m_rank);
+        }
+
+        Eigen::Index size() const;
+
+        bool empty() const
+        {
+            return m_data == nullptr;
+        }
+
+        const Dtype *data() const
+        {
+            return m_data;
+        }
+
+        /**
+         * View the buffer as a tensor of the given rank, which must be the rank of this handle
+         */
+        template <int Rank>
+        TensorView<Dtype, Rank> view() const;
+
+        /**
+         * A handle to the same buffer with a different shape of the same size
+         */
+        Activation reshape(const std::vector<Eigen::Index> &shape) const;
+
+        /**
+         * Hand out the buffer as a tensor. The tensor is moved out when this handle is the only owner of a
+         * tensor of that rank and shape, and copied otherwise. Leaves the handle empty.
+         */
+        template <int Rank>
+        Eigen::Tensor<Dtype, Rank> release();
+
+    private:
+        std::shared_ptr<void> m_owner;                    ///< The tensor owning the buffer, of rank m_ownerRank
+        int m_ownerRank = 0;                              ///< The rank of the owning tensor
+        const Dtype *m_data = nullptr;                    ///< Start of the buffer
+        int m_rank = 0;                                   ///< The rank of this handle
+        Eigen::array<Eigen::Index, MAX_RANK> m_dimensions{}; ///< The shape of this handle, the first m_rank entries are used
+    };
+
+    template <typename Dtype>
+    template <int Rank>
+    Activation<Dtype>::Activation(Eigen::Tensor<Dtype, Rank> &&tensor) : m_ownerRank(Rank),
+                                                                         m_rank(Rank)
+    {
+        static_assert(Rank <= MAX_RANK, "Activation rank is limited to MAX_RANK");
+        auto owner = std::make_shared<Eigen::Tensor<Dtype, Rank>>(std::move(tensor));
+        m_data = owner->data();
+        for (int ii = 0; ii < Rank; ++ii)
+        {
+            m_dimensions[ii] = owner->dimension(ii);
+        }
+        m_owner = std::move(owner);
+    }
+
+    template <typename Dtype>
+    Eigen::Index Activation<Dtype>::size() const
+    {
+        if (m_rank == 0)
+        {
+            return 0;
+        }
+
+        Eigen::Index size = 1;
+        for (int ii = 0; ii < m_rank; ++ii)
+        {
+            size *= m_dimensions[ii];
+        }
+        return size;
+    }
+
+    template <typename Dtype>
+    template <int Rank>
+    TensorView<Dtype, Rank> Activation<Dtype>::view() const
+    {
+        assert(m_rank == Rank && "Activation::view rank does not match the rank of the activation");
+        Eigen::array<Eigen::Index, Rank> dimensions;
+        for (int ii = 0; ii < Rank; ++ii)
+        {
+            dimensions[ii] = m_dimensions[ii];
+        }
+        return TensorView<Dtype, Rank>(m_data, dimensions);
+    }
+
+    template <typename Dtype>
+    Activation<Dtype> Activation<Dtype>::reshape(const std::vector<Eigen::Index> &shape) const
+    {
+        assert(shape.size() <= MAX_RANK && "Activation::reshape rank is limited to MAX_RANK");
+        Activation reshaped(*this);
+        reshaped.m_rank = static_cast<int>(shape.size());
+        std::copy(shape.begin(), shape.end(), reshaped.m_dimensions.begin());
+        assert(reshaped.size() == size() && "Activation::reshape has to keep the number of elements");
+        return reshaped;
+    }
+
+    template <typename Dtype>
+    template <int Rank>
+    Eigen::Tensor<Dtype, Rank> Activation<Dtype>::release()
+    {
+        auto view = this->view<Rank>();
+        auto owner = static_cast<Eigen::Tensor<Dtype, Rank> *>(m_owner.get());
+        const bool canMove = m_ownerRank == Rank && m_owner.use_count() == 1 &&
+                             owner->data() == m_data && owner->dimensions() == view.dimensions();
+
+        Eigen::Tensor<Dtype, Rank> tensor = canMove ? std::move(*owner) : Eigen::Tensor<Dtype, Rank>(view);
+        *this = Activation();
+        return tensor;
+    }
+}
@@ -0,0 +1,518 @@
+#pragma once
+
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nn
+{
+    namespace internal
+    {
+        /**
+         * Version 2 added the optimizer step of Net. Version 1 files still load, with the step starting at 0.
+         */
+        const uint32_t CHECKPOINT_FORMAT_VERSION = 2;
+        const uint32_t OLDEST_CHECKPOINT_FORMAT_VERSION = 1;
+    }
+
+    /**
+     * Position of the training loop at the time a snapshot was taken
+     */
+    struct TrainingProgress
+    {
+        uint64_t epoch = 0; ///< The epoch to resume from
+        uint64_t batch = 0; ///< The batch within the epoch to resume from
+    };
+
+    /**
+     * An in-memory copy of the full training state (weights, optimizer state, progress and RNG state).
+     *
+     * Layers and optimizers append their state in a fixed order with the add* methods and read it back in the
+     * same order with the read* methods. Every tensor is copied on capture so the training loop can keep
+     * mutating its own tensors while the snapshot is serialized on another thread.
+     */
+    template <typename Dtype = float>
+    class Snapshot
+    {
+    public:
+        Snapshot() = default;
+
+        template <int Dims>
+        void addTensor(const std::string &name, const Eigen::Tensor<Dtype, Dims> &tensor);
+
+        void addInteger(const std::string &name, uint64_t value);
+
+        template <int Dims>
+        bool readTensor(const std::string &name, Eigen::Tensor<Dtype, Dims> &tensor);
+
+        bool readInteger(const std::string &name, uint64_t &value);
+
+        template <typename Engine>
+        void setRngState(const Engine &engine)
+        {
+            std::ostringstream stream;
+            stream << engine;
+            m_rngState = stream.str();
+        }
+
+        template <typename Engine>
+        bool getRngState(Engine &engine) const
+        {
+            if (m_rngState.empty())
+            {
+                std::cerr << "Snapshot does not contain an RNG state" << std::endl;
+                return false;
+            }
+            std::istringstream stream(m_rngState);
+            stream >> engine;
+            return !stream.fail();
+        }
+
+        void setProgress(const TrainingProgress &progress)
+        {
+            m_progress = progress;
+        }
+
+        const TrainingProgress &getProgress() const
+        {
+            return m_progress;
+        }
+
+        /**
+         * Rewind the read cursor so the snapshot can be restored more than once
+         */
+        void rewind()
+        {
+            m_readPosition = 0;
+        }
+
+        /**
+         * The format version of the file the snapshot was loaded from, the current version for a captured one
+         */
+        uint32_t getVersion() const
+        {
+            return m_version;
+        }
+
+        bool save(const std::string &path) const;
+
+        bool load(const std::string &path);
+
+    private:
+        struct Record
+        {
+            std::string name;                ///< Name of the field, checked on restore
+            std::vector<Eigen::Index> dims;  ///< Dimensions of a tensor record, empty for an integer record
+            std::vector<Dtype> data;         ///< Flattened tensor data
+            uint64_t integer = 0;            ///< Value of an integer record
+        };
+
+        const Record *nextRecord(const std::string &name);
+
+        std::vector<Record> m_records;
+        TrainingProgress m_progress;
+        std::string m_rngState;
+        size_t m_readPosition = 0;
+        uint32_t m_version = internal::CHECKPOINT_FORMAT_VERSION;
+    };
+
+    template <typename Dtype>
+    template <int Dims>
+    void Snapshot<Dtype>::addTensor(const std::string &name, const Eigen::Tensor<Dtype, Dims> &tensor)
+    {
+        Record record;
+        record.name = name;
+        record.dims.assign(tensor.dimensions().begin(), tensor.dimensions().end());
+        record.data.assign(tensor.data(), tensor.data() + tensor.size());
+        m_records.push_back(std::move(record));
+    }
+
+    template <typename Dtype>
+    void Snapshot<Dtype>::addInteger(const std::string &name, uint64_t value)
+    {
+        Record record;
+        record.name = name;
+        record.integer = value;
+        m_records.push_back(std::move(record));
+    }
+
+    template <typename Dtype>
+    const typename Snapshot<Dtype>::Record *Snapshot<Dtype>::nextRecord(const std::string &name)
+    {
+        if (m_readPosition >= m_records.size())
+        {
+            std::cerr << "Snapshot has no record left for: " << name << std::endl;
+            return nullptr;
+        }
+
+        const Record &record = m_records[m_readPosition];
+        if (record.name != name)
+        {
+            std::cerr << "Snapshot expected record " << name << " but found " << record.name << std::endl;
+            return nullptr;
+        }
+        m_readPosition++;
+        return &record;
+    }
+
+    template <typename Dtype>
+    template <int Dims>
+    bool Snapshot<Dtype>::readTensor(const std::string &name, Eigen::Tensor<Dtype, Dims> &tensor)
+    {
+        const Record *record = nextRecord(name);
+        if (record == nullptr)
+        {
+            return false;
+        }
+
+        if (record->dims.size() != Dims)
+        {
+            std::cerr << "Snapshot record " << name << " has rank " << record->dims.size()
+                      << " but expected " << Dims << std::endl;
+            return false;
+        }
+
+        Eigen::array<Eigen::Index, Dims> dims;
+        std::copy(record->dims.begin(), record->dims.end(), dims.begin());
+        tensor = Eigen::Tensor<Dtype, Dims>(dims);
+        std::copy(record->data.begin(), record->data.end(), tensor.data());
+        return true;
+    }
+
+    template <typename Dtype>
+    bool Snapshot<Dtype>::readInteger(const std::string &name, uint64_t &value)
+    {
+        const Record *record = nextRecord(name);
+        if (record == nullptr)
+        {
+            return false;
+        }
+        value = record->integer;
+        return true;
+    }
+
+    namespace internal
+    {
+        template <typename T>
+        void writePod(std::ostream &stream, const T &value)
+        {
+            stream.write(reinterpret_cast<const char *>(&value), sizeof(T));
+        }
+
+        template <typename T>
+        bool readPod(std::istream &stream, T &value)
+        {
+            stream.read(reinterpret_cast<char *>(&value), sizeof(T));
+            return static_cast<bool>(stream);
+        }
+
+        /**
+         * fsync a file or directory
+         */
+        inline bool syncPath(const std::string &path)
+        {
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return false;
+            }
+            const bool succeeded = ::fsync(fd) == 0;
+            ::close(fd);
+            return succeeded;
+        }
+
+        inline void writeString(std::ostream &stream, const std::string &value)
+        {
+            writePod<uint64_t>(stream, value.size());
+            stream.write(value.data(), value.size());
+        }
+
+        /**
+         * @param maxSize Upper bound on the size read from the stream, so a corrupted size cannot allocate more
+         * than the file holds
+         */
+        inline bool readString(std::istream &stream, std::string &value, uint64_t maxSize)
+        {
+            uint64_t size;
+            if (!readPod(stream, size) || size > maxSize)
+            {
+                return false;
+            }
+            value.resize(size);
+            stream.read(&value[0], size);
+            return static_cast<bool>(stream);
+        }
+    }
+
+    template <typename Dtype>
+    bool Snapshot<Dtype>::save(const std::string &path) const
+    {
+        // Write next to the destination and rename so a crash never leaves a truncated checkpoint behind
+        const std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!file)
+            {
+                std::cerr << "Could not open checkpoint file for writing: " << tmpPath << std::endl;
+                return false;
+            }
+
+            file.write("CPPNNCKP", 8);
+            internal::writePod<uint32_t>(file, internal::CHECKPOINT_FORMAT_VERSION);
+            internal::writePod<uint32_t>(file, sizeof(Dtype));
+            internal::writePod<uint64_t>(file, m_progress.epoch);
+            internal::writePod<uint64_t>(file, m_progress.batch);
+            internal::writeString(file, m_rngState);
+            internal::writePod<uint64_t>(file, m_records.size());
+
+            for (const Record &record : m_records)
+            {
+                internal::writeString(file, record.name);
+                internal::writePod<uint64_t>(file, record.dims.size());
+                for (Eigen::Index dim : record.dims)
+                {
+                    internal::writePod<int64_t>(file, dim);
+                }
+                internal::writePod<uint64_t>(file, record.integer);
+                file.write(reinterpret_cast<const char *>(record.data.data()), record.data.size() * sizeof(Dtype));
+            }
+
+            if (!file)
+            {
+                std::cerr << "Failed writing checkpoint file: " << tmpPath << std::endl;
+                return false;
+            }
+        }
+
+        // The data has to reach the disk before the rename does, or a power loss can leave the renamed file empty
+        if (!internal::syncPath(tmpPath))
+        {
+            std::cerr << "Could not flush checkpoint file to disk: " << tmpPath << std::endl;
+            return false;
+        }
+
+        const size_t separator = path.find_last_of('/');
+        const std::string directory = separator == std::string::npos ? "." : path.substr(0, std::max<size_t>(separator, 1));
+        if (!internal::syncPath(directory) || std::rename(tmpPath.c_str(), path.c_str()) != 0)
+        {
+            std::cerr << "Could not move checkpoint into place: " << path << std::endl;
+            return false;
+        }
+
+        // Persist the rename itself
+        if (!internal::syncPath(directory))
+        {
+            std::cerr << "Could not flush checkpoint directory to disk: " << directory << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    template <typename Dtype>
+    bool Snapshot<Dtype>::load(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            std::cerr << "Could not open checkpoint file: " << path << std::endl;
+            return false;
+        }
+
+        char magic[8];
+        uint32_t version, dtypeSize;
+        file.read(magic, 8);
+        if (!file || std::string(magic, 8) != "CPPNNCKP" || !internal::readPod(file, version) ||
+            version < internal::OLDEST_CHECKPOINT_FORMAT_VERSION || version > internal::CHECKPOINT_FORMAT_VERSION ||
+            !internal::readPod(file, dtypeSize) || dtypeSize != sizeof(Dtype))
+        {
+            std::cerr << "Incompatible checkpoint file: " << path << std::endl;
+            return false;
+        }
+
+        // Every size in the file is checked against the bytes left in it before anything is allocated
+        const std::streampos headerEnd = file.tellg();
+        file.seekg(0, std::ios::end);
+        const uint64_t fileSize = file.tellg();
+        file.seekg(headerEnd);
+        auto remaining = [&]()
+        {
+            return fileSize - static_cast<uint64_t>(file.tellg());
+        };
+
+        uint64_t numRecords;
+        if (!internal::readPod(file, m_progress.epoch) || !internal::readPod(file, m_progress.batch) ||
+            !internal::readString(file, m_rngState, remaining()) || !internal::readPod(file, numRecords))
+        {
+            std::cerr << "Truncated checkpoint header: " << path << std::endl;
+            return false;
+        }
+
+        // A record holds at least its name size, rank and integer
+        const uint64_t minRecordBytes = 3 * sizeof(uint64_t);
+        if (numRecords > remaining() / minRecordBytes)
+        {
+            std::cerr << "Corrupted checkpoint, more records than the file can hold: " << path << std::endl;
+            return false;
+        }
+
+        m_version = version;
+        m_records.clear();
+        m_records.resize(numRecords);
+        m_readPosition = 0;
+        for (Record &record : m_records)
+        {
+            uint64_t rank;
+            if (!internal::readString(file, record.name, remaining()) || !internal::readPod(file, rank) ||
+                rank > remaining() / sizeof(int64_t))
+            {
+                std::cerr << "Truncated checkpoint record: " << path << std::endl;
+                return false;
+            }
+
+            record.dims.resize(rank);
+            uint64_t size = rank > 0 ? 1 : 0;
+            for (Eigen::Index &dim : record.dims)
+            {
+                int64_t value;
+                if (!internal::readPod(file, value) || value < 0 ||
+                    (value > 0 && size > std::numeric_limits<uint64_t>::max() / value))
+                {
+                    std::cerr << "Corrupted checkpoint record dimensions " << record.name << ": " << path << std::endl;
+                    return false;
+                }
+                dim = value;
+                size *= value;
+            }
+
+            if (!internal::readPod(file, record.integer) || size > remaining() / sizeof(Dtype))
+            {
+                std::cerr << "Truncated checkpoint record " << record.name << ": " << path << std::endl;
+                return false;
+            }
+
+            record.data.resize(size);
+            file.read(reinterpret_cast<char *>(record.data.data()), size * sizeof(Dtype));
+            if (!file)
+            {
+                std::cerr << "Truncated checkpoint record " << record.name << ": " << path << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Serializes snapshots to disk on a background thread.
+     *
+     * Snapshots are written in the order they were submitted and the training loop never blocks on disk I/O.
+     * At most one snapshot per path is kept pending: if the writer is still busy when a new snapshot for the
+     * same path is submitted, the older pending one is replaced, since it would be overwritten anyway.
+     * Snapshots for different paths, e.g. one file per epoch, are all written.
+     */
+    template <typename Dtype = float>
+    class CheckpointWriter
+    {
+    public:
+        CheckpointWriter() : m_stop(false), m_busy(false), m_failed(false), m_thread(&CheckpointWriter::run, this) {}
+
+        CheckpointWriter(const CheckpointWriter &) = delete;
+
+        CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+        ~CheckpointWriter()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_condition.notify_all();
+            m_thread.join();
+        }
+
+        void submit(Snapshot<Dtype> &&snapshot, const std::string &path)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                std::unique_ptr<Snapshot<Dtype>> pending(new Snapshot<Dtype>(std::move(snapshot)));
+                auto samePath = std::find_if(m_pending.begin(), m_pending.end(), [&](const PendingWrite &write)
+                                             { return write.first == path; });
+                if (samePath != m_pending.end())
+                {
+                    samePath->second = std::move(pending);
+                }
+                else
+                {
+                    m_pending.emplace_back(path, std::move(pending));
+                }
+            }
+            m_condition.notify_all();
+        }
+
+        /**
+         * Block until every submitted snapshot has been written
+         * @return false if any write since the last flush failed
+         */
+        bool flush()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]()
+                             { return m_pending.empty() && !m_busy; });
+            bool succeeded = !m_failed;
+            m_failed = false;
+            return succeeded;
+        }
+
+    private:
+        void run()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                m_condition.wait(lock, [this]()
+                                 { return m_stop || !m_pending.empty(); });
+                if (m_pending.empty())
+                {
+                    return;
+                }
+
+                std::unique_ptr<Snapshot<Dtype>> snapshot = std::move(m_pending.front().second);
+                std::string path = std::move(m_pending.front().first);
+                m_pending.pop_front();
+                m_busy = true;
+
+                lock.unlock();
+                bool succeeded = snapshot->save(path);
+                lock.lock();
+
+                m_failed = m_failed || !succeeded;
+                m_busy = false;
+                m_condition.notify_all();
+            }
+        }
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        typedef std::pair<std::string, std::unique_ptr<Snapshot<Dtype>>> PendingWrite; ///< Path and snapshot
+
+        std::deque<PendingWrite> m_pending; ///< Snapshots waiting to be written, at most one per path
+        bool m_stop;
+        bool m_busy;
+        bool m_failed;
+        std::thread m_thread; ///< Declared last so it starts after the state above is initialized
+    };
+}
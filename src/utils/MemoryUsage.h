@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace nn
+{
+    /**
+     * Bytes held by a layer, split by what the memory is used for
+     */
+    struct MemoryUsage
+    {
+        size_t parameterBytes = 0;      ///< Trainable weights and biases
+        size_t gradientBytes = 0;       ///< Gradients of the trainable weights
+        size_t optimizerStateBytes = 0; ///< Per-weight optimizer state, e.g. Adam moments
+        size_t activationBytes = 0;     ///< Tensors cached by forward for use in backward
+        size_t temporaryBytes = 0;      ///< Largest tensor materialized and handed on by a forward or backward call
+
+        /**
+         * Bytes that stay allocated between calls, i.e. everything but the temporaries
+         */
+        size_t persistentBytes() const
+        {
+            return parameterBytes + gradientBytes + optimizerStateBytes + activationBytes;
+        }
+
+        size_t totalBytes() const
+        {
+            return persistentBytes() + temporaryBytes;
+        }
+
+        MemoryUsage &operator+=(const MemoryUsage &other)
+        {
+            parameterBytes += other.parameterBytes;
+            gradientBytes += other.gradientBytes;
+            optimizerStateBytes += other.optimizerStateBytes;
+            activationBytes += other.activationBytes;
+            temporaryBytes += other.temporaryBytes;
+            return *this;
+        }
+    };
+
+    /**
+     * Memory usage of a whole network, per layer and in total
+     */
+    struct MemoryReport
+    {
+        std::vector<std::string> layerNames; ///< The name of every layer in order
+        std::vector<MemoryUsage> layers;     ///< The usage of every layer in order
+        MemoryUsage total;                   ///< The summed usage of all layers
+        size_t estimatedPeakBytes = 0;       ///< Highest number of bytes alive at once, from the per-layer accounting
+
+        void print(std::ostream &stream = std::cout) const
+        {
+            stream << std::left << std::setw(12) << "Layer" << std::right
+                   << std::setw(12) << "Params" << std::setw(12) << "Grads" << std::setw(12) << "Optimizer"
+                   << std::setw(12) << "Activations" << std::setw(12) << "Temporary" << std::endl;
+            for (size_t ii = 0; ii < layers.size(); ++ii)
+            {
+                printRow(stream, layerNames[ii], layers[ii]);
+            }
+            printRow(stream, "Total", total);
+            stream << "Estimated peak bytes: " << estimatedPeakBytes << std::endl;
+        }
+
+    private:
+        static void printRow(std::ostream &stream, const std::string &name, const MemoryUsage &usage)
+        {
+            stream << std::left << std::setw(12) << name << std::right
+                   << std::setw(12) << usage.parameterBytes << std::setw(12) << usage.gradientBytes
+                   << std::setw(12) << usage.optimizerStateBytes << std::setw(12) << usage.activationBytes
+                   << std::setw(12) << usage.temporaryBytes << std::endl;
+        }
+    };
+
+    template <typename TensorType>
+    size_t tensorBytes(const TensorType &tensor)
+    {
+        return static_cast<size_t>(tensor.size()) * sizeof(typename TensorType::Scalar);
+    }
+
+    /**
+     * Bytes of a tensor of the given shape, for any rank
+     */
+    template <typename Dtype, typename ShapeType>
+    size_t shapeBytes(const ShapeType &shape)
+    {
+        size_t size = sizeof(Dtype);
+        for (auto dimension : shape)
+        {
+            size *= static_cast<size_t>(dimension);
+        }
+        return size;
+    }
+}
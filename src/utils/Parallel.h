@@ -0,0 +1,181 @@
+#pragma once
+
+#include <unsupported/Eigen/CXX11/Tensor>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace nn
+{
+    namespace internal
+    {
+        inline int &numThreadsSetting()
+        {
+            static int numThreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+            return numThreads;
+        }
+
+        /**
+         * Worker threads that stay alive between parallelFor calls, so a kernel does not pay for creating and
+         * joining threads every time it runs. Workers are started when a call first needs them and then wait
+         * on a condition variable for the next call.
+         */
+        class ThreadPool
+        {
+        public:
+            /**
+             * The pool of this process. A child created with fork() has none of its parent's threads, so it
+             * gets a pool of its own.
+             */
+            static ThreadPool &instance()
+            {
+                // Never destroyed, so workers blocked in wait at exit do not outlive their pool
+                static ThreadPool *pool = new ThreadPool();
+                if (pool->m_pid != getpid())
+                {
+                    pool = new ThreadPool();
+                }
+                return *pool;
+            }
+
+            ThreadPool(const ThreadPool &) = delete;
+
+            ThreadPool &operator=(const ThreadPool &) = delete;
+
+            /**
+             * Run function(task) for every task in [0, numTasks) on numThreads threads, counting the caller
+             */
+            void run(Eigen::Index numTasks, int numThreads, const std::function<void(Eigen::Index)> &function)
+            {
+                // One call at a time, a second caller waits for the workers to become free
+                std::lock_guard<std::mutex> dispatchLock(m_dispatchMutex);
+                const size_t numWorkers = numThreads - 1;
+                while (m_numWorkers < numWorkers)
+                {
+                    std::thread(&ThreadPool::work, this, m_numWorkers++, m_generation).detach();
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_function = &function;
+                    m_numTasks = numTasks;
+                    m_nextTask = 0;
+                    m_numJobWorkers = numWorkers;
+                    m_numBusy = numWorkers;
+                    m_generation++;
+                }
+                m_condition.notify_all();
+
+                runTasks();
+
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_done.wait(lock, [this]()
+                            { return m_numBusy == 0; });
+                m_function = nullptr;
+            }
+
+            /**
+             * Whether the calling thread is running a task, in which case a nested parallelFor runs serially
+             */
+            static bool &insideTask()
+            {
+                static thread_local bool inside = false;
+                return inside;
+            }
+
+        private:
+            ThreadPool() : m_pid(getpid()) {}
+
+            void runTasks()
+            {
+                insideTask() = true;
+                for (Eigen::Index task = m_nextTask++; task < m_numTasks; task = m_nextTask++)
+                {
+                    (*m_function)(task);
+                }
+                insideTask() = false;
+            }
+
+            /**
+             * @param seenGeneration The last call before the worker started, which it does not take part in
+             */
+            void work(size_t index, uint64_t seenGeneration)
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (true)
+                {
+                    m_condition.wait(lock, [&]()
+                                     { return m_generation != seenGeneration; });
+                    seenGeneration = m_generation;
+                    if (index >= m_numJobWorkers)
+                    {
+                        continue;
+                    }
+
+                    lock.unlock();
+                    runTasks();
+                    lock.lock();
+                    if (--m_numBusy == 0)
+                    {
+                        m_done.notify_all();
+                    }
+                }
+            }
+
+            pid_t m_pid; ///< The process the workers belong to
+
+            std::mutex m_dispatchMutex;
+            std::mutex m_mutex;
+            std::condition_variable m_condition; ///< Wakes the workers for a new call
+            std::condition_variable m_done;      ///< Wakes the caller once every worker finished its tasks
+            size_t m_numWorkers = 0; ///< Workers started so far
+
+            const std::function<void(Eigen::Index)> *m_function = nullptr; ///< The function of the current call
+            Eigen::Index m_numTasks = 0;
+            std::atomic<Eigen::Index> m_nextTask{0};
+            size_t m_numJobWorkers = 0; ///< Workers taking part in the current call, the others keep waiting
+            size_t m_numBusy = 0;       ///< Workers of the current call that have not finished yet
+            uint64_t m_generation = 0;  ///< Counts the calls, so a worker runs every call once
+        };
+    }
+
+    /**
+     * Set the number of threads used by the multi-threaded kernels, defaults to the number of hardware threads
+     */
+    inline void setNumThreads(int numThreads)
+    {
+        internal::numThreadsSetting() = std::max(1, numThreads);
+    }
+
+    inline int getNumThreads()
+    {
+        return internal::numThreadsSetting();
+    }
+
+    /**
+     * Run function(task) for every task in [0, numTasks), spread over up to getNumThreads() threads of a
+     * persistent pool. Tasks are handed out dynamically, so they may differ in cost; the calling thread takes
+     * part as well. Calls from inside a task run serially on the calling thread.
+     */
+    template <typename Function>
+    void parallelFor(Eigen::Index numTasks, Function function)
+    {
+        const Eigen::Index numThreads = std::min<Eigen::Index>(getNumThreads(), numTasks);
+        if (numThreads <= 1 || internal::ThreadPool::insideTask())
+        {
+            for (Eigen::Index task = 0; task < numTasks; ++task)
+            {
+                function(task);
+            }
+            return;
+        }
+
+        internal::ThreadPool::instance().run(numTasks, static_cast<int>(numThreads), std::function<void(Eigen::Index)>(function));
+    }
+}
@@ -72,5 +72,22 @@ namespace nn
         }
         return weights;
     };
-}
 
+    /**
+     * Draw weights of an arbitrary shape, e.g. (kernelHeight, kernelWidth, inChannels, outChannels) for a
+     * convolution, whose fan-in and fan-out cannot be read off the shape
+     */
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> getRandomWeights(const Eigen::array<Eigen::Index, Dims> &dims, int fanIn, int fanOut,
+                                                InitializationScheme scheme = InitializationScheme::GlorotUniform)
+    {
+        Eigen::Tensor<Dtype, Dims> weights(dims);
+
+        auto distribution = WeightDistribution<Dtype>(scheme, fanIn, fanOut);
+        for (Eigen::Index ii = 0; ii < weights.size(); ++ii)
+        {
+            weights.data()[ii] = distribution.get();
+        }
+        return weights;
+    }
+}
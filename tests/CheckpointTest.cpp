@@ -0,0 +1,185 @@
+#include "TestUtils.h"
+#include "../src/loss/CrossEntropy.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+/**
+ * Training that resumes from a checkpoint ends with bit-identical weights and optimizer state to training
+ * that never stopped, and corrupted or mismatching checkpoints are rejected without touching the network.
+ */
+
+using test::check;
+
+const int BATCH_SIZE = 16, NUM_FEATURES = 8, NUM_HIDDEN = 12, NUM_CLASSES = 3;
+
+std::unique_ptr<nn::Net<float>> makeNet(bool outputBias = true)
+{
+    return test::makeDenseNet(BATCH_SIZE, NUM_FEATURES, NUM_HIDDEN, NUM_CLASSES, new nn::Adam<float>(0.01), outputBias);
+}
+
+void train(nn::Net<float> &net, const Eigen::Tensor<float, 2> &input, const Eigen::Tensor<float, 2> &labels, int numSteps)
+{
+    nn::CrossEntropyLoss<float, 2> lossFunc;
+    for (int ii = 0; ii < numSteps; ++ii)
+    {
+        auto result = net.forward<2, 2>(input);
+        net.backward(lossFunc.backward(result, labels));
+        net.step();
+    }
+}
+
+std::string readFile(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string &path, const std::string &contents)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(contents.data(), contents.size());
+}
+
+int main()
+{
+    Eigen::Tensor<float, 2> input(BATCH_SIZE, NUM_FEATURES);
+    input.setRandom();
+    const Eigen::Tensor<float, 2> labels = test::oneHotLabels(BATCH_SIZE, NUM_CLASSES);
+
+    // Train 20 steps in one go, checkpointing after 8 of them
+    const std::string resumePath = "checkpoint_test_resume.ckpt";
+    const std::string straightPath = "checkpoint_test_straight.ckpt";
+    const std::string resumedPath = "checkpoint_test_resumed.ckpt";
+    nn::TrainingProgress savedProgress;
+    savedProgress.epoch = 3;
+    savedProgress.batch = 8;
+    auto straight = makeNet();
+    train(*straight, input, labels, 8);
+    check(straight->saveCheckpoint(resumePath, savedProgress), "saving the checkpoint");
+    train(*straight, input, labels, 12);
+    check(straight->saveCheckpoint(straightPath), "saving the uninterrupted run");
+
+    // Resume a freshly initialized network from the checkpoint and train the remaining 12 steps
+    auto resumed = makeNet();
+    nn::TrainingProgress progress;
+    check(resumed->loadCheckpoint(resumePath, progress), "loading the checkpoint");
+    check(progress.epoch == 3 && progress.batch == 8, "restoring the training progress");
+    train(*resumed, input, labels, 12);
+    check(resumed->saveCheckpoint(resumedPath), "saving the resumed run");
+
+    const std::string straightBytes = readFile(straightPath);
+    check(!straightBytes.empty() && straightBytes == readFile(resumedPath),
+          "resumed weights and optimizer state are bit-identical to the uninterrupted run");
+
+    // A network whose last layer differs restores its first layer before it finds the mismatch, and has to
+    // roll it back
+    const std::string beforePath = "checkpoint_test_before.ckpt";
+    const std::string afterPath = "checkpoint_test_after.ckpt";
+    auto other = makeNet(false);
+    check(other->saveCheckpoint(beforePath), "saving the mismatching network");
+    check(!other->loadCheckpoint(resumePath, progress), "rejecting a checkpoint of another shape");
+    check(other->saveCheckpoint(afterPath) && readFile(beforePath) == readFile(afterPath),
+          "a failed load leaves the network unchanged");
+    nn::Snapshot<float> otherState;
+    other->saveState(otherState);
+    check(other->loadState(otherState) && other->loadState(otherState), "loading the same snapshot twice");
+
+    // Corrupt the sizes in the header and in the first tensor record, then truncate the file
+    const std::string valid = readFile(resumePath);
+    const size_t headerBytes = 8 + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    const size_t rngBytes = sizeof(uint64_t) + *reinterpret_cast<const uint64_t *>(&valid[headerBytes]);
+    const size_t firstRecord = headerBytes + rngBytes + sizeof(uint64_t);
+    const size_t nameSize = *reinterpret_cast<const uint64_t *>(&valid[firstRecord]);
+    const size_t numLayersRecord = 2 * sizeof(uint64_t) + nameSize + sizeof(uint64_t);
+    const size_t weightsRank = firstRecord + numLayersRecord + sizeof(uint64_t) + std::string("Dense.weights").size();
+    const std::string corruptPath = "checkpoint_test_corrupt.ckpt";
+    const std::vector<std::pair<size_t, int64_t>> corruptions = {
+        {headerBytes, int64_t(1) << 60},                     // RNG state size
+        {headerBytes + rngBytes, int64_t(1) << 60},          // number of records
+        {weightsRank, int64_t(1) << 60},                     // rank
+        {weightsRank + sizeof(uint64_t), -1},                // negative dimension
+        {weightsRank + sizeof(uint64_t), int64_t(1) << 40},  // dimension larger than the file
+        {weightsRank + 2 * sizeof(uint64_t), int64_t(1) << 62} // dimension product that overflows
+    };
+    for (const auto &corruption : corruptions)
+    {
+        std::string corrupted = valid;
+        std::memcpy(&corrupted[corruption.first], &corruption.second, sizeof(int64_t));
+        writeFile(corruptPath, corrupted);
+        nn::Snapshot<float> snapshot;
+        check(!snapshot.load(corruptPath), "rejecting a corrupted size at byte " + std::to_string(corruption.first));
+    }
+    for (size_t length : {size_t(4), headerBytes, valid.size() / 2, valid.size() - 1})
+    {
+        writeFile(corruptPath, valid.substr(0, length));
+        nn::Snapshot<float> snapshot;
+        check(!snapshot.load(corruptPath), "rejecting a checkpoint truncated to " + std::to_string(length) + " bytes");
+    }
+
+    // A version 1 file has no optimizer step record, the last one, and resumes with the step at 0
+    const size_t stepRecordBytes = sizeof(uint64_t) + std::string("Net.optimizerStep").size() + 2 * sizeof(uint64_t);
+    std::string version1 = valid.substr(0, valid.size() - stepRecordBytes);
+    const uint32_t oldVersion = 1;
+    std::memcpy(&version1[8], &oldVersion, sizeof(uint32_t));
+    (*reinterpret_cast<uint64_t *>(&version1[headerBytes + rngBytes]))--;
+    const std::string version1Path = "checkpoint_test_version1.ckpt";
+    const std::string version1SavedPath = "checkpoint_test_version1_saved.ckpt";
+    writeFile(version1Path, version1);
+    auto old = makeNet();
+    check(old->loadCheckpoint(version1Path, progress), "loading a version 1 checkpoint");
+    std::string expected = valid;
+    std::memset(&expected[expected.size() - sizeof(uint64_t)], 0, sizeof(uint64_t));
+    check(old->saveCheckpoint(version1SavedPath, progress) && readFile(version1SavedPath) == expected,
+          "a version 1 checkpoint restores the weights and starts the optimizer step at 0");
+
+    // The writer keeps every path it was given, and only the latest snapshot of a path
+    const std::vector<std::string> epochPaths = {"checkpoint_test_epoch0.ckpt", "checkpoint_test_epoch1.ckpt",
+                                                 "checkpoint_test_epoch2.ckpt"};
+    {
+        nn::CheckpointWriter<float> writer;
+        for (uint64_t epoch = 0; epoch < 6; ++epoch)
+        {
+            nn::Snapshot<float> snapshot;
+            nn::TrainingProgress epochProgress;
+            epochProgress.epoch = epoch;
+            snapshot.setProgress(epochProgress);
+            straight->saveState(snapshot);
+            writer.submit(std::move(snapshot), epochPaths[epoch % epochPaths.size()]);
+        }
+        check(writer.flush(), "writing snapshots in the background");
+    }
+    for (size_t ii = 0; ii < epochPaths.size(); ++ii)
+    {
+        nn::Snapshot<float> snapshot;
+        check(snapshot.load(epochPaths[ii]) && snapshot.getProgress().epoch == ii + epochPaths.size(),
+              "keeping the latest snapshot of " + epochPaths[ii]);
+    }
+
+    // Optimizer state is restored only onto weights of the shape it was saved for
+    std::vector<std::unique_ptr<nn::Optimizer<float>>> optimizers;
+    optimizers.emplace_back(new nn::StochasticGradientDescent<float>(0.1, 0.9));
+    optimizers.emplace_back(new nn::Adam<float>(0.1));
+    optimizers.emplace_back(new nn::Lamb<float>(0.1));
+    for (const auto &optimizer : optimizers)
+    {
+        Eigen::Tensor<float, 2> weights(3, 2), transposed(2, 3);
+        weights.setRandom();
+        transposed.setRandom();
+        auto impl = optimizer->createOptimizer<2>();
+        impl->update(weights, weights);
+        nn::Snapshot<float> snapshot;
+        impl->saveState(snapshot);
+        check(!impl->loadState(snapshot, transposed), "rejecting optimizer state of another shape");
+        snapshot.rewind();
+        check(impl->loadState(snapshot, weights), "restoring optimizer state of the same shape");
+    }
+
+    for (const std::string &path : {resumePath, straightPath, resumedPath, beforePath, afterPath, corruptPath,
+                                    version1Path, version1SavedPath, epochPaths[0], epochPaths[1], epochPaths[2]})
+    {
+        std::remove(path.c_str());
+    }
+
+    return test::report("Checkpoint");
+}
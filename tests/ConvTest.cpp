@@ -0,0 +1,197 @@
+#include "TestUtils.h"
+#include <cmath>
+
+/**
+ * Conv2D, MaxPool2D and AvgPool2D forward and backward against direct loops in double precision.
+ *
+ * The batch sizes take every path of the direct convolution: full tiles of BATCH_LANES entries, single packets
+ * and half packets of the tail, and the scalar entries left after them. Output channels that are not a multiple
+ * of the channel tile and windows clipped by the padding are covered as well.
+ */
+
+typedef Eigen::Tensor<double, 4> Reference;
+
+/**
+ * Largest difference between the layer and the reference, relative to the reference once it exceeds 1
+ */
+double maxError(const float *values, const Reference &reference)
+{
+    double error = 0;
+    for (Eigen::Index ii = 0; ii < reference.size(); ++ii)
+    {
+        error = std::max(error, std::abs(values[ii] - reference.data()[ii]) / std::max(1.0, std::abs(reference.data()[ii])));
+    }
+    return error;
+}
+
+/**
+ * @return The largest error of the output, input gradient, weight gradient and bias gradient
+ */
+double checkConv(int batchSize, int inChannels, int outChannels, int kernelHeight, int kernelWidth, int stride, int padding)
+{
+    const int height = 7, width = 6;
+    nn::Conv2D<float> conv(inChannels, outChannels, kernelHeight, kernelWidth, stride, padding);
+    const Eigen::Tensor<float, 4> input = test::randomTensor<float, 4>({batchSize, height, width, inChannels});
+    const Eigen::Tensor<float, 4> output = conv.forward(input);
+    const auto outputShape = conv.getOutputShape(input.dimensions());
+    const Eigen::Tensor<float, 4> grad = test::randomTensor<float, 4>(outputShape);
+    const Eigen::Tensor<float, 4> inputGrad = conv.backward(grad);
+    std::vector<nn::ParameterView<float>> parameters;
+    conv.collectParameters(parameters);
+
+    const Eigen::Tensor<float, 4> &weights = conv.getWeights();
+    const Eigen::Tensor<float, 4> &bias = conv.getBias();
+    Reference expected(outputShape), expectedInputGrad(input.dimensions()), expectedWeightsGrad(weights.dimensions());
+    Reference expectedBiasGrad(bias.dimensions());
+    expectedInputGrad.setZero();
+    expectedWeightsGrad.setZero();
+    expectedBiasGrad.setZero();
+    for (Eigen::Index n = 0; n < batchSize; ++n)
+    {
+        for (Eigen::Index oh = 0; oh < outputShape[1]; ++oh)
+        {
+            for (Eigen::Index ow = 0; ow < outputShape[2]; ++ow)
+            {
+                for (Eigen::Index oc = 0; oc < outChannels; ++oc)
+                {
+                    double sum = bias(0, 0, 0, oc);
+                    expectedBiasGrad(0, 0, 0, oc) += grad(n, oh, ow, oc);
+                    for (int kh = 0; kh < kernelHeight; ++kh)
+                    {
+                        for (int kw = 0; kw < kernelWidth; ++kw)
+                        {
+                            const Eigen::Index ih = oh * stride - padding + kh, iw = ow * stride - padding + kw;
+                            if (ih < 0 || ih >= height || iw < 0 || iw >= width)
+                            {
+                                continue;
+                            }
+                            for (Eigen::Index ic = 0; ic < inChannels; ++ic)
+                            {
+                                sum += double(input(n, ih, iw, ic)) * weights(kh, kw, ic, oc);
+                                expectedInputGrad(n, ih, iw, ic) += double(grad(n, oh, ow, oc)) * weights(kh, kw, ic, oc);
+                                expectedWeightsGrad(kh, kw, ic, oc) += double(grad(n, oh, ow, oc)) * input(n, ih, iw, ic);
+                            }
+                        }
+                    }
+                    expected(n, oh, ow, oc) = sum;
+                }
+            }
+        }
+    }
+
+    return std::max(std::max(maxError(output.data(), expected), maxError(inputGrad.data(), expectedInputGrad)),
+                    std::max(maxError(parameters[0].gradient, expectedWeightsGrad),
+                             maxError(parameters[1].gradient, expectedBiasGrad)));
+}
+
+/**
+ * @return The largest error of the output and input gradient of MaxPool2D, or of AvgPool2D if average is set
+ */
+template <typename Pool>
+double checkPool(int poolHeight, int poolWidth, int stride, bool average)
+{
+    const int batchSize = 13, height = 7, width = 8, channels = 3;
+    Pool pool(poolHeight, poolWidth, stride);
+    const int strideHeight = stride > 0 ? stride : poolHeight, strideWidth = stride > 0 ? stride : poolWidth;
+    const Eigen::Tensor<float, 4> input = test::randomTensor<float, 4>({batchSize, height, width, channels});
+    const Eigen::Tensor<float, 4> output = pool.forward(input);
+    const Eigen::Tensor<float, 4> grad = test::randomTensor<float, 4>(output.dimensions());
+    const Eigen::Tensor<float, 4> inputGrad = pool.backward(grad);
+
+    Reference expected(output.dimensions()), expectedInputGrad(input.dimensions());
+    expectedInputGrad.setZero();
+    for (Eigen::Index n = 0; n < batchSize; ++n)
+    {
+        for (Eigen::Index oh = 0; oh < output.dimension(1); ++oh)
+        {
+            for (Eigen::Index ow = 0; ow < output.dimension(2); ++ow)
+            {
+                for (Eigen::Index c = 0; c < channels; ++c)
+                {
+                    // Random values have no ties, so the maximum of every window is unique
+                    double sum = 0, maximum = -INFINITY;
+                    Eigen::Index maxH = 0, maxW = 0;
+                    for (int kh = 0; kh < poolHeight; ++kh)
+                    {
+                        for (int kw = 0; kw < poolWidth; ++kw)
+                        {
+                            const Eigen::Index ih = oh * strideHeight + kh, iw = ow * strideWidth + kw;
+                            sum += input(n, ih, iw, c);
+                            expectedInputGrad(n, ih, iw, c) += average ? double(grad(n, oh, ow, c)) / (poolHeight * poolWidth) : 0;
+                            if (input(n, ih, iw, c) > maximum)
+                            {
+                                maximum = input(n, ih, iw, c);
+                                maxH = ih;
+                                maxW = iw;
+                            }
+                        }
+                    }
+                    expected(n, oh, ow, c) = average ? sum / (poolHeight * poolWidth) : maximum;
+                    if (!average)
+                    {
+                        expectedInputGrad(n, maxH, maxW, c) += grad(n, oh, ow, c);
+                    }
+                }
+            }
+        }
+    }
+    return std::max(maxError(output.data(), expected), maxError(inputGrad.data(), expectedInputGrad));
+}
+
+int main()
+{
+    const double tolerance = 1e-4;
+    auto check = [&](double error, const std::string &message)
+    {
+        test::checkError(error, tolerance, message);
+    };
+
+    // 45 = 32 + 8 + 4 + 1 and 19 = 16 + 3 reach every tail path from 4 up to 16 floats per packet
+    for (int batchSize : {1, 3, 13, 19, 45, 64})
+    {
+        for (int stride : {1, 2})
+        {
+            for (int padding : {0, 1})
+            {
+                check(checkConv(batchSize, 3, 6, 3, 3, stride, padding),
+                      "Conv2D 3x3 batch " + std::to_string(batchSize) + " stride " + std::to_string(stride) +
+                          " padding " + std::to_string(padding));
+            }
+        }
+        check(checkConv(batchSize, 2, 5, 2, 3, 1, 1), "Conv2D 2x3 batch " + std::to_string(batchSize));
+    }
+
+    // The same kernels spread over the thread pool
+    nn::setNumThreads(3);
+    check(checkConv(45, 3, 20, 3, 3, 1, 1), "Conv2D on 3 threads");
+    check(checkPool<nn::MaxPool2D<float>>(2, 2, 0, false), "MaxPool2D on 3 threads");
+    nn::setNumThreads(1);
+
+    for (int stride : {0, 1, 2})
+    {
+        check(checkPool<nn::MaxPool2D<float>>(2, 3, stride, false), "MaxPool2D 2x3 stride " + std::to_string(stride));
+        check(checkPool<nn::AvgPool2D<float>>(2, 3, stride, true), "AvgPool2D 2x3 stride " + std::to_string(stride));
+    }
+    check(checkPool<nn::MaxPool2D<float>>(3, 3, 2, false), "MaxPool2D 3x3 overlapping windows");
+
+    // Forward reuses its packed kernel until step or loadState change the weights
+    const Eigen::Tensor<float, 4> input = test::randomTensor<float, 4>({5, 7, 6, 3});
+    nn::Conv2D<float> trained(3, 6, 3, 3), other(3, 6, 3, 3), copy(3, 6, 3, 3);
+    trained.registerOptimizer(std::make_shared<nn::StochasticGradientDescent<float>>(0.5));
+    const Eigen::Tensor<float, 4> before = trained.forward(input);
+    trained.backward(test::randomTensor<float, 4>(before.dimensions()));
+    trained.step();
+    nn::Snapshot<float> trainedState, otherState;
+    trained.saveState(trainedState);
+    other.saveState(otherState);
+    copy.registerOptimizer(std::make_shared<nn::StochasticGradientDescent<float>>(0.5));
+    copy.forward(input);
+    test::check(copy.loadState(trainedState), "restoring a trained Conv2D");
+    const Eigen::Tensor<float, 0> stepError = (trained.forward(input) - copy.forward(input)).abs().maximum();
+    check(stepError(), "forward after step and after loadState uses the new weights");
+    test::check(trained.loadState(otherState), "restoring an untrained Conv2D");
+    const Eigen::Tensor<float, 0> loadError = (trained.forward(input) - other.forward(input)).abs().maximum();
+    check(loadError(), "forward after loadState uses the restored weights");
+
+    return test::report("Convolution");
+}
@@ -0,0 +1,157 @@
+#include "TestUtils.h"
+#include "../src/loss/CrossEntropy.h"
+#include <chrono>
+#include <sys/wait.h>
+
+/**
+ * Ranks that train data-parallel on shards of a batch end with the weights of a single process trained on the
+ * whole batch, over shared memory and over loopback TCP. A rank that stops mid-training breaks the group for the
+ * others as soon as its links close, and their backward then fails at once on every later step. Shared memory
+ * segments do not outlive a link that failed to set up.
+ */
+
+const int WORLD_SIZE = 3, SHARD_SIZE = 4, NUM_FEATURES = 6, NUM_HIDDEN = 10, NUM_CLASSES = 3, NUM_STEPS = 3;
+const float TOLERANCE = 1e-5f;
+
+std::unique_ptr<nn::Net<float>> makeNet(int batchSize)
+{
+    return test::makeDenseNet(batchSize, NUM_FEATURES, NUM_HIDDEN, NUM_CLASSES, new nn::StochasticGradientDescent<float>(0.5));
+}
+
+/**
+ * Run function(rank) in WORLD_SIZE forked processes and wait for all of them
+ */
+template <typename Function>
+bool runRanks(Function function)
+{
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < WORLD_SIZE; ++rank)
+    {
+        const pid_t child = fork();
+        if (child == 0)
+        {
+            _exit(function(rank));
+        }
+        children.push_back(child);
+    }
+
+    bool succeeded = true;
+    for (pid_t child : children)
+    {
+        int status;
+        waitpid(child, &status, 0);
+        succeeded = succeeded && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return succeeded;
+}
+
+int main()
+{
+    const int batchSize = WORLD_SIZE * SHARD_SIZE;
+    Eigen::Tensor<float, 2> input(batchSize, NUM_FEATURES);
+    input.setRandom();
+    const Eigen::Tensor<float, 2> labels = test::oneHotLabels(batchSize, NUM_CLASSES);
+
+    // Every network starts from the same weights
+    nn::Snapshot<float> initial;
+    makeNet(batchSize)->saveState(initial);
+
+    // The single process reference trains on the whole batch
+    nn::CrossEntropyLoss<float, 2> lossFunc;
+    auto reference = makeNet(batchSize);
+    reference->loadState(initial);
+    for (int step = 0; step < NUM_STEPS; ++step)
+    {
+        auto result = reference->forward<2, 2>(input);
+        reference->backward(lossFunc.backward(result, labels));
+        reference->step();
+    }
+    const Eigen::Tensor<float, 2> expected = reference->forward<2, 2>(input);
+
+    // A segment nobody attached to is removed with the channel that created it
+    const std::string segment = "/cpp-nn-test-" + std::to_string(getpid());
+    delete nn::SharedMemoryChannel::create(segment);
+    const int leftover = shm_open(segment.c_str(), O_RDWR, 0);
+    test::check(leftover < 0, "removing a shared memory segment nobody attached to");
+    if (leftover >= 0)
+    {
+        close(leftover);
+        shm_unlink(segment.c_str());
+    }
+
+    int port = 31500 + (getpid() % 1000) * 2 * WORLD_SIZE;
+    for (bool useSharedMemory : {true, false})
+    {
+        const std::string transport = useSharedMemory ? "shared memory" : "TCP";
+        const bool succeeded = runRanks([&](int rank)
+                                        {
+            auto net = makeNet(SHARD_SIZE);
+            net->loadState(initial);
+
+            // Small buckets, so the gradients of every layer are reduced in several of them
+            auto group = std::make_shared<nn::ProcessGroup>(rank, WORLD_SIZE, port, std::vector<std::string>(), useSharedMemory);
+            if (!group->connect(std::chrono::milliseconds(10000)) ||
+                !net->setDataParallel(new nn::DataParallel<float>(group, 64)))
+            {
+                std::cerr << "FAILED: rank " << rank << " could not join the group over " << transport << std::endl;
+                return 1;
+            }
+
+            const Eigen::array<Eigen::Index, 2> offsets = {rank * SHARD_SIZE, 0};
+            const Eigen::Tensor<float, 2> shard = input.slice(offsets, Eigen::array<Eigen::Index, 2>{SHARD_SIZE, NUM_FEATURES});
+            const Eigen::Tensor<float, 2> shardLabels = labels.slice(offsets, Eigen::array<Eigen::Index, 2>{SHARD_SIZE, NUM_CLASSES});
+            for (int step = 0; step < NUM_STEPS; ++step)
+            {
+                auto result = net->forward<2, 2>(shard);
+                if (!net->backward(lossFunc.backward(result, shardLabels)))
+                {
+                    std::cerr << "FAILED: rank " << rank << " backward over " << transport << std::endl;
+                    return 1;
+                }
+                net->step();
+            }
+
+            const Eigen::Tensor<float, 0> maxDiff = (net->forward<2, 2>(input) - expected).abs().maximum();
+            if (maxDiff() > TOLERANCE)
+            {
+                std::cerr << "FAILED: rank " << rank << " over " << transport << " differs from the single process run by "
+                          << maxDiff() << std::endl;
+                return 1;
+            }
+
+            // The last rank leaves, the others notice its closed links long before the timeout, fail to reduce
+            // and keep failing without waiting on the ring again
+            if (rank == WORLD_SIZE - 1)
+            {
+                return 0;
+            }
+            const std::chrono::milliseconds timeout(30000), failFast(5000);
+            group->setTimeout(timeout);
+            auto result = net->forward<2, 2>(shard);
+            auto start = std::chrono::steady_clock::now();
+            if (net->backward(lossFunc.backward(result, shardLabels)) || !group->isBroken())
+            {
+                std::cerr << "FAILED: rank " << rank << " reduced without the last rank over " << transport << std::endl;
+                return 1;
+            }
+            if (std::chrono::steady_clock::now() - start >= failFast)
+            {
+                std::cerr << "FAILED: rank " << rank << " waited for the timeout to notice the last rank leaving over "
+                          << transport << std::endl;
+                return 1;
+            }
+            start = std::chrono::steady_clock::now();
+            const bool retried = net->backward(lossFunc.backward(result, shardLabels));
+            if (retried || std::chrono::steady_clock::now() - start >= failFast)
+            {
+                std::cerr << "FAILED: rank " << rank << " did not fail fast on a broken group over " << transport << std::endl;
+                return 1;
+            }
+            return 0; });
+
+        test::check(succeeded, "training data-parallel over " + transport);
+        port += WORLD_SIZE;
+    }
+
+    return test::report("Data-parallel");
+}
@@ -0,0 +1,130 @@
+#include "TestUtils.h"
+#include <cmath>
+
+/**
+ * Analytic gradients against central finite differences in double precision. The loss is sum(output * weights)
+ * for a fixed random weights tensor, so backward of those weights gives the gradient of the loss with respect to
+ * the input and to every parameter the layer exposes through collectParameters.
+ *
+ * Covered are the normalization layers and the recurrent layers, whose parameters include the recurrent
+ * weights and biases that only backpropagation through time reaches.
+ */
+
+const double STEP = 1e-6;
+
+/**
+ * Largest difference between the analytic and numeric gradient, relative to the numeric one once it exceeds 1
+ */
+double gradientError(double analytic, double numeric)
+{
+    return std::abs(analytic - numeric) / std::max(1.0, std::abs(numeric));
+}
+
+/**
+ * @param checkParameters Whether to check the parameter gradients too, which are only computed in training
+ * @return The largest error of the input gradient and, if requested, of the parameter gradients
+ */
+template <typename Layer, int Dims>
+double checkGradients(Layer &layer, Eigen::Tensor<double, Dims> input, bool checkParameters = true)
+{
+    const Eigen::Tensor<double, Dims> output = layer.forward(input);
+    const Eigen::Tensor<double, Dims> lossWeights = test::randomTensor<double, Dims>(output.dimensions());
+    const Eigen::Tensor<double, Dims> inputGrad = layer.backward(lossWeights);
+    std::vector<nn::ParameterView<double>> parameters;
+    layer.collectParameters(parameters);
+    std::vector<std::vector<double>> parameterGrads;
+    for (const auto &parameter : parameters)
+    {
+        parameterGrads.emplace_back(parameter.gradient, parameter.gradient + parameter.size);
+    }
+
+    auto loss = [&]()
+    {
+        const Eigen::Tensor<double, 0> sum = (layer.forward(input) * lossWeights).sum();
+        return sum();
+    };
+    auto numericGradient = [&](double &value)
+    {
+        const double original = value;
+        value = original + STEP;
+        const double above = loss();
+        value = original - STEP;
+        const double below = loss();
+        value = original;
+        return (above - below) / (2 * STEP);
+    };
+
+    double error = 0;
+    for (Eigen::Index ii = 0; ii < input.size(); ++ii)
+    {
+        error = std::max(error, gradientError(inputGrad.data()[ii], numericGradient(input.data()[ii])));
+    }
+    for (size_t pp = 0; checkParameters && pp < parameters.size(); ++pp)
+    {
+        for (Eigen::Index ii = 0; ii < parameters[pp].size; ++ii)
+        {
+            error = std::max(error, gradientError(parameterGrads[pp][ii], numericGradient(parameters[pp].weights[ii])));
+        }
+    }
+    return error;
+}
+
+/**
+ * Replace every parameter of the layer by random values, so no gradient vanishes by a zero bias or unit scale
+ */
+template <typename Layer>
+void randomizeParameters(Layer &layer)
+{
+    std::vector<nn::ParameterView<double>> parameters;
+    layer.collectParameters(parameters);
+    for (const auto &parameter : parameters)
+    {
+        const Eigen::Tensor<double, 1> values = test::randomTensor<double, 1>({parameter.size});
+        std::copy(values.data(), values.data() + parameter.size, parameter.weights);
+    }
+}
+
+int main()
+{
+    const double tolerance = 1e-6;
+    auto check = [&](double error, const std::string &message)
+    {
+        test::checkError(error, tolerance, message);
+    };
+
+    const int batchSize = 7, numFeatures = 5;
+    const Eigen::array<Eigen::Index, 2> shape = {batchSize, numFeatures};
+
+    // BatchNorm normalizes with the batch statistics in training, whose shifted sums have to hold for a mean far
+    // from zero, and with the running ones in inference
+    nn::BatchNorm<double> batchNorm(numFeatures);
+    randomizeParameters(batchNorm);
+    check(checkGradients(batchNorm, test::randomTensor<double, 2>(shape)), "BatchNorm in training");
+    Eigen::Tensor<double, 2> shifted = test::randomTensor<double, 2>(shape);
+    shifted += shifted.constant(50);
+    check(checkGradients(batchNorm, shifted), "BatchNorm in training with a large mean");
+    batchNorm.setTraining(false);
+    check(checkGradients(batchNorm, test::randomTensor<double, 2>(shape), false), "BatchNorm in inference");
+
+    // LayerNorm shifts every row by its first feature, a mean far from zero takes that path
+    nn::LayerNorm<double> layerNorm(numFeatures);
+    randomizeParameters(layerNorm);
+    check(checkGradients(layerNorm, test::randomTensor<double, 2>(shape)), "LayerNorm");
+    check(checkGradients(layerNorm, shifted), "LayerNorm with a large mean");
+
+    // The recurrent layers backpropagate through time, from every timestep or from the last one only
+    const int timeSteps = 5, inputSize = 4, hiddenSize = 3;
+    const Eigen::array<Eigen::Index, 3> sequenceShape = {batchSize, timeSteps, inputSize};
+    for (bool returnSequences : {true, false})
+    {
+        const std::string outputs = returnSequences ? " returning sequences" : " returning the last step";
+        nn::LSTM<double> lstm(inputSize, hiddenSize, returnSequences);
+        randomizeParameters(lstm);
+        check(checkGradients(lstm, test::randomTensor<double, 3>(sequenceShape)), "LSTM" + outputs);
+        nn::GRU<double> gru(inputSize, hiddenSize, returnSequences);
+        randomizeParameters(gru);
+        check(checkGradients(gru, test::randomTensor<double, 3>(sequenceShape)), "GRU" + outputs);
+    }
+
+    return test::report("Gradient");
+}
@@ -0,0 +1,110 @@
+#include "TestUtils.h"
+
+/**
+ * Layers that pass their input through in inference: backward follows what the last forward did, even if the
+ * layer switched between training and inference in between, and no buffer is copied. BatchNorm folds, or
+ * restores a folded snapshot, only in inference and keeps the network there.
+ */
+
+using test::check;
+
+const int BATCH_SIZE = 6, NUM_FEATURES = 5;
+
+nn::Activation<float> makeActivation(bool random)
+{
+    Eigen::Tensor<float, 2> tensor(BATCH_SIZE, NUM_FEATURES);
+    if (random)
+    {
+        tensor.setRandom();
+    }
+    else
+    {
+        tensor.setConstant(1);
+    }
+    return nn::Activation<float>(std::move(tensor));
+}
+
+bool equal(const nn::Activation<float> &first, const nn::Activation<float> &second)
+{
+    return first.size() == second.size() && std::equal(first.data(), first.data() + first.size(), second.data());
+}
+
+int main()
+{
+    // Dropout masks the gradient of a masked forward, even when switched to inference before backward
+    nn::Dropout<float> dropout(0.5, 42);
+    const auto input = makeActivation(true);
+    const auto ones = makeActivation(false);
+    const auto masked = dropout.forwardActivation(input);
+    check(!equal(masked, input), "masking the input in training");
+    dropout.setTraining(false);
+    const auto maskedGrad = dropout.backwardActivation(ones);
+    bool sameMask = true;
+    for (Eigen::Index ii = 0; ii < input.size(); ++ii)
+    {
+        sameMask = sameMask && ((masked.data()[ii] == 0) == (maskedGrad.data()[ii] == 0));
+    }
+    check(sameMask, "backward after switching to inference applies the mask of forward");
+
+    // An inference forward passes through, and so does its backward after switching back to training
+    const auto passed = dropout.forwardActivation(input);
+    check(passed.data() == input.data(), "inference forward hands on the input buffer");
+    check(dropout.memoryUsage().temporaryBytes == 0, "inference forward materializes nothing");
+    dropout.setTraining(true);
+    const auto passedGrad = dropout.backwardActivation(ones);
+    check(passedGrad.data() == ones.data(), "backward after switching to training passes the gradient through");
+
+    // BatchNorm folds only in inference, into a Dense layer that computes what both computed before, and a
+    // folded network stays in inference
+    nn::Net<float> net;
+    auto batchNorm = new nn::BatchNorm<>(NUM_FEATURES);
+    net.add(new nn::Dense<>(BATCH_SIZE, NUM_FEATURES, NUM_FEATURES, true));
+    net.add(batchNorm);
+    check(net.foldBatchNorm() == -1, "refusing to fold BatchNorm in training mode");
+
+    // Random scales and shifts, and running statistics moved away from zero mean and unit variance by training
+    std::vector<nn::ParameterView<float>> parameters;
+    batchNorm->collectParameters(parameters);
+    for (const auto &parameter : parameters)
+    {
+        const Eigen::Tensor<float, 1> values = test::randomTensor<float, 1>({parameter.size});
+        std::copy(values.data(), values.data() + parameter.size, parameter.weights);
+    }
+    for (int ii = 0; ii < 5; ++ii)
+    {
+        const Eigen::Tensor<float, 2> batch = test::randomTensor<float, 2>({BATCH_SIZE, NUM_FEATURES});
+        net.forward<2, 2>(Eigen::Tensor<float, 2>(batch * batch.constant(3) + batch.constant(2)));
+    }
+
+    const Eigen::Tensor<float, 2> inferenceInput = test::randomTensor<float, 2>({BATCH_SIZE, NUM_FEATURES});
+    check(net.setTraining(false), "switching to inference");
+    const Eigen::Tensor<float, 2> unfolded = net.forward<2, 2>(inferenceInput);
+    check(net.foldBatchNorm() == 1, "folding BatchNorm in inference mode");
+    const nn::MemoryReport foldedMemory = net.memoryReport();
+    check(foldedMemory.layers[1].activationBytes == 0 && foldedMemory.layers[1].temporaryBytes == 0,
+          "a folded BatchNorm releases the caches of its last training batch");
+    const Eigen::Tensor<float, 0> foldError = (net.forward<2, 2>(inferenceInput) - unfolded).abs().maximum();
+    test::checkError(foldError(), 1e-5, "folded Dense output matches Dense and BatchNorm");
+    check(!net.setTraining(true), "refusing to train a network with folded BatchNorm");
+    check(net.foldBatchNorm() == 0, "folding every BatchNorm once");
+
+    // A Dense layer without a bias keeps its parameters, and its BatchNorm stays unfolded
+    nn::Net<float> unbiased;
+    unbiased.add(new nn::Dense<>(BATCH_SIZE, NUM_FEATURES, NUM_FEATURES, false));
+    unbiased.add(new nn::BatchNorm<>(NUM_FEATURES));
+    check(unbiased.setTraining(false) && unbiased.foldBatchNorm() == 0 && unbiased.setTraining(true),
+          "not folding BatchNorm into a Dense layer without a bias");
+
+    // A folded snapshot restores only into a network in inference, which then stays there
+    nn::Snapshot<float> folded;
+    net.saveState(folded);
+    nn::Net<float> restored;
+    restored.add(new nn::Dense<>(BATCH_SIZE, NUM_FEATURES, NUM_FEATURES, true));
+    restored.add(new nn::BatchNorm<>(NUM_FEATURES));
+    check(!restored.loadState(folded) && restored.setTraining(true),
+          "refusing to restore a folded BatchNorm into a network in training");
+    check(restored.setTraining(false) && restored.loadState(folded), "restoring a folded BatchNorm in inference");
+    check(!restored.setTraining(true) && restored.foldBatchNorm() == 0, "keeping a restored folded network in inference");
+
+    return test::report("Layer");
+}
@@ -0,0 +1,183 @@
+#include "TestUtils.h"
+#include "../src/loss/CrossEntropy.h"
+
+#ifdef __GLIBC__
+#include <atomic>
+#include <cerrno>
+#include <malloc.h>
+#endif
+
+/**
+ * Memory reports work before the first forward, when layers have not seen an input yet, peak estimation works
+ * from the first forward on, and the memory predicted for a batch before training is the memory training uses.
+ * The estimated peak is checked against the bytes a training step really allocates, where glibc lets the test count
+ * them.
+ */
+
+using test::check;
+
+#ifdef __GLIBC__
+/**
+ * Count the bytes the test allocates with the C allocator, which Eigen and operator new both go through, by
+ * wrapping glibc's own functions. Sizes are the usable sizes of the blocks, so what is freed matches what was added.
+ */
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void *__libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void *ptr);
+}
+
+namespace
+{
+    std::atomic<size_t> liveBytes(0), peakBytes(0);
+
+    void *counted(void *ptr)
+    {
+        if (ptr)
+        {
+            const size_t live = liveBytes += malloc_usable_size(ptr);
+            size_t peak = peakBytes.load();
+            while (live > peak && !peakBytes.compare_exchange_weak(peak, live))
+            {
+            }
+        }
+        return ptr;
+    }
+}
+
+extern "C"
+{
+    void *malloc(size_t size)
+    {
+        return counted(__libc_malloc(size));
+    }
+
+    void *calloc(size_t count, size_t size)
+    {
+        return counted(__libc_calloc(count, size));
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        const size_t oldBytes = ptr ? malloc_usable_size(ptr) : 0;
+        void *resized = __libc_realloc(ptr, size);
+        if (!resized && size > 0)
+        {
+            return nullptr; // The old block is still allocated
+        }
+        liveBytes -= oldBytes;
+        return counted(resized);
+    }
+
+    void *memalign(size_t alignment, size_t size)
+    {
+        return counted(__libc_memalign(alignment, size));
+    }
+
+    void *aligned_alloc(size_t alignment, size_t size)
+    {
+        return counted(__libc_memalign(alignment, size));
+    }
+
+    int posix_memalign(void **ptr, size_t alignment, size_t size)
+    {
+        void *allocated = counted(__libc_memalign(alignment, size));
+        if (!allocated)
+        {
+            return ENOMEM;
+        }
+        *ptr = allocated;
+        return 0;
+    }
+
+    void free(void *ptr)
+    {
+        if (ptr)
+        {
+            liveBytes -= malloc_usable_size(ptr);
+        }
+        __libc_free(ptr);
+    }
+}
+#endif
+
+const int BATCH_SIZE = 5, HEIGHT = 8, WIDTH = 8, CHANNELS = 2, NUM_FILTERS = 4, NUM_CLASSES = 3;
+
+int main()
+{
+    Eigen::Tensor<float, 4> input(BATCH_SIZE, HEIGHT, WIDTH, CHANNELS);
+    input.setRandom();
+    const Eigen::Tensor<float, 2> labels = test::oneHotLabels(BATCH_SIZE, NUM_CLASSES);
+
+    // A fresh network holds its weights and gradients, and nothing for activations it has not computed yet
+    auto fresh = test::makeConvNet(BATCH_SIZE, CHANNELS, NUM_FILTERS, NUM_CLASSES);
+    const nn::MemoryReport before = fresh->memoryReport();
+    check(before.total.parameterBytes > 0 && before.total.activationBytes == 0 && before.total.temporaryBytes == 0,
+          "reporting the memory of a network before its first forward");
+
+    // Peak estimation asks every layer for its memory before the first one has run
+    auto tracked = test::makeConvNet(BATCH_SIZE, CHANNELS, NUM_FILTERS, NUM_CLASSES);
+    tracked->setPeakEstimation(true);
+    nn::CrossEntropyLoss<float, 2> lossFunc;
+    auto result = tracked->forward<4, 2>(input);
+    tracked->backward(lossFunc.backward(result, labels));
+    const nn::MemoryReport after = tracked->memoryReport();
+    check(after.total.activationBytes > 0, "reporting the activations cached by forward");
+    check(after.estimatedPeakBytes >= after.total.persistentBytes(), "estimating the peak from the first forward on");
+
+    // The prediction for the batch shape matches, layer by layer, what a training step holds and its peak.
+    // Adam allocates its moments in the first step, so the peak of a step with them is reached in the second.
+    auto predicted = test::makeConvNet(BATCH_SIZE, CHANNELS, NUM_FILTERS, NUM_CLASSES);
+    const nn::MemoryReport prediction = predicted->predictMemoryUsage({BATCH_SIZE, HEIGHT, WIDTH, CHANNELS});
+    predicted->setPeakEstimation(true);
+    for (int step = 0; step < 2; ++step)
+    {
+        result = predicted->forward<4, 2>(input);
+        predicted->backward(lossFunc.backward(result, labels));
+        predicted->step();
+    }
+    const nn::MemoryReport measured = predicted->memoryReport();
+    check(prediction.layers.size() == measured.layers.size(), "predicting the memory of every layer");
+    for (size_t ii = 0; ii < std::min(prediction.layers.size(), measured.layers.size()); ++ii)
+    {
+        const nn::MemoryUsage &expected = prediction.layers[ii], &actual = measured.layers[ii];
+        const std::string layer = measured.layerNames[ii] + " " + std::to_string(ii);
+        check(expected.parameterBytes == actual.parameterBytes && expected.gradientBytes == actual.gradientBytes,
+              "predicting the weights and gradients of " + layer);
+        check(expected.optimizerStateBytes == actual.optimizerStateBytes, "predicting the optimizer state of " + layer);
+        check(expected.activationBytes == actual.activationBytes, "predicting the activations of " + layer);
+        check(expected.temporaryBytes == actual.temporaryBytes, "predicting the temporaries of " + layer);
+    }
+    check(prediction.estimatedPeakBytes == measured.estimatedPeakBytes,
+          "predicting the peak of a training step, " + std::to_string(prediction.estimatedPeakBytes) +
+              " bytes predicted and " + std::to_string(measured.estimatedPeakBytes) + " measured");
+
+#ifdef __GLIBC__
+    // The estimate against the bytes actually allocated during a training step, counting the network from its
+    // construction on. The estimate leaves out the temporaries inside layer calls and the small allocations around
+    // them, so the step allocates at least the estimate and, for this network, at most half as much again.
+    const size_t baseline = liveBytes;
+    auto counted = test::makeConvNet(BATCH_SIZE, CHANNELS, NUM_FILTERS, NUM_CLASSES);
+    counted->setPeakEstimation(true);
+    for (int step = 0; step < 2; ++step)
+    {
+        if (step == 1)
+        {
+            counted->resetPeakEstimate();
+            peakBytes = liveBytes.load();
+        }
+        auto output = counted->forward<4, 2>(input);
+        counted->backward(lossFunc.backward(output, labels));
+        counted->step();
+    }
+    const size_t estimated = counted->memoryReport().estimatedPeakBytes, allocated = peakBytes - baseline;
+    const std::string bytes = std::to_string(estimated) + " bytes estimated and " + std::to_string(allocated) + " allocated";
+    check(allocated >= estimated, "allocating at least the estimated peak of a training step, " + bytes);
+    check(allocated <= estimated + estimated / 2, "allocating at most 50% more than the estimated peak, " + bytes);
+#endif
+
+    return test::report("Memory");
+}
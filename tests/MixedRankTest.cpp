@@ -0,0 +1,78 @@
+#include "TestUtils.h"
+
+/**
+ * Flatten and Reshape change only the shape of the activation handle: forward and backward keep the buffer of
+ * their input and map every element to the position column-major storage gives it. A network chaining layers
+ * of different ranks computes what calling its layers one after the other does.
+ */
+
+using test::check;
+
+const int BATCH_SIZE = 3, HEIGHT = 6, WIDTH = 6, CHANNELS = 2, NUM_FILTERS = 3, NUM_CLASSES = 4;
+
+int main()
+{
+    const Eigen::Tensor<float, 4> input = test::randomTensor<float, 4>({BATCH_SIZE, HEIGHT, WIDTH, CHANNELS});
+    const Eigen::Index numFeatures = HEIGHT * WIDTH * CHANNELS;
+
+    // Flatten to (batchSize, features) and Reshape back to (batchSize, height, width, channels)
+    nn::Flatten<float> flatten;
+    nn::Reshape<float> reshape({HEIGHT, WIDTH, CHANNELS});
+    const nn::Activation<float> activation{Eigen::Tensor<float, 4>(input)};
+    const nn::Activation<float> flat = flatten.forwardActivation(activation);
+    check(flat.shape() == std::vector<Eigen::Index>({BATCH_SIZE, numFeatures}), "flattening to the batch and features");
+    check(flat.data() == activation.data(), "flattening shares the buffer of the input");
+    const auto flatView = flat.view<2>();
+    bool sameValues = true;
+    for (Eigen::Index n = 0; n < BATCH_SIZE; ++n)
+    {
+        for (Eigen::Index h = 0; h < HEIGHT; ++h)
+        {
+            for (Eigen::Index w = 0; w < WIDTH; ++w)
+            {
+                for (Eigen::Index c = 0; c < CHANNELS; ++c)
+                {
+                    sameValues = sameValues && flatView(n, h + HEIGHT * (w + WIDTH * c)) == input(n, h, w, c);
+                }
+            }
+        }
+    }
+    check(sameValues, "flattening keeps every sample in its row");
+
+    const nn::Activation<float> reshaped = reshape.forwardActivation(flat);
+    check(reshaped.shape() == activation.shape(), "reshaping back to the input shape");
+    check(reshaped.data() == activation.data(), "reshaping shares the buffer of the input");
+    const Eigen::Tensor<bool, 0> roundTrip = (reshaped.view<4>() == input).all();
+    check(roundTrip(), "flattening and reshaping back keeps every value in place");
+
+    // Backward hands the gradient on with the shape of the forward input
+    const nn::Activation<float> grad{test::randomTensor<float, 4>({BATCH_SIZE, HEIGHT, WIDTH, CHANNELS})};
+    const nn::Activation<float> reshapeGrad = reshape.backwardActivation(grad);
+    check(reshapeGrad.shape() == flat.shape() && reshapeGrad.data() == grad.data(),
+          "Reshape backward restores the flat shape in the same buffer");
+    const nn::Activation<float> flattenGrad = flatten.backwardActivation(reshapeGrad);
+    check(flattenGrad.shape() == activation.shape() && flattenGrad.data() == grad.data(),
+          "Flatten backward restores the input shape in the same buffer");
+    const Eigen::Tensor<bool, 0> sameGrad = (flattenGrad.view<4>() == grad.view<4>()).all();
+    check(sameGrad(), "the gradient round trip keeps every value in place");
+
+    // Conv2D, MaxPool2D, Flatten and Dense through nn::Net against the same layers called one by one
+    auto conv = new nn::Conv2D<>(CHANNELS, NUM_FILTERS, 3, 3, /*stride*/ 1, /*padding*/ 1);
+    auto pool = new nn::MaxPool2D<>(2, 2);
+    auto dense = new nn::Dense<>(BATCH_SIZE, NUM_FILTERS * (HEIGHT / 2) * (WIDTH / 2), NUM_CLASSES, true);
+    nn::Net<float> net;
+    net.add(conv);
+    net.add(pool);
+    net.add(new nn::Flatten<>());
+    net.add(dense);
+
+    const Eigen::Tensor<float, 4> pooled = pool->forward(conv->forward(input));
+    const Eigen::Tensor<float, 2> flattened = pooled.reshape(Eigen::array<Eigen::Index, 2>{BATCH_SIZE, pooled.size() / BATCH_SIZE});
+    const Eigen::Tensor<float, 2> expected = dense->forward(flattened);
+    const Eigen::Tensor<float, 2> output = net.forward<4, 2>(input);
+    const Eigen::Tensor<float, 0> maxDiff = (output - expected).abs().maximum();
+    check(output.dimensions() == expected.dimensions(), "chaining layers of different ranks keeps the output shape");
+    test::checkError(maxDiff(), 1e-6, "chaining layers of different ranks computes what the layers compute one by one");
+
+    return test::report("Mixed-rank");
+}
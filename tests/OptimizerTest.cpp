@@ -0,0 +1,175 @@
+#include "TestUtils.h"
+#include <cmath>
+
+/**
+ * The update rules against their textbook form, written out per element over several steps with a fresh
+ * gradient every step, and the learning rate schedules against values worked out by hand.
+ */
+
+const int NUM_STEPS = 6;
+const Eigen::array<Eigen::Index, 2> SHAPE = {4, 3};
+
+/**
+ * State of the reference update rules, one entry per weight
+ */
+struct Reference
+{
+    std::vector<double> weights, firstMoment, secondMoment, velocity;
+};
+
+/**
+ * Run the optimizer for NUM_STEPS steps next to the reference update, which gets the step counted from 1 and the
+ * learning rate of that step. decayWeights is passed on to createOptimizer.
+ *
+ * @return The largest difference between the weights of the optimizer and the reference
+ */
+template <typename Update>
+double checkUpdates(nn::Optimizer<double> &optimizer, Update referenceUpdate, bool decayWeights = true)
+{
+    Eigen::Tensor<double, 2> weights(SHAPE), grad(SHAPE);
+    weights.setRandom();
+    Reference reference;
+    reference.weights.assign(weights.data(), weights.data() + weights.size());
+    reference.firstMoment.assign(weights.size(), 0);
+    reference.secondMoment.assign(weights.size(), 0);
+    reference.velocity.assign(weights.size(), 0);
+
+    auto impl = optimizer.createOptimizer<2>(decayWeights);
+    for (int step = 1; step <= NUM_STEPS; ++step)
+    {
+        grad.setRandom();
+        grad = grad - grad.constant(0.5);
+        const double learningRate = optimizer.getLearningRate();
+        impl->update(weights, grad);
+        optimizer.advance();
+        referenceUpdate(reference, std::vector<double>(grad.data(), grad.data() + grad.size()), step, learningRate);
+    }
+
+    double error = 0;
+    for (Eigen::Index ii = 0; ii < weights.size(); ++ii)
+    {
+        error = std::max(error, std::abs(weights.data()[ii] - reference.weights[ii]));
+    }
+    return error;
+}
+
+/**
+ * The Adam direction of one weight after updating its moments, without weight decay
+ */
+double adamDirection(Reference &reference, size_t ii, double grad, int step, double beta1, double beta2, double epsilon)
+{
+    reference.firstMoment[ii] = beta1 * reference.firstMoment[ii] + (1 - beta1) * grad;
+    reference.secondMoment[ii] = beta2 * reference.secondMoment[ii] + (1 - beta2) * grad * grad;
+    const double firstUnbiased = reference.firstMoment[ii] / (1 - std::pow(beta1, step));
+    const double secondUnbiased = reference.secondMoment[ii] / (1 - std::pow(beta2, step));
+    return firstUnbiased / (std::sqrt(secondUnbiased) + epsilon);
+}
+
+int main()
+{
+    const double tolerance = 1e-12;
+    auto check = [&](double error, const std::string &message)
+    {
+        test::checkError(error, tolerance, message);
+    };
+
+    const double learningRate = 0.1, momentum = 0.9, weightDecay = 0.05, beta1 = 0.9, beta2 = 0.999;
+
+    // Nesterov steps along the gradient plus the momentum times the updated velocity
+    nn::StochasticGradientDescent<double> nesterov(learningRate, momentum, true);
+    check(checkUpdates(nesterov, [&](Reference &reference, const std::vector<double> &grad, int, double rate)
+                       {
+                           for (size_t ii = 0; ii < grad.size(); ++ii)
+                           {
+                               reference.velocity[ii] = momentum * reference.velocity[ii] + grad[ii];
+                               reference.weights[ii] -= rate * (grad[ii] + momentum * reference.velocity[ii]);
+                           }
+                       }),
+          "SGD with Nesterov momentum");
+
+    // AdamW shrinks the weights by the decay first, then takes the Adam step
+    const double adamEpsilon = 1e-8;
+    nn::AdamW<double> adamW(learningRate, weightDecay, beta1, beta2, adamEpsilon);
+    check(checkUpdates(adamW, [&](Reference &reference, const std::vector<double> &grad, int step, double rate)
+                       {
+                           for (size_t ii = 0; ii < grad.size(); ++ii)
+                           {
+                               reference.weights[ii] -= rate * weightDecay * reference.weights[ii];
+                               reference.weights[ii] -= rate * adamDirection(reference, ii, grad[ii], step, beta1, beta2, adamEpsilon);
+                           }
+                       }),
+          "AdamW");
+
+    // LAMB scales the decayed Adam direction by the ratio of the weight norm to the direction norm
+    const double lambEpsilon = 1e-6;
+    nn::Lamb<double> lamb(learningRate, weightDecay, beta1, beta2, lambEpsilon);
+    check(checkUpdates(lamb, [&](Reference &reference, const std::vector<double> &grad, int step, double rate)
+                       {
+                           std::vector<double> direction(grad.size());
+                           double weightNorm = 0, directionNorm = 0;
+                           for (size_t ii = 0; ii < grad.size(); ++ii)
+                           {
+                               direction[ii] = adamDirection(reference, ii, grad[ii], step, beta1, beta2, lambEpsilon) +
+                                               weightDecay * reference.weights[ii];
+                               weightNorm += reference.weights[ii] * reference.weights[ii];
+                               directionNorm += direction[ii] * direction[ii];
+                           }
+                           const double trustRatio = std::sqrt(weightNorm) / std::sqrt(directionNorm);
+                           for (size_t ii = 0; ii < grad.size(); ++ii)
+                           {
+                               reference.weights[ii] -= rate * trustRatio * direction[ii];
+                           }
+                       }),
+          "LAMB");
+
+    // Tensors excluded from weight decay, such as biases, take plain Adam steps under AdamW and LAMB
+    auto adamStep = [&](double epsilon)
+    {
+        return [&, epsilon](Reference &reference, const std::vector<double> &grad, int step, double rate)
+        {
+            for (size_t ii = 0; ii < grad.size(); ++ii)
+            {
+                reference.weights[ii] -= rate * adamDirection(reference, ii, grad[ii], step, beta1, beta2, epsilon);
+            }
+        };
+    };
+    nn::AdamW<double> undecayedAdamW(learningRate, weightDecay, beta1, beta2, adamEpsilon);
+    check(checkUpdates(undecayedAdamW, adamStep(adamEpsilon), /*decayWeights*/ false), "AdamW without weight decay");
+    nn::Lamb<double> undecayedLamb(learningRate, weightDecay, beta1, beta2, lambEpsilon);
+    check(checkUpdates(undecayedLamb, adamStep(lambEpsilon), /*decayWeights*/ false),
+          "LAMB without weight decay or trust ratio");
+
+    // Every schedule at the steps where it changes
+    nn::StepDecay<double> stepDecay(3, 0.5);
+    check(std::abs(stepDecay.learningRate(2, 2) - 2) + std::abs(stepDecay.learningRate(2, 3) - 1) +
+              std::abs(stepDecay.learningRate(2, 7) - 0.5),
+          "StepDecay");
+    nn::CosineDecay<double> cosineDecay(4, 0.1);
+    check(std::abs(cosineDecay.learningRate(1, 0) - 1) + std::abs(cosineDecay.learningRate(1, 2) - 0.55) +
+              std::abs(cosineDecay.learningRate(1, 4) - 0.1) + std::abs(cosineDecay.learningRate(1, 9) - 0.1),
+          "CosineDecay");
+    nn::Warmup<double> warmup(4, new nn::StepDecay<double>(2, 0.5));
+    check(std::abs(warmup.learningRate(1, 0) - 0.25) + std::abs(warmup.learningRate(1, 3) - 1) +
+              std::abs(warmup.learningRate(1, 5) - 1) + std::abs(warmup.learningRate(1, 6) - 0.5),
+          "Warmup followed by StepDecay");
+
+    // The optimizers read the scheduled rate of the current step, and follow a jump to another step
+    nn::StochasticGradientDescent<double> scheduled(learningRate, momentum, true);
+    scheduled.setSchedule(new nn::Warmup<double>(2, new nn::CosineDecay<double>(3)));
+    check(checkUpdates(scheduled, [&](Reference &reference, const std::vector<double> &grad, int step, double rate)
+                       {
+                           const double expectedRate = step <= 2 ? learningRate * step / 2
+                                                                 : learningRate * (1 + std::cos(std::acos(-1.0) * std::min(step - 3, 3) / 3)) / 2;
+                           for (size_t ii = 0; ii < grad.size(); ++ii)
+                           {
+                               reference.velocity[ii] = momentum * reference.velocity[ii] + grad[ii];
+                               reference.weights[ii] -= expectedRate * (grad[ii] + momentum * reference.velocity[ii]);
+                           }
+                           check(std::abs(rate - expectedRate), "scheduled learning rate at step " + std::to_string(step));
+                       }),
+          "SGD with Nesterov momentum on a schedule");
+    scheduled.setStep(1);
+    check(std::abs(scheduled.getLearningRate() - learningRate), "jumping to a step of the schedule");
+
+    return test::report("Optimizer");
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "../src/Net.h"
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+/**
+ * The check and report harness shared by the tests, and the small networks and inputs several of them build
+ */
+namespace test
+{
+    inline int &failureCount()
+    {
+        static int failures = 0;
+        return failures;
+    }
+
+    inline void check(bool condition, const std::string &message)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED: " << message << std::endl;
+            failureCount()++;
+        }
+    }
+
+    /**
+     * Check that an error, e.g. against a reference implementation, is within the tolerance. A NaN error fails.
+     */
+    inline void checkError(double error, double tolerance, const std::string &message)
+    {
+        if (!(error <= tolerance))
+        {
+            std::cerr << "FAILED: " << message << ", error " << error << std::endl;
+            failureCount()++;
+        }
+    }
+
+    /**
+     * Print that the tests passed if no check failed
+     * @return The exit code of the test
+     */
+    inline int report(const std::string &suite)
+    {
+        if (failureCount() == 0)
+        {
+            std::cout << suite << " tests passed" << std::endl;
+        }
+        return failureCount() == 0 ? 0 : 1;
+    }
+
+    /**
+     * A tensor of uniform random values in [-1, 1]
+     */
+    template <typename Dtype, int Dims>
+    Eigen::Tensor<Dtype, Dims> randomTensor(const Eigen::array<Eigen::Index, Dims> &shape)
+    {
+        Eigen::Tensor<Dtype, Dims> tensor(shape);
+        tensor.setRandom();
+        return tensor * tensor.constant(2) - tensor.constant(1);
+    }
+
+    /**
+     * One-hot labels that cycle through the classes
+     */
+    inline Eigen::Tensor<float, 2> oneHotLabels(int batchSize, int numClasses)
+    {
+        Eigen::Tensor<float, 2> labels(batchSize, numClasses);
+        labels.setZero();
+        for (int ii = 0; ii < batchSize; ++ii)
+        {
+            labels(ii, ii % numClasses) = 1;
+        }
+        return labels;
+    }
+
+    /**
+     * Dense, Relu, Dense and Softmax, training with the given optimizer. Takes ownership of the optimizer.
+     */
+    inline std::unique_ptr<nn::Net<float>> makeDenseNet(int batchSize, int numFeatures, int numHidden, int numClasses,
+                                                        nn::Optimizer<float> *optimizer, bool outputBias = true)
+    {
+        std::unique_ptr<nn::Net<float>> net(new nn::Net<float>());
+        net->add(new nn::Dense<>(batchSize, numFeatures, numHidden, true));
+        net->add(new nn::Relu<>());
+        net->add(new nn::Dense<>(batchSize, numHidden, numClasses, outputBias));
+        net->add(new nn::Softmax<>());
+        net->registerOptimizer(optimizer);
+        return net;
+    }
+
+    /**
+     * Conv2D, MaxPool2D, Conv2D, AvgPool2D, Flatten, Dense and Softmax for (batchSize, 8, 8, channels) inputs,
+     * training with Adam
+     */
+    inline std::unique_ptr<nn::Net<float>> makeConvNet(int batchSize, int channels, int numFilters, int numClasses)
+    {
+        std::unique_ptr<nn::Net<float>> net(new nn::Net<float>());
+        net->add(new nn::Conv2D<>(channels, numFilters, 3, 3, /*stride*/ 1, /*padding*/ 1));
+        net->add(new nn::MaxPool2D<>(2, 2));
+        net->add(new nn::Conv2D<>(numFilters, numFilters, 3, 3));
+        net->add(new nn::AvgPool2D<>(2, 2));
+        net->add(new nn::Flatten<>());
+        net->add(new nn::Dense<>(batchSize, numFilters, numClasses, true));
+        net->add(new nn::Softmax<>());
+        net->registerOptimizer(new nn::Adam<float>(0.01));
+        return net;
+    }
+}